@@ -129,5 +129,51 @@ ALL_RATIOS_X(MAKE250ADD)
 
 MAKE250(mulxymm250, 10, "imull  $0, %eax, %eax\n\t")
 
+/* zero the registers the licence payloads use, so the FP ops never see denormals */
+#define ZERO_LICENCE_REGS                         \
+        "vpxor %xmm0, %xmm0, %xmm0\n\t"           \
+        "vpxor %xmm1, %xmm1, %xmm1\n\t"           \
+        "vpxor %xmm2, %xmm2, %xmm2\n\t"           \
+        "vpxor %xmm3, %xmm3, %xmm3\n\t"           \
+        "vpxor %xmm4, %xmm4, %xmm4\n\t"           \
+        "vpxor %xmm5, %xmm5, %xmm5\n\t"           \
+        "vpxor %xmm6, %xmm6, %xmm6\n\t"           \
+        "vpxor %xmm7, %xmm7, %xmm7\n\t"           \
+        "vpxor %xmm8, %xmm8, %xmm8\n\t"           \
+        "vpxor %xmm9, %xmm9, %xmm9\n\t"           \
+
+/**
+ * 1000 copies of instr on w registers: _lat is a single dependency chain, while _tput
+ * spreads them over 8 independent accumulators, enough to cover the latency of any of
+ * the instructions in the matrix (FMA: 4 cycles on 2 ports).
+ */
+#define MAKE_LICENCE(cls, w, instr)                          \
+void lic_##cls##_##w##_lat(bench_args args) {               \
+    asm volatile (                                           \
+        ZERO_LICENCE_REGS                                    \
+        ".rept 1000\n\t"                                     \
+        #instr " %" #w "0, %" #w "0, %" #w "0\n\t"            \
+        ".endr\n\t"                                          \
+        "vzeroupper\n\t"                                     \
+    );                                                       \
+}                                                            \
+void lic_##cls##_##w##_tput(bench_args args) {              \
+    asm volatile (                                           \
+        ZERO_LICENCE_REGS                                    \
+        ".rept 125\n\t"                                      \
+        #instr " %" #w "8, %" #w "9, %" #w "0\n\t"            \
+        #instr " %" #w "8, %" #w "9, %" #w "1\n\t"            \
+        #instr " %" #w "8, %" #w "9, %" #w "2\n\t"            \
+        #instr " %" #w "8, %" #w "9, %" #w "3\n\t"            \
+        #instr " %" #w "8, %" #w "9, %" #w "4\n\t"            \
+        #instr " %" #w "8, %" #w "9, %" #w "5\n\t"            \
+        #instr " %" #w "8, %" #w "9, %" #w "6\n\t"            \
+        #instr " %" #w "8, %" #w "9, %" #w "7\n\t"            \
+        ".endr\n\t"                                          \
+        "vzeroupper\n\t"                                     \
+    );                                                       \
+}
+
+LICENCE_MATRIX_X(MAKE_LICENCE)
 
 void dummy(bench_args args) {}
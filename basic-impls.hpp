@@ -38,4 +38,29 @@ ALL_RATIOS_X(DEFINE250)
 
 bench_fn mulxymm250_10;
 
+/**
+ * The licence characterization matrix: f(class, width, instr) for each instruction class
+ * and vector width, with instr the 3-operand instruction used for that cell. Each cell
+ * has a latency-bound lic_<class>_<width>_lat test and a throughput-bound _tput test.
+ */
+#define LICENCE_MATRIX_X(f) \
+    f(int,  xmm, vpor)        \
+    f(int,  ymm, vpor)        \
+    f(int,  zmm, vpord)       \
+    f(fadd, xmm, vaddps)      \
+    f(fadd, ymm, vaddps)      \
+    f(fadd, zmm, vaddps)      \
+    f(fma,  xmm, vfmadd231ps) \
+    f(fma,  ymm, vfmadd231ps) \
+    f(fma,  zmm, vfmadd231ps) \
+    f(shuf, xmm, vpermilps)   \
+    f(shuf, ymm, vpermilps)   \
+    f(shuf, zmm, vpermilps)   \
+
+#define DECLARE_LICENCE(cls, w, instr) \
+    bench_fn lic_##cls##_##w##_lat;    \
+    bench_fn lic_##cls##_##w##_tput;
+
+LICENCE_MATRIX_X(DECLARE_LICENCE)
+
 #endif
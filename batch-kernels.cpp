@@ -0,0 +1,77 @@
+/*
+ * batch-kernels.cpp
+ *
+ * AVX2 implementations of the batch kernels, each with a scalar tail.
+ */
+
+#include "batch-kernels.hpp"
+
+#include <immintrin.h>
+
+/*
+ * Convert 4 uint64_t values all below 2^52 to double, exactly: placing the value in
+ * the mantissa of 2^52 and subtracting 2^52 (AVX2 has no 64-bit integer conversion).
+ */
+static inline __m256d u52_to_double(__m256i v) {
+    const __m256i magic_bits = _mm256_set1_epi64x(0x4330000000000000);
+    const __m256d magic      = _mm256_castsi256_pd(magic_bits);
+    return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(v, magic_bits)), magic);
+}
+
+static inline double delta_one(const uint64_t* in, size_t i, uint64_t sub) {
+    uint64_t d = in[i + 1] - in[i];
+    return (double)(d > sub ? d - sub : 0);
+}
+
+void batch_delta(const uint64_t* in, size_t n, uint64_t sub, double* out) {
+    if (n < 2) {
+        return;
+    }
+    const size_t count = n - 1;
+    // unsigned 64-bit compares are done as signed compares with the sign bit flipped
+    const __m256i sign  = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i vsub  = _mm256_set1_epi64x(sub);
+    const __m256i ssub  = _mm256_xor_si256(vsub, sign);
+    const __m256i big   = _mm256_set1_epi64x(~((1ull << 52) - 1));
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(in + i + 1));
+        __m256i d  = _mm256_sub_epi64(hi, lo);
+        __m256i keep = _mm256_cmpgt_epi64(_mm256_xor_si256(d, sign), ssub);
+        d = _mm256_and_si256(_mm256_sub_epi64(d, vsub), keep);
+        if (!_mm256_testz_si256(d, big)) {
+            // a delta of 2^52 or more: rare enough (wrapped or failed counters) to do the slow way
+            for (size_t j = i; j < i + 4; j++) {
+                out[j] = delta_one(in, j, sub);
+            }
+            continue;
+        }
+        _mm256_storeu_pd(out + i, u52_to_double(d));
+    }
+    for (; i < count; i++) {
+        out[i] = delta_one(in, i, sub);
+    }
+}
+
+void batch_divide(const double* a, const double* b, size_t n, double* out) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_div_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] / b[i];
+    }
+}
+
+void batch_mul_div(const double* in, size_t n, double mul, double div, double* out) {
+    const __m256d vmul = _mm256_set1_pd(mul), vdiv = _mm256_set1_pd(div);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_div_pd(_mm256_mul_pd(_mm256_loadu_pd(in + i), vmul), vdiv));
+    }
+    for (; i < n; i++) {
+        out[i] = in[i] * mul / div;
+    }
+}
@@ -0,0 +1,31 @@
+/*
+ * batch-kernels.hpp
+ *
+ * Whole-array kernels used to evaluate columns over many samples at once. Each kernel
+ * gives bit-for-bit the same results as the obvious scalar loop, since the results
+ * must match the per-sample evaluation they replace.
+ */
+
+#ifndef BATCH_KERNELS_H_
+#define BATCH_KERNELS_H_
+
+#include <cinttypes>
+#include <cstddef>
+
+/**
+ * The deltas between consecutive elements of in (n elements, so n - 1 deltas), less
+ * sub (saturating at zero), converted to double:
+ *
+ *     out[i] = (double)(in[i + 1] - in[i] > sub ? in[i + 1] - in[i] - sub : 0)
+ *
+ * The deltas wrap as uint64_t arithmetic does. With sub == 0 this is just the deltas.
+ */
+void batch_delta(const uint64_t* in, size_t n, uint64_t sub, double* out);
+
+/** out[i] = a[i] / b[i] for i < n */
+void batch_divide(const double* a, const double* b, size_t n, double* out);
+
+/** out[i] = in[i] * mul / div for i < n, in that order */
+void batch_mul_div(const double* in, size_t n, double mul, double div, double* out);
+
+#endif // #ifndef BATCH_KERNELS_H_
@@ -0,0 +1,72 @@
+/*
+ * bench-convert.cpp
+ *
+ * Converts binary traces written by bench (with TRACE_DIR set) into the same CSV
+ * layout bench prints to stdout, so the existing scripts can consume them.
+ *
+ *     bench-convert results/vporzmm_vz100.trace > vporzmm_vz100.csv
+ */
+
+#include "csv-emitter.hpp"
+#include "trace-file.hpp"
+
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void convert(const char* path, bool info) {
+    TraceReader reader(path);
+    auto& h = reader.get_header();
+
+    if (info) {
+        fprintf(stderr, "trace        : %s\n", path);
+        fprintf(stderr, "cpu          : %s (family %u, model %u, stepping %u)\n",
+                h.brand, h.family, h.model, h.stepping);
+        fprintf(stderr, "tsc freq     : %10.1f MHz\n", h.tsc_freq / 1000000.);
+        fprintf(stderr, "rows         : %10zu\n", reader.row_count());
+        fprintf(stderr, "columns      : %10zu\n", reader.column_count());
+    }
+
+    // a new header line is printed every time the repeat changes, as bench does
+    ssize_t repeat_col = reader.find_column("repeat");
+    const uint64_t* repeats = repeat_col >= 0 ? reader.u64_column(repeat_col) : nullptr;
+
+    CsvEmitter out(stdout);
+    for (size_t row = 0; row < reader.row_count(); row++) {
+        if (row == 0 || (repeats && repeats[row] != repeats[row - 1])) {
+            for (size_t col = 0; col < reader.column_count(); col++) {
+                if (col) {
+                    out.put(',');
+                }
+                out.put(reader.column_name(col).c_str());
+            }
+            out.put('\n');
+        }
+        for (size_t col = 0; col < reader.column_count(); col++) {
+            if (col) {
+                out.put(',');
+            }
+            reader.print_cell(out, col, row);
+        }
+        out.put('\n');
+    }
+}
+
+int main(int argc, char** argv) {
+    bool info = getenv("INFO") && strcmp(getenv("INFO"), "0");
+    if (argc < 2) {
+        fprintf(stderr, "Usage:\n\tbench-convert TRACE_FILE [TRACE_FILE...]\n\n"
+                "Prints the given traces to stdout in CSV format. Set INFO=1 to print the trace header to stderr.\n");
+        return EXIT_FAILURE;
+    }
+    try {
+        for (int i = 1; i < argc; i++) {
+            convert(argv[i], info);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "bench-convert: %s\n", e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,193 @@
+/*
+ * campaign.cpp
+ */
+
+#include "campaign.hpp"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+static std::runtime_error campaign_error(size_t line, const std::string& problem) {
+    return std::runtime_error("bad campaign manifest line " + std::to_string(line) + ": " + problem);
+}
+
+/* parse a cycle count like 5000, or a duration like 100us, into TSC cycles */
+static int64_t parse_cycles(size_t line, const std::string& var, const std::string& value, double tsc_freq) {
+    size_t pos = 0;
+    double v = -1;
+    try {
+        v = std::stod(value, &pos);
+    } catch (std::exception&) {
+    }
+    std::string unit = value.substr(std::min(pos, value.size()));
+    double mult = unit == "" || unit == "cyc" ? 1 : unit == "ns" ? tsc_freq / 1e9 : unit == "us" ? tsc_freq / 1e6
+            : unit == "ms" ? tsc_freq / 1e3 : -1;
+    if (!(v >= 0) || mult < 0) {
+        throw campaign_error(line, "bad " + var + " " + value + ", expected TSC cycles or a duration in ns, us, ms or cyc");
+    }
+    return v * mult;
+}
+
+std::vector<CampaignCell> parse_campaign(const std::string& text, double tsc_freq) {
+    std::vector<CampaignCell> ret;
+    std::set<std::string> names;
+    std::istringstream lines(text);
+    std::string line;
+    for (size_t lineno = 1; std::getline(lines, line); lineno++) {
+        std::istringstream ts(line.substr(0, line.find('#')));
+        std::vector<std::string> tokens;
+        std::string token;
+        while (ts >> token) {
+            tokens.push_back(token);
+        }
+        if (tokens.empty()) {
+            continue;
+        }
+        if (tokens.size() < 2) {
+            throw campaign_error(lineno, "expected: NAME TESTS [VAR=VALUE...]");
+        }
+
+        CampaignCell cell;
+        cell.name  = tokens[0];
+        cell.tests = tokens[1];
+        if (cell.name.find('/') != std::string::npos || cell.name[0] == '.') {
+            throw campaign_error(lineno, "cell name " + cell.name + " can't contain / or start with .");
+        }
+        if (!names.insert(cell.name).second) {
+            throw campaign_error(lineno, "duplicate cell name " + cell.name);
+        }
+
+        for (size_t i = 2; i < tokens.size(); i++) {
+            size_t eq = tokens[i].find('=');
+            if (eq == std::string::npos) {
+                throw campaign_error(lineno, "expected VAR=VALUE, not " + tokens[i]);
+            }
+            std::string var = tokens[i].substr(0, eq), value = tokens[i].substr(eq + 1);
+            if (var == "TEST_CYC") {
+                cell.test_cycles = parse_cycles(lineno, var, value, tsc_freq);
+            } else if (var == "TEST_PER") {
+                cell.period_cycles = parse_cycles(lineno, var, value, tsc_freq);
+            } else if (var == "TEST_RES") {
+                cell.resolution_cycles = parse_cycles(lineno, var, value, tsc_freq);
+            } else if (var == "TEST_EXTRA") {
+                cell.payload_extra_cycles = parse_cycles(lineno, var, value, tsc_freq);
+            } else if (var == "COLS") {
+                cell.cols = value;
+            } else {
+                throw campaign_error(lineno, "unknown setting " + var + " (expected TEST_CYC, TEST_PER, TEST_RES, TEST_EXTRA or COLS)");
+            }
+        }
+        ret.push_back(cell);
+    }
+    if (ret.empty()) {
+        throw std::runtime_error("campaign manifest has no cells");
+    }
+    return ret;
+}
+
+std::vector<CampaignCell> load_campaign(const std::string& path, double tsc_freq) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("can't open campaign manifest " + path);
+    }
+    std::stringstream contents;
+    contents << in.rdbuf();
+    return parse_campaign(contents.str(), tsc_freq);
+}
+
+/* run cells in order, writing each to its file in dir */
+static void run_cells(const std::vector<CampaignCell>& cells, const std::string& dir, const CellRunner& run_cell) {
+    for (auto& cell : cells) {
+        std::string path = dir + "/" + cell.name + ".csv", part = path + ".part";
+        FILE* out = fopen(part.c_str(), "w");
+        if (!out) {
+            throw std::runtime_error("can't create " + part + ": " + strerror(errno));
+        }
+        run_cell(cell, out);
+        bool write_error = ferror(out);
+        write_error |= fclose(out) != 0;
+        if (write_error || rename(part.c_str(), path.c_str())) {
+            throw std::runtime_error("writing the results of campaign cell " + cell.name + " to " + path + " failed");
+        }
+    }
+}
+
+static void pin_worker(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        throw std::runtime_error("can't pin to cpu " + std::to_string(cpu) + ": " + strerror(errno));
+    }
+}
+
+int run_campaign(const std::string& path, const std::string& dir, const std::vector<int>& cpus,
+                 double tsc_freq, bool verbose, const CellRunner& run_cell) {
+    auto cells = load_campaign(path, tsc_freq);
+    if (mkdir(dir.c_str(), 0777) && errno != EEXIST) {
+        throw std::runtime_error("can't create the campaign directory " + dir + ": " + strerror(errno));
+    }
+
+    std::vector<CampaignCell> todo;
+    for (auto& cell : cells) {
+        struct stat st;
+        if (stat((dir + "/" + cell.name + ".csv").c_str(), &st) == 0) {
+            if (verbose) fprintf(stderr, "Campaign cell %s is already done, skipping it\n", cell.name.c_str());
+        } else {
+            todo.push_back(cell);
+        }
+    }
+    fprintf(stderr, "About to run %zu of the %zu campaign cells in %s, writing to %s\n", todo.size(), cells.size(),
+            path.c_str(), dir.c_str());
+
+    if (cpus.empty()) {
+        run_cells(todo, dir, run_cell);
+        return 0;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    std::vector<pid_t> workers;
+    for (size_t w = 0; w < cpus.size(); w++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw std::runtime_error(std::string("fork failed: ") + strerror(errno));
+        }
+        if (pid == 0) {
+            int status = EXIT_SUCCESS;
+            try {
+                pin_worker(cpus[w]);
+                std::vector<CampaignCell> mine;
+                for (size_t i = w; i < todo.size(); i += cpus.size()) {
+                    mine.push_back(todo[i]);
+                }
+                run_cells(mine, dir, run_cell);
+            } catch (std::exception& e) {
+                fprintf(stderr, "Campaign worker on cpu %d failed: %s\n", cpus[w], e.what());
+                status = EXIT_FAILURE;
+            }
+            fflush(stderr);
+            _exit(status);
+        }
+        workers.push_back(pid);
+    }
+
+    int failed = 0;
+    for (pid_t pid : workers) {
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            failed++;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,67 @@
+/*
+ * campaign.hpp
+ *
+ * Campaign manifests: a list of cells, each a set of tests and the settings to run them
+ * with, which bench runs one after the other in a single process, writing each cell's
+ * results to its own file. One cell per line, with # starting a comment:
+ *
+ *     # name          tests               settings
+ *     zmm-vz100       vporzmm_vz100       TEST_EXTRA=100us COLS=Cycles,Unhalt_GHz,IPC
+ *     zmm-vz100-8us   vporzmm_vz100       TEST_EXTRA=100us TEST_RES=8us
+ *     tput            *_tput_vz100
+ *
+ * The tests are a selector list, as for the TEST_NAME argument. The settings are TEST_CYC,
+ * TEST_PER, TEST_RES and TEST_EXTRA, in TSC cycles like the environment variables or
+ * with one of the suffixes ns, us, ms or cyc, and COLS. Settings a cell doesn't give
+ * come from the environment.
+ */
+
+#ifndef CAMPAIGN_H_
+#define CAMPAIGN_H_
+
+#include <cinttypes>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct CampaignCell {
+    /* the cell's results go to <name>.csv */
+    std::string name;
+    /* the selector list of the tests to run */
+    std::string tests;
+    /* TEST_CYC, TEST_PER, TEST_RES and TEST_EXTRA in TSC cycles, or -1 if not given */
+    int64_t test_cycles = -1, period_cycles = -1, resolution_cycles = -1, payload_extra_cycles = -1;
+    /* COLS, or empty if not given */
+    std::string cols;
+};
+
+/**
+ * Parse the text of a manifest. Throws std::runtime_error on bad syntax, an unknown
+ * setting, or a duplicate or unsafe cell name. Test selectors are checked when the cell
+ * runs, not here.
+ */
+std::vector<CampaignCell> parse_campaign(const std::string& text, double tsc_freq);
+
+/**
+ * Load and parse the manifest at the given path.
+ */
+std::vector<CampaignCell> load_campaign(const std::string& path, double tsc_freq);
+
+/**
+ * Runs one cell, writing its results to out. Errors are thrown.
+ */
+using CellRunner = std::function<void(const CampaignCell& cell, FILE* out)>;
+
+/**
+ * Run the cells of the manifest at path which don't have a result file in dir yet,
+ * with run_cell, in this process, or if cpus isn't empty, in one worker process pinned
+ * to each of those cpus, which take the cells round-robin. The results of each cell
+ * go to a <dir>/<name>.csv.part file first, which is renamed to <name>.csv once the
+ * cell is complete, so a cell's .csv only exists if it finished. Returns the number
+ * of workers that failed.
+ */
+int run_campaign(const std::string& path, const std::string& dir, const std::vector<int>& cpus,
+                 double tsc_freq, bool verbose, const CellRunner& run_cell);
+
+#endif // #ifndef CAMPAIGN_H_
@@ -8,16 +8,23 @@
 
 #include "hedley.h"
 #include "inttypes.h"
+// with an unsigned index type, span's contract checks compare count >= 0
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wtype-limits"
 #include "nonstd/span.hpp"
+#pragma GCC diagnostic pop
 
 #include <stdlib.h>
 
 using char_span = nonstd::span<char>;
 
 /**
- * Bundles all the arguments.
+ * Bundles all the arguments: a source and a destination buffer, each the size of the
+ * current working set. Payloads that don't touch memory ignore them.
  */
-struct bench_args {};
+struct bench_args {
+    char_span src, dst;
+};
 
 using bench_fn = void (bench_args args);
 
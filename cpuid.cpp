@@ -121,3 +121,26 @@ int get_smt_shift()
     return smtShift;
 }
 
+bool cpu_has_avx512f() {
+    return cpuid_highest_leaf() >= 7 && get_bits(cpuid(7).ebx, 16, 16);
+}
+
+bool cpu_has_avx512bw() {
+    return cpuid_highest_leaf() >= 7 && get_bits(cpuid(7).ebx, 30, 30);
+}
+
+bool cpu_has_avx512dq() {
+    return cpuid_highest_leaf() >= 7 && get_bits(cpuid(7).ebx, 17, 17);
+}
+
+bool cpu_has_avx512vl() {
+    return cpuid_highest_leaf() >= 7 && get_bits(cpuid(7).ebx, 31, 31);
+}
+
+bool cpu_has_waitpkg() {
+    return cpuid_highest_leaf() >= 7 && get_bits(cpuid(7).ecx, 5, 5);
+}
+
+uint32_t get_x2apic_id() {
+    return cpuid(0xb).edx;
+}
@@ -42,6 +42,24 @@ std::string get_brand_string();
 
 int get_smt_shift();
 
+/** true if AVX-512F is supported (this doesn't check that the OS has enabled it) */
+bool cpu_has_avx512f();
+
+/** true if AVX-512BW is supported (again, not checking the OS) */
+bool cpu_has_avx512bw();
+
+/** true if AVX-512DQ is supported (again, not checking the OS) */
+bool cpu_has_avx512dq();
+
+/** true if AVX-512VL is supported (again, not checking the OS) */
+bool cpu_has_avx512vl();
+
+/** true if the WAITPKG instructions (umonitor, umwait, tpause) are supported */
+bool cpu_has_waitpkg();
+
+/** the x2APIC id of the cpu this is executing on, from cpuid leaf 0xb */
+uint32_t get_x2apic_id();
+
 /* get bits [start:end] inclusive of the given value */
 uint32_t get_bits(uint32_t value, int start, int end);
 
@@ -0,0 +1,113 @@
+/*
+ * csv-emitter.hpp
+ *
+ * A buffered text emitter for the CSV output, built on std::to_chars so that formatting
+ * a value never allocates and never goes through printf's format string parsing.
+ *
+ * The output is byte-for-byte identical to the printf formats it replaces: put_uint()
+ * matches "%zu", put_int() matches "%zd" and put_fixed3() matches "%.3f" (std::to_chars
+ * with an explicit precision is specified to behave as printf in the C locale).
+ */
+
+#ifndef CSV_EMITTER_H_
+#define CSV_EMITTER_H_
+
+#include <cassert>
+#include <charconv>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "hedley.h"
+
+class CsvEmitter {
+    /* enough for any single value: %.3f of DBL_MAX is 313 characters */
+    static constexpr size_t MAX_VALUE_CHARS = 320;
+
+    FILE* out;
+    std::vector<char> buf;
+    char *pos, *limit;
+
+    /* make sure there is room for at least n more characters */
+    void ensure(size_t n) {
+        if (HEDLEY_UNLIKELY((size_t)(limit - pos) < n)) {
+            flush();
+        }
+    }
+
+public:
+    /** the default buffer size is large enough to usually hold an entire repeat */
+    explicit CsvEmitter(FILE* out, size_t capacity = 4 * 1024 * 1024)
+        : out{out}, buf(capacity < 2 * MAX_VALUE_CHARS ? 2 * MAX_VALUE_CHARS : capacity),
+          pos{buf.data()}, limit{buf.data() + buf.size()} {}
+
+    ~CsvEmitter() { flush(); }
+
+    CsvEmitter(const CsvEmitter&) = delete;
+    CsvEmitter& operator=(const CsvEmitter&) = delete;
+
+    /** the number of characters buffered but not yet written */
+    size_t pending() const { return pos - buf.data(); }
+
+    /** write out everything buffered so far */
+    void flush() {
+        if (pos != buf.data()) {
+            fwrite(buf.data(), 1, pos - buf.data(), out);
+            pos = buf.data();
+        }
+        fflush(out);
+    }
+
+    void put(char c) {
+        ensure(1);
+        *pos++ = c;
+    }
+
+    void put(const char* s) {
+        size_t len = strlen(s);
+        if (len > buf.size()) {
+            flush();
+            fwrite(s, 1, len, out);
+            return;
+        }
+        ensure(len);
+        memcpy(pos, s, len);
+        pos += len;
+    }
+
+    void put_uint(uint64_t v) {
+        ensure(MAX_VALUE_CHARS);
+        pos = std::to_chars(pos, limit, v).ptr;
+    }
+
+    void put_int(int64_t v) {
+        ensure(MAX_VALUE_CHARS);
+        pos = std::to_chars(pos, limit, v).ptr;
+    }
+
+    /** equivalent to printf("%.3f", v) */
+    void put_fixed3(double v) {
+        ensure(MAX_VALUE_CHARS);
+        auto res = std::to_chars(pos, limit, v, std::chars_format::fixed, 3);
+        assert(res.ec == std::errc{});
+        pos = res.ptr;
+    }
+
+    /**
+     * Output a column value: as an integer if the value is integral,
+     * otherwise with 3 decimal places.
+     */
+    void put_value(double v) {
+        ssize_t iv = v;
+        if ((double)iv == v) {
+            put_int(iv);
+        } else {
+            put_fixed3(v);
+        }
+    }
+};
+
+#endif // #ifndef CSV_EMITTER_H_
@@ -0,0 +1,122 @@
+/*
+ * emit-bench.cpp
+ *
+ * Compares the printf-based row output bench used to use against CsvEmitter on a
+ * synthetic trace shaped like real bench output, checking that both produce
+ * identical bytes and reporting the time each takes.
+ *
+ *     ./emit-bench               # 2 million rows
+ *     ROWS=10000000 ./emit-bench
+ */
+
+#include "csv-emitter.hpp"
+
+#include <random>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+struct Row {
+    size_t repeat;
+    double us;
+    uint64_t period, sdl, payspin, totspin, paytime;
+    double vals[4];
+};
+
+/** the output loop as it was before CsvEmitter */
+static void printf_rows(FILE* f, const std::vector<Row>& rows) {
+    for (auto& row : rows) {
+        fprintf(f, "%zu,%.3f,%zu,%zu,%zu,%zu,%zu", row.repeat, row.us, (size_t)row.period, (size_t)row.sdl,
+                (size_t)row.payspin, (size_t)row.totspin, (size_t)row.paytime);
+        for (double val : row.vals) {
+            ssize_t ival = val;
+            if ((double)ival == val) {
+                fprintf(f, ",%zd", ival);
+            } else {
+                fprintf(f, ",%.3f", val);
+            }
+        }
+        fprintf(f, "\n");
+    }
+}
+
+static void emitter_rows(FILE* f, const std::vector<Row>& rows) {
+    CsvEmitter out(f);
+    for (auto& row : rows) {
+        out.put_uint(row.repeat);
+        out.put(',');
+        out.put_fixed3(row.us);
+        for (uint64_t v : {row.period, row.sdl, row.payspin, row.totspin, row.paytime}) {
+            out.put(',');
+            out.put_uint(v);
+        }
+        for (double val : row.vals) {
+            out.put(',');
+            out.put_value(val);
+        }
+        out.put('\n');
+    }
+}
+
+static std::vector<Row> make_rows(size_t count) {
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> ghz(0.8, 3.8), ipc(0.1, 4.0);
+    std::vector<Row> rows(count);
+    for (size_t i = 0; i < count; i++) {
+        double ns = 476. + (rng() % 1000) / 100.;
+        rows[i] = {i * 3 / count, 1000. * i / 2100. + 0.0005, i / 5000, i * 2100, rng() % 3, 30 + rng() % 20, 2000 + rng() % 300,
+                   {(double)(1000 + rng() % 1000), ns * ghz(rng), ghz(rng), ipc(rng)}};
+    }
+    return rows;
+}
+
+template <typename F>
+static double time_ms(F f) {
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    f();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1000. + (end.tv_nsec - start.tv_nsec) / 1000000.;
+}
+
+template <typename F>
+static std::string capture(F f) {
+    char* buf  = nullptr;
+    size_t len = 0;
+    FILE* mem  = open_memstream(&buf, &len);
+    f(mem);
+    fclose(mem);
+    std::string ret(buf, len);
+    free(buf);
+    return ret;
+}
+
+int main() {
+    const char* rows_env = getenv("ROWS");
+    size_t count = rows_env ? atoll(rows_env) : 2000000;
+    auto rows    = make_rows(count);
+
+    // correctness: both must produce the same bytes
+    if (capture([&](FILE* f) { printf_rows(f, rows); }) != capture([&](FILE* f) { emitter_rows(f, rows); })) {
+        fprintf(stderr, "MISMATCH: CsvEmitter output differs from printf output\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE* devnull = fopen("/dev/null", "w");
+    if (!devnull) {
+        perror("fopen /dev/null");
+        return EXIT_FAILURE;
+    }
+    double printf_ms  = time_ms([&] { printf_rows(devnull, rows); fflush(devnull); });
+    double emitter_ms = time_ms([&] { emitter_rows(devnull, rows); });
+    fclose(devnull);
+
+    printf("rows     : %10zu (output identical)\n", count);
+    printf("printf   : %10.1f ms (%6.1f ns/row)\n", printf_ms, printf_ms * 1e6 / count);
+    printf("emitter  : %10.1f ms (%6.1f ns/row)\n", emitter_ms, emitter_ms * 1e6 / count);
+    printf("speedup  : %10.2fx\n", printf_ms / emitter_ms);
+    return EXIT_SUCCESS;
+}
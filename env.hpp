@@ -22,6 +22,12 @@ T parse_from_string(const std::string& str) {
    ss >> result;
    return result;
 }
+
+/* strings are taken whole, not just up to the first whitespace */
+template <>
+inline std::string parse_from_string<std::string>(const std::string& str) {
+   return str;
+}
 }
 
 struct envvar_not_found : public std::runtime_error {
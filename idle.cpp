@@ -0,0 +1,104 @@
+/*
+ * idle.cpp
+ */
+
+#include "idle.hpp"
+#include "cpuid.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/prctl.h>
+#include <time.h>
+
+static void sleep_ns(uint64_t ns) {
+    timespec ts{(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+    nanosleep(&ts, nullptr);
+}
+
+uint64_t idle_sleep(const IdleMode& mode, uint64_t deadline) {
+    uint64_t now = rdtsc();
+    if (now + mode.sleep_cycles + mode.sleep_margin < deadline) {
+        sleep_ns(mode.sleep_ns);
+    } else {
+        // too close to the deadline to risk a sleep
+        _mm_pause();
+    }
+    return rdtsc();
+}
+
+/* umwait wakes on a write to the monitored line, which nothing ever writes */
+alignas(64) static char umwait_line[64];
+
+__attribute__((target("waitpkg")))
+uint64_t idle_umwait(const IdleMode& mode, uint64_t deadline) {
+    _umonitor(umwait_line);
+    // the wait can also end early, e.g., on an interrupt or at the OS-imposed limit
+    _umwait(mode.umwait_ctrl, deadline);
+    return rdtsc();
+}
+
+/*
+ * How much longer than requested a sleep takes, at the 90th percentile of a few tries:
+ * sleeps are only started when at least this much slack remains before the deadline.
+ */
+static uint64_t calibrate_sleep_margin(const IdleMode& mode) {
+    std::vector<uint64_t> over;
+    for (int i = 0; i < 20; i++) {
+        uint64_t start = rdtsc();
+        sleep_ns(mode.sleep_ns);
+        uint64_t took = rdtsc() - start;
+        over.push_back(took > mode.sleep_cycles ? took - mode.sleep_cycles : 0);
+    }
+    std::sort(over.begin(), over.end());
+    return over[over.size() * 9 / 10];
+}
+
+IdleMode parse_idle_mode(const std::string& mode, uint64_t tsc_freq) {
+    IdleMode ret;
+    if (mode == "spin") {
+        ret.kind = IDLE_SPIN;
+    } else if (mode == "pause") {
+        ret.kind = IDLE_PAUSE;
+    } else if (mode.rfind("sleep:", 0) == 0) {
+        double us = -1;
+        try {
+            us = std::stod(mode.substr(6));
+        } catch (std::exception&) {
+        }
+        if (!(us > 0)) {
+            throw std::runtime_error("bad sleep time in IDLE_MODE " + mode);
+        }
+        ret.kind         = IDLE_SLEEP;
+        ret.sleep_ns     = us * 1000;
+        ret.sleep_cycles = us * tsc_freq / 1000000.;
+        // the default timer slack of 50 us would swamp short sleeps
+        prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+        ret.sleep_margin = calibrate_sleep_margin(ret);
+    } else if (mode == "umwait" || mode == "umwait:c02" || mode == "umwait:c01") {
+        if (!cpu_has_waitpkg()) {
+            throw std::runtime_error("IDLE_MODE " + mode + " needs WAITPKG, which this cpu doesn't support");
+        }
+        ret.kind        = IDLE_UMWAIT;
+        ret.umwait_ctrl = mode == "umwait:c01";
+    } else {
+        throw std::runtime_error("unknown IDLE_MODE " + mode + ", expected spin, pause, sleep:N, umwait or umwait:c01");
+    }
+    return ret;
+}
+
+std::string IdleMode::to_string() const {
+    switch (kind) {
+    case IDLE_SPIN:
+        return "spin";
+    case IDLE_PAUSE:
+        return "pause";
+    case IDLE_SLEEP:
+        return string_format("sleep %.1f us (margin %zu cycles)", sleep_ns / 1000., (size_t)sleep_margin);
+    case IDLE_UMWAIT:
+        return umwait_ctrl ? "umwait C0.1" : "umwait C0.2";
+    }
+    return "?";
+}
@@ -0,0 +1,77 @@
+/*
+ * idle.hpp
+ *
+ * The ways the sampling loop can wait out the off-payload part of each period.
+ */
+
+#ifndef IDLE_H_
+#define IDLE_H_
+
+#include "hedley.h"
+#include "tsc-support.hpp"
+
+#include <cinttypes>
+#include <string>
+
+#include <immintrin.h>
+
+enum IdleKind {
+    /** spin on rdtsc, the original behavior */
+    IDLE_SPIN,
+    /** spin on rdtsc with a pause in each iteration */
+    IDLE_PAUSE,
+    /** nanosleep in fixed-size chunks, as long as they fit before the deadline */
+    IDLE_SLEEP,
+    /** umwait (WAITPKG) until the deadline */
+    IDLE_UMWAIT,
+};
+
+struct IdleMode {
+    IdleKind kind = IDLE_SPIN;
+    /* IDLE_SLEEP: the requested sleep, and how much longer than that a sleep may take, in TSC cycles */
+    uint64_t sleep_ns = 0, sleep_cycles = 0, sleep_margin = 0;
+    /* IDLE_UMWAIT: the umwait control argument, 0 for C0.2 and 1 for C0.1 */
+    uint32_t umwait_ctrl = 0;
+
+    std::string to_string() const;
+};
+
+/**
+ * Parse an IDLE_MODE value: spin, pause, sleep:N (N in us), umwait (C0.2) or umwait:c01.
+ * Sleep modes are calibrated against tsc_freq, and umwait is only accepted if the cpu
+ * supports it. Throws std::runtime_error on bad or unsupported modes.
+ */
+IdleMode parse_idle_mode(const std::string& mode, uint64_t tsc_freq);
+
+/**
+ * True if an IDLE_SLEEP sleep, plus its margin, fits in a sample interval of the given
+ * number of TSC cycles at all: otherwise idle_sleep never sleeps and only pauses.
+ */
+inline bool idle_sleep_fits(const IdleMode& mode, uint64_t interval) {
+    return mode.kind != IDLE_SLEEP || mode.sleep_cycles + mode.sleep_margin < interval;
+}
+
+uint64_t idle_sleep(const IdleMode& mode, uint64_t deadline);
+uint64_t idle_umwait(const IdleMode& mode, uint64_t deadline);
+
+/**
+ * Idle for a while, but not (much) past deadline, and return the current TSC. Called
+ * repeatedly until the deadline passes, so a mode may return well before it.
+ */
+HEDLEY_ALWAYS_INLINE
+static uint64_t idle_step(const IdleMode& mode, uint64_t deadline) {
+    switch (mode.kind) {
+    case IDLE_SPIN:
+        return rdtsc();
+    case IDLE_PAUSE:
+        _mm_pause();
+        return rdtsc();
+    case IDLE_SLEEP:
+        return idle_sleep(mode, deadline);
+    case IDLE_UMWAIT:
+        return idle_umwait(mode, deadline);
+    }
+    HEDLEY_UNREACHABLE();
+}
+
+#endif // #ifndef IDLE_H_
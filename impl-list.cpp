@@ -1,62 +1,175 @@
 #include "impl-list.hpp"
 #include "basic-impls.hpp"
 #include "common-cxx.hpp"
+#include "cpuid.hpp"
+#include "mem-impls.hpp"
 #include "misc.hpp"
 
-#define MAKE250_ENTRY(rep) {"vporxymm250_" #rep,  vporxymm250_ ## rep,  "250x xyayaya ratio " #rep, NONE},
+#include <algorithm>
+#include <unordered_map>
+
+#include <fnmatch.h>
+
+/* the ISA flags a payload at each width needs */
+#define WIDTH_ISA_xmm NONE
+#define WIDTH_ISA_ymm NONE
+#define WIDTH_ISA_zmm AVX512F
+
+#define MAKE250_ENTRY(rep) {"vporxymm250_" #rep,  vporxymm250_ ## rep,  "250x xyayaya ratio " #rep, NONE, "vpor mixed"},
+
+#define LICENCE_ENTRIES(cls, w, instr) \
+    {"lic_" #cls "_" #w "_lat",  lic_##cls##_##w##_lat,  "licence matrix: " #instr " " #w " latency",    WIDTH_ISA_##w, "lic " #cls " " #w " lat"}, \
+    {"lic_" #cls "_" #w "_tput", lic_##cls##_##w##_tput, "licence matrix: " #instr " " #w " throughput", WIDTH_ISA_##w, "lic " #cls " " #w " tput"},
+
+#define MEM_ENTRY(kind, w) {"mem_" #kind "_" #w, mem_##kind##_##w, #kind " " #w " over the working set", WIDTH_ISA_##w, "mem " #kind " " #w},
 
 const test_description all_funcs[] = {
-    {"vporxmm",        vporxmm,        "vpor xmm", NO_VZ },
-    {"vporymm",        vporymm,        "vpor ymm", NO_VZ },
-    {"vporzmm",        vporzmm,        "vpor zmm", NO_VZ },
-    {"vporxmm_vz",     vporxmm_vz,     "vpor xmm w/ vzeroupper", NONE},
-    {"vporymm_vz",     vporymm_vz,     "vpor ymm w/ vzeroupper", NONE},
-    {"vporzmm_vz",     vporzmm_vz,     "vpor zmm w/ vzeroupper", NONE},
-    {"vporxmm_vz100",  vporxmm_vz100,  "100x vpor lat xmm w/ vzero", NONE},
-    {"vporymm_vz100",  vporymm_vz100,  "100x vpor lat ymm w/ vzero", NONE},
-    {"vporzmm_vz100",  vporzmm_vz100,  "100x vpor lat zmm w/ vzero", NONE},
-    {"vpermdzmm_vz100",  vpermdzmm_vz100,  "100x vpermd lat zmm w/ vzero", NONE},
-    {"vporxmm_tput_vz100",  vporxmm_tput_vz100,  "100x vpor tput xmm w/ vzero", NONE},
-    {"vporymm_tput_vz100",  vporymm_tput_vz100,  "100x vpor tput ymm w/ vzero", NONE},
-    {"vporzmm_tput_vz100",  vporzmm_tput_vz100,  "100x vpor tput zmm w/ vzero", NONE},
-    {"vporxymm250",  vporxymm250,  "250x yxxx lat w/ vzero", NONE},
-    {"vporyzmm250",  vporyzmm250,  "250x zyyy lat w/ vzero", NONE},
+    {"vporxmm",        vporxmm,        "vpor xmm", NO_VZ, "vpor xmm"},
+    {"vporymm",        vporymm,        "vpor ymm", NO_VZ, "vpor ymm"},
+    {"vporzmm",        vporzmm,        "vpor zmm", NO_VZ | AVX512F, "vpor zmm"},
+    {"vporxmm_vz",     vporxmm_vz,     "vpor xmm w/ vzeroupper", NONE, "vpor xmm"},
+    {"vporymm_vz",     vporymm_vz,     "vpor ymm w/ vzeroupper", NONE, "vpor ymm"},
+    {"vporzmm_vz",     vporzmm_vz,     "vpor zmm w/ vzeroupper", AVX512F, "vpor zmm"},
+    {"vporxmm_vz100",  vporxmm_vz100,  "100x vpor lat xmm w/ vzero", NONE, "vpor xmm lat"},
+    {"vporymm_vz100",  vporymm_vz100,  "100x vpor lat ymm w/ vzero", NONE, "vpor ymm lat"},
+    {"vporzmm_vz100",  vporzmm_vz100,  "100x vpor lat zmm w/ vzero", AVX512F, "vpor zmm lat"},
+    {"vpermdzmm_vz100",  vpermdzmm_vz100,  "100x vpermd lat zmm w/ vzero", AVX512F, "vpermd zmm lat"},
+    {"vporxmm_tput_vz100",  vporxmm_tput_vz100,  "100x vpor tput xmm w/ vzero", NONE, "vpor xmm tput"},
+    {"vporymm_tput_vz100",  vporymm_tput_vz100,  "100x vpor tput ymm w/ vzero", NONE, "vpor ymm tput"},
+    {"vporzmm_tput_vz100",  vporzmm_tput_vz100,  "100x vpor tput zmm w/ vzero", AVX512F, "vpor zmm tput"},
+    {"vporxymm250",  vporxymm250,  "250x yxxx lat w/ vzero", NONE, "vpor mixed"},
+    {"vporyzmm250",  vporyzmm250,  "250x zyyy lat w/ vzero", NONE, "vpor mixed"},
     ALL_RATIOS_X(MAKE250_ENTRY)
-    {"mulxymm250_10",  mulxymm250_10,  "1x vpor ymm 10x imul", NONE},
+    {"mulxymm250_10",  mulxymm250_10,  "1x vpor ymm 10x imul", NONE, "vpor mixed"},
 
     // {"vpermdxmm_tput_vz100",  vpermdxmm_tput_vz100,  "100x vpermd tput xmm w/ vzero", NONE},
     // {"vpermdymm_tput_vz100",  vpermdymm_tput_vz100,  "100x vpermd tput ymm w/ vzero", NONE},
-    {"vpermdzmm_tput_vz100",  vpermdzmm_tput_vz100,  "100x vpermd tput zmm w/ vzero", NONE},
+    {"vpermdzmm_tput_vz100",  vpermdzmm_tput_vz100,  "100x vpermd tput zmm w/ vzero", AVX512F, "vpermd zmm tput"},
+    LICENCE_MATRIX_X(LICENCE_ENTRIES)
+    MEM_MATRIX_X(MEM_ENTRY)
     {"dummy",          dummy,          "empty function", NONE},
 };
 
-auto b() -> decltype(get_all().begin()) {
-    return get_all().begin();
+/* the ISA extensions named by the flags, in the order they are checked */
+static const struct {
+    AlgoFlags flag;
+    const char* tag;
+    bool (*supported)();
+} isa_flags[] = {
+    {AVX512F,  "avx512f",  cpu_has_avx512f},
+    {AVX512BW, "avx512bw", cpu_has_avx512bw},
+    {AVX512DQ, "avx512dq", cpu_has_avx512dq},
+    {AVX512VL, "avx512vl", cpu_has_avx512vl},
+};
+
+std::vector<std::string> get_tags(const test_description& test) {
+    std::vector<std::string> ret;
+    for (auto& tag : split(test.tags ? test.tags : "", " ")) {
+        if (!tag.empty()) {
+            ret.push_back(tag);
+        }
+    }
+    for (auto& isa : isa_flags) {
+        if (test.flags & isa.flag) {
+            ret.push_back(isa.tag);
+        }
+    }
+    return ret;
 }
 
-auto e() -> decltype(get_all().end()) {
-    return get_all().end();
+const char* missing_isa(const test_description& test) {
+    for (auto& isa : isa_flags) {
+        if ((test.flags & isa.flag) && !isa.supported()) {
+            return isa.tag;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * All the tests, in registration order, indexed by name and by tag since there are
+ * thousands once the generated kernels are included.
+ */
+struct Registry {
+    std::vector<test_description> tests;
+    std::unordered_map<std::string, size_t> by_name;
+    std::unordered_map<std::string, std::vector<size_t>> by_tag;
+
+    Registry() {
+        for (auto& t : all_funcs) {
+            add(t);
+        }
+    }
+
+    void add(const test_description& test) {
+        if (!by_name.emplace(test.name, tests.size()).second) {
+            throw std::runtime_error(std::string("a test named ") + test.name + " already exists");
+        }
+        for (auto& tag : get_tags(test)) {
+            by_tag[tag].push_back(tests.size());
+        }
+        tests.push_back(test);
+    }
+};
+
+static Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+const std::vector<test_description>& get_all() {
+    return registry().tests;
 }
 
 const test_description* get_by_name(const std::string& name) {
-    auto it = std::find_if(b(), e(), [&](auto d) { return name == d.name; });
-    return it == e() ? nullptr : &*it;
+    auto& r = registry();
+    auto it = r.by_name.find(name);
+    return it == r.by_name.end() ? nullptr : &r.tests[it->second];
+}
+
+/* the indexes of the tests matching a single selector, in registration order */
+static std::vector<size_t> select(const std::string& selector) {
+    auto& r = registry();
+    std::vector<size_t> ret;
+    if (selector.size() > 1 && selector[0] == '@') {
+        auto it = r.by_tag.find(selector.substr(1));
+        if (it != r.by_tag.end()) {
+            ret = it->second;
+        }
+    } else if (selector.find_first_of("*?[") != std::string::npos) {
+        for (size_t i = 0; i < r.tests.size(); i++) {
+            if (fnmatch(selector.c_str(), r.tests[i].name, 0) == 0) {
+                ret.push_back(i);
+            }
+        }
+    } else {
+        auto it = r.by_name.find(selector);
+        if (it != r.by_name.end()) {
+            ret.push_back(it->second);
+        }
+    }
+    return ret;
 }
 
 std::vector<test_description> get_by_list(const std::string& list) {
+    auto& r = registry();
     std::vector<test_description> ret;
-    for (auto& name : split(list, ",")) {
-        auto t = get_by_name(name);
-        if (!t) {
-            throw std::runtime_error("no test named " + name);
+    std::vector<bool> seen(r.tests.size());
+    for (auto& selector : split(list, ",")) {
+        auto matches = select(selector);
+        if (matches.empty()) {
+            throw std::runtime_error("no test named or matching " + selector);
+        }
+        for (size_t i : matches) {
+            if (!seen[i]) {
+                seen[i] = true;
+                ret.push_back(r.tests[i]);
+            }
         }
-        ret.push_back(*t);
     }
     return ret;
 }
 
-const std::vector<test_description>& get_all() {
-    static std::vector<test_description> all =
-            std::vector<test_description>(all_funcs, all_funcs + COUNT_OF(all_funcs));
-    return all;
+void register_test(const test_description& test) {
+    registry().add(test);
 }
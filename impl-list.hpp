@@ -17,13 +17,27 @@ enum AlgoFlags {
     /** algo doesn't return the right result (e.g., because it is a dummy for testing) */
     INCORRECT    = 1 << 1,
     NO_VZ        = 1 << 2,
+    /** needs AVX-512F, e.g., any zmm payload */
+    AVX512F      = 1 << 3,
+    /** needs AVX-512BW, e.g., zmm byte or word shuffles */
+    AVX512BW     = 1 << 4,
+    /** needs AVX-512DQ, e.g., a JITted zmm vandps */
+    AVX512DQ     = 1 << 5,
+    /** needs AVX-512VL, e.g., a JITted instruction on xmm16-31 or ymm16-31 */
+    AVX512VL     = 1 << 6,
 };
 
+constexpr AlgoFlags operator|(AlgoFlags a, AlgoFlags b) {
+    return AlgoFlags((int)a | (int)b);
+}
+
 struct test_description {
     const char *name;
     bench_fn *f;
     const char *desc;
     AlgoFlags flags;
+    /** space separated tags for selection with @tag, e.g., the width and instruction class */
+    const char *tags = "";
 
     void call_f(const bench_args& args) const {
         f(args);
@@ -37,14 +51,34 @@ struct test_description {
 const test_description* get_by_name(const std::string& name);
 
 /**
- * Given a comma separated list of test names, return a list of all the
- * tests, or throw if one isn't found.
+ * Given a comma separated list of test selectors, return the selected tests, in order
+ * and without duplicates, or throw if a selector matches nothing. A selector is a test
+ * name, a glob on test names like *zmm*_tput, or @tag for every test with that tag. The
+ * tags of a test are its own tags plus the ISA extensions it needs from its flags, e.g.,
+ * avx512f.
  */
 std::vector<test_description> get_by_list(const std::string& list);
 
+/**
+ * Return all the tags of the given test, including those implied by its flags.
+ */
+std::vector<std::string> get_tags(const test_description& test);
+
+/**
+ * Return the name of the first ISA extension the test needs that this cpu doesn't
+ * support, or nullptr if it can run here.
+ */
+const char* missing_isa(const test_description& test);
+
 /**
  * Return all test descriptors.
  */
 const std::vector<test_description>& get_all();
 
+/**
+ * Add a test created at runtime (e.g., a JIT payload) to the list. Call this before
+ * looking up any tests, since it invalidates pointers into the list.
+ */
+void register_test(const test_description& test);
+
 #endif
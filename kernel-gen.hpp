@@ -0,0 +1,162 @@
+/*
+ * kernel-gen.hpp
+ *
+ * Compile-time generation of payload kernels: Kernel<Insn, W, UNROLL, DEP> is UNROLL
+ * copies of the instruction Insn at vector width W, either as one dependency chain
+ * (LATENCY) or spread round-robin over 8 independent accumulators (THROUGHPUT). The
+ * copies are a single asm statement, so the compiler can't fold, reorder or add moves
+ * between them, but it does allocate the registers.
+ *
+ * The registers are declared as xmm values and printed at the kernel's width with the
+ * x/t/g operand modifiers, so no AVX-512 code is generated outside the asm itself.
+ *
+ * KernelGrid registers the kernel for every combination of its parameter lists as a
+ * test named <insn>_<width>_<unroll>_<lat|tput>, e.g., vpord_zmm_1000_tput, and tagged
+ * with the instruction, width, lat or tput, and kernel.
+ */
+
+#ifndef KERNEL_GEN_H_
+#define KERNEL_GEN_H_
+
+#include "common-cxx.hpp"
+#include "impl-list.hpp"
+
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <immintrin.h>
+
+enum KernelWidth { KW_XMM, KW_YMM, KW_ZMM };
+
+enum KernelDep { LATENCY, THROUGHPUT };
+
+template <KernelWidth W>
+using WidthTag = std::integral_constant<KernelWidth, W>;
+
+/* the operands of an instruction that updates d using s, as d = d op s */
+#define KERNEL_OPS_RMW(m, s, d) " %" #m #s ", %" #m #d ", %" #m #d "\n\t"
+/* the operands of an FMA, as d += s * s */
+#define KERNEL_OPS_FMA(m, s, d) " %" #m #s ", %" #m #s ", %" #m #d "\n\t"
+
+/*
+ * One width of an instruction: chain repeats it n times on a, and spread repeats it n
+ * times in total over the 8 accumulators a0-a7, round-robin. The count goes to .rept
+ * and .if as an immediate operand, so each is a single asm statement. The accumulators
+ * are early-clobber so s never shares a register with them, even though all are zero.
+ */
+#define KERNEL_INSN_WIDTH(kw, insn, ops, m)                                                   \
+    template <size_t N>                                                                      \
+    HEDLEY_ALWAYS_INLINE static void chain(WidthTag<kw>, __m128i& a, __m128i s) {            \
+        asm volatile (".rept %c2\n\t" insn ops(m, 1, 0) ".endr"                               \
+            : "+&x"(a) : "x"(s), "i"(N));                                                    \
+    }                                                                                        \
+    template <size_t N>                                                                      \
+    HEDLEY_ALWAYS_INLINE static void spread(WidthTag<kw>, __m128i& a0, __m128i& a1,          \
+            __m128i& a2, __m128i& a3, __m128i& a4, __m128i& a5, __m128i& a6, __m128i& a7,    \
+            __m128i s) {                                                                     \
+        asm volatile (".rept %c9 / 8\n\t"                                                    \
+            insn ops(m, 8, 0) insn ops(m, 8, 1) insn ops(m, 8, 2) insn ops(m, 8, 3)          \
+            insn ops(m, 8, 4) insn ops(m, 8, 5) insn ops(m, 8, 6) insn ops(m, 8, 7)          \
+            ".endr\n\t"                                                                      \
+            ".if %c9 %% 8 > 0\n\t" insn ops(m, 8, 0) ".endif\n\t"                             \
+            ".if %c9 %% 8 > 1\n\t" insn ops(m, 8, 1) ".endif\n\t"                             \
+            ".if %c9 %% 8 > 2\n\t" insn ops(m, 8, 2) ".endif\n\t"                             \
+            ".if %c9 %% 8 > 3\n\t" insn ops(m, 8, 3) ".endif\n\t"                             \
+            ".if %c9 %% 8 > 4\n\t" insn ops(m, 8, 4) ".endif\n\t"                             \
+            ".if %c9 %% 8 > 5\n\t" insn ops(m, 8, 5) ".endif\n\t"                             \
+            ".if %c9 %% 8 > 6\n\t" insn ops(m, 8, 6) ".endif"                                 \
+            : "+&x"(a0), "+&x"(a1), "+&x"(a2), "+&x"(a3),                                    \
+              "+&x"(a4), "+&x"(a5), "+&x"(a6), "+&x"(a7)                                     \
+            : "x"(s), "i"(N));                                                               \
+    }
+
+/**
+ * Define the instruction trait type, with the given mnemonic at each width (they differ
+ * when the AVX-512 form has its own name, like vpord), operand form (one of the
+ * KERNEL_OPS_ macros) and the AlgoFlags ISA flags the zmm form needs.
+ */
+#define KERNEL_INSN(type, xmm_insn, ymm_insn, zmm_insn, ops, zmm_isa)                         \
+struct type {                                                                                \
+    static constexpr AlgoFlags ZMM_ISA = zmm_isa;                                            \
+    static const char* name(KernelWidth w) {                                                 \
+        return w == KW_XMM ? xmm_insn : w == KW_YMM ? ymm_insn : zmm_insn;                   \
+    }                                                                                        \
+    KERNEL_INSN_WIDTH(KW_XMM, xmm_insn, ops, x)                                              \
+    KERNEL_INSN_WIDTH(KW_YMM, ymm_insn, ops, t)                                              \
+    KERNEL_INSN_WIDTH(KW_ZMM, zmm_insn, ops, g)                                              \
+};
+
+template <typename Insn, KernelWidth W, size_t UNROLL, KernelDep DEP>
+struct Kernel {
+    static void run(bench_args args) {
+        // zeroed (with VEX, so the whole zmm register) so FP ops never see denormals
+        __m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0, a4 = a0, a5 = a0, a6 = a0, a7 = a0;
+        __m128i src = _mm_setzero_si128();
+        if (DEP == LATENCY) {
+            Insn::template chain<UNROLL>(WidthTag<W>{}, a0, src);
+        } else {
+            Insn::template spread<UNROLL>(WidthTag<W>{}, a0, a1, a2, a3, a4, a5, a6, a7, src);
+        }
+        asm volatile ("vzeroupper");
+    }
+
+    static const char* name() {
+        static const std::string name = std::string(Insn::name(W)) + "_" + (W == KW_XMM ? "xmm" : W == KW_YMM ? "ymm" : "zmm")
+                + "_" + std::to_string(UNROLL) + (DEP == LATENCY ? "_lat" : "_tput");
+        return name.c_str();
+    }
+
+    static const char* desc() {
+        static const std::string desc = std::to_string(UNROLL) + "x " + Insn::name(W)
+                + (DEP == LATENCY ? " as one dependency chain" : " over 8 accumulators");
+        return desc.c_str();
+    }
+
+    /* the instruction, width and dependency type, plus "kernel" */
+    static const char* tags() {
+        static const std::string tags = std::string(Insn::name(W)) + (W == KW_XMM ? " xmm" : W == KW_YMM ? " ymm" : " zmm")
+                + (DEP == LATENCY ? " lat" : " tput") + " kernel";
+        return tags.c_str();
+    }
+
+    static void do_register() {
+        register_test({name(), run, desc(), W == KW_ZMM ? Insn::ZMM_ISA : NONE, tags()});
+    }
+};
+
+template <typename... Insns> struct InsnList {};
+template <KernelWidth... Ws> struct WidthList {};
+template <size_t... Us>      struct UnrollList {};
+template <KernelDep... Ds>   struct DepList {};
+
+/**
+ * Instantiating KernelGrid<InsnList<...>, WidthList<...>, UnrollList<...>, DepList<...>>
+ * as a static object registers a kernel for every combination of the parameters.
+ */
+template <typename I, typename W, typename U, typename D>
+struct KernelGrid;
+
+template <typename... Insns, KernelWidth... Ws, size_t... Us, KernelDep... Ds>
+struct KernelGrid<InsnList<Insns...>, WidthList<Ws...>, UnrollList<Us...>, DepList<Ds...>> {
+    template <typename Insn, KernelWidth W, size_t U>
+    static void register_deps() {
+        (Kernel<Insn, W, U, Ds>::do_register(), ...);
+    }
+
+    template <typename Insn, KernelWidth W>
+    static void register_unrolls() {
+        (register_deps<Insn, W, Us>(), ...);
+    }
+
+    template <typename Insn>
+    static void register_widths() {
+        (register_unrolls<Insn, Ws>(), ...);
+    }
+
+    KernelGrid() {
+        (register_widths<Insns>(), ...);
+    }
+};
+
+#endif // #ifndef KERNEL_GEN_H_
@@ -0,0 +1,21 @@
+/**
+ * The grid of template-generated kernels (see kernel-gen.hpp), which register themselves
+ * in the test list at startup.
+ */
+
+#include "kernel-gen.hpp"
+
+KERNEL_INSN(Vpor,        "vpor",        "vpor",        "vpord",       KERNEL_OPS_RMW, AVX512F)
+KERNEL_INSN(Vpaddd,      "vpaddd",      "vpaddd",      "vpaddd",      KERNEL_OPS_RMW, AVX512F)
+KERNEL_INSN(Vpmulld,     "vpmulld",     "vpmulld",     "vpmulld",     KERNEL_OPS_RMW, AVX512F)
+KERNEL_INSN(Vaddps,      "vaddps",      "vaddps",      "vaddps",      KERNEL_OPS_RMW, AVX512F)
+KERNEL_INSN(Vmulps,      "vmulps",      "vmulps",      "vmulps",      KERNEL_OPS_RMW, AVX512F)
+KERNEL_INSN(Vfmadd231ps, "vfmadd231ps", "vfmadd231ps", "vfmadd231ps", KERNEL_OPS_FMA, AVX512F)
+KERNEL_INSN(Vpermilps,   "vpermilps",   "vpermilps",   "vpermilps",   KERNEL_OPS_RMW, AVX512F)
+KERNEL_INSN(Vpshufb,     "vpshufb",     "vpshufb",     "vpshufb",     KERNEL_OPS_RMW, AVX512BW)
+
+static KernelGrid<
+        InsnList<Vpor, Vpaddd, Vpmulld, Vaddps, Vmulps, Vfmadd231ps, Vpermilps, Vpshufb>,
+        WidthList<KW_XMM, KW_YMM, KW_ZMM>,
+        UnrollList<100, 1000>,
+        DepList<LATENCY, THROUGHPUT>> kernel_grid;
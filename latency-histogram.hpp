@@ -0,0 +1,96 @@
+/*
+ * latency-histogram.hpp
+ *
+ * An HDR-style histogram of non-negative integer values (e.g., latencies in cycles)
+ * with log-linear buckets: values below 2^SUB_BITS each get their own bucket, and
+ * above that every power of two is split into 2^(SUB_BITS-1) equal buckets, so every
+ * value is recorded with a relative error of at most 2^-(SUB_BITS-1) over the whole
+ * 64-bit range, in a fixed amount of memory.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cstddef>
+#include <vector>
+
+template <unsigned SUB_BITS>
+class LogLinearHistogram {
+    static_assert(SUB_BITS >= 1 && SUB_BITS < 32, "bad SUB_BITS");
+
+    static constexpr uint64_t SUB  = 1ull << SUB_BITS;
+    static constexpr uint64_t HALF = SUB / 2;
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+
+public:
+    static constexpr size_t BUCKETS = SUB + (64 - SUB_BITS) * HALF;
+
+    LogLinearHistogram() : counts(BUCKETS), total{0} {}
+
+    /** the bucket holding value v */
+    static size_t index(uint64_t v) {
+        if (v < SUB) {
+            return v;
+        }
+        unsigned shift = 63 - __builtin_clzll(v) - (SUB_BITS - 1);
+        return SUB + (shift - 1) * HALF + ((v >> shift) - HALF);
+    }
+
+    /** the smallest value in bucket idx */
+    static uint64_t bucket_low(size_t idx) {
+        if (idx < SUB) {
+            return idx;
+        }
+        size_t j = idx - SUB;
+        unsigned shift = j / HALF + 1;
+        return (HALF + j % HALF) << shift;
+    }
+
+    /** the largest value in bucket idx */
+    static uint64_t bucket_high(size_t idx) {
+        return idx + 1 < BUCKETS ? bucket_low(idx + 1) - 1 : UINT64_MAX;
+    }
+
+    void record(uint64_t v) {
+        counts[index(v)]++;
+        total++;
+    }
+
+    void reset() {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = 0;
+    }
+
+    uint64_t count() const { return total; }
+
+    uint64_t bucket_count(size_t idx) const { return counts[idx]; }
+
+    /**
+     * The (upper bound of the bucket holding the) value at percentile p, in [0, 100],
+     * or 0 if the histogram is empty.
+     */
+    uint64_t value_at_percentile(double p) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, p / 100. * total + 0.5), seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return bucket_high(i);
+            }
+        }
+        assert(false);
+        return UINT64_MAX;
+    }
+};
+
+/** the histogram used for payload latencies: 64 linear sub-buckets, so ~3% precision */
+using LatencyHistogram = LogLinearHistogram<6>;
+
+#endif // #ifndef LATENCY_HISTOGRAM_H_
@@ -3,7 +3,7 @@
  *
  * unit-test-main.cpp
  */
-// #define CATCH_CONFIG_NO_POSIX_SIGNALS
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
 // This tells Catch to provide a main() - only do this in one cpp file
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
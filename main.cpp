@@ -1,21 +1,42 @@
 
 #include <assert.h>
 #include "common-cxx.hpp"
+#include "basic-impls.hpp"
+#include "batch-kernels.hpp"
+#include "campaign.hpp"
+#include "cpuid.hpp"
+#include "csv-emitter.hpp"
 #include "env.hpp"
+#include "idle.hpp"
 #include "impl-list.hpp"
+#include "latency-histogram.hpp"
+#include "mem-impls.hpp"
 #include "misc.hpp"
+#include "multi-cpu.hpp"
 #include "msr-access.h"
 #include "opt-control.h"
+#include "payload-jit.hpp"
 #include "perf-timer-events.hpp"
 #include "perf-timer.hpp"
+#include "quantile-sketch.hpp"
+#include "schedule.hpp"
+#include "spsc-ring.hpp"
+#include "trace-file.hpp"
+#include "transition-detector.hpp"
 #include "tsc-support.hpp"
 
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <atomic>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 
+#include <errno.h>
 #include <math.h>
 #include <sys/mman.h>
 #include <time.h>
@@ -24,6 +45,7 @@
 #include <immintrin.h>
 
 #include <sched.h>
+#include <unistd.h>
 
 // #include "dbg.h"
 
@@ -34,9 +56,14 @@ static bool summary;
 static bool debug;
 static bool prefix_cols;
 static bool no_warm;  // true == skip the warmup stamp() each iteration
+static bool subtract_overhead;  // true == subtract the calibrated stamp overhead from counter deltas
+static double retry_pct;        // the percentile of stamp cost above which the counters are re-read
 
 static uint64_t tsc_freq;
 
+/* where the CSV results go: stdout, except for campaign cells, which have their own files */
+static FILE* csv_out = stdout;
+
 using velem = std::vector<char>;
 
 #define vprint(...)                       \
@@ -57,15 +84,6 @@ void flushmem(const void* p, size_t size) {
     _mm_mfence();
 }
 
-void pinToCpu(int cpu) {
-    cpu_set_t set;
-    CPU_ZERO(&set);
-    CPU_SET(cpu, &set);
-    if (sched_setaffinity(0, sizeof(set), &set)) {
-        assert("pinning failed" && false);
-    }
-}
-
 template <typename... Args>
 void usageCheck(bool condition, const std::string& fmt, Args... args) {
     if (!condition) {
@@ -117,11 +135,14 @@ struct iprinter;
 struct RunArgs {
     double busy;
     size_t repeat_count, iters;
+    /* the current working set size, and the buffers (of at least that size) it is taken from */
+    size_t size;
+    char_span src, dst;
 
     /**
-     * Get the intersect args appropriate for the given iteration.
+     * Get the args for the payload: the first size bytes of each buffer.
      */
-    bench_args get_args() const { return {}; }
+    bench_args get_args() const { return {src.first(size), dst.first(size)}; }
 };
 
 class StampConfig;
@@ -138,14 +159,18 @@ public:
 
     Stamp() : tsc(-1) {}
 
-    Stamp(uint64_t tsc, event_counts counters, uint64_t tsc_before, size_t retries)
-        : tsc{tsc},  tsc_before{tsc_before}, counters{counters}, retries{retries}, msrs_read{0} {}
+    /* mux_idx of a stamp that has no multiplexed counts */
+    constexpr static uint32_t NO_MUX = -1;
+
+    Stamp(uint64_t tsc, event_counts counters, uint64_t tsc_before, uint32_t retries, uint32_t mux_idx = NO_MUX)
+        : tsc{tsc},  tsc_before{tsc_before}, counters{counters}, retries{retries}, mux_idx{mux_idx}, msrs_read{0} {}
 
     std::string to_string() { return std::string("tsc: ") + std::to_string(this->tsc); }
 
     uint64_t tsc, tsc_before;
+    /* unused when the counters are multiplexed, which the StampConfig has at mux_idx (see mux_at) */
     event_counts counters;
-    size_t retries;
+    uint32_t retries, mux_idx;
     uint64_t msr_values[MAX_MSR];
     size_t msrs_read;
 };
@@ -174,14 +199,20 @@ class StampDelta {
     // not cycles: has arbitrary units
     uint64_t tsc_delta;
     event_counts counters;
+    /* with multiplexed counters, the mux_idx of the before and after stamps */
+    uint32_t mux_before, mux_after;
 
     StampDelta(const StampConfig& config,
                uint64_t tsc_delta,
-               event_counts counters)
+               event_counts counters,
+               uint32_t mux_before = Stamp::NO_MUX,
+               uint32_t mux_after = Stamp::NO_MUX)
         : empty(false),
           config{&config},
           tsc_delta{tsc_delta},
-          counters{std::move(counters)}
+          counters{std::move(counters)},
+          mux_before{mux_before},
+          mux_after{mux_after}
           {}
 
 public:
@@ -190,7 +221,7 @@ public:
      * never be returned from functions like min(), unless both arguments
      * are empty. Handy for accumulation patterns.
      */
-    StampDelta() : empty(true), config{nullptr}, tsc_delta{}, counters{} {}
+    StampDelta() : empty(true), config{nullptr}, tsc_delta{}, counters{}, mux_before{Stamp::NO_MUX}, mux_after{Stamp::NO_MUX} {}
 
     double get_nanos() const {
         assert(!empty);
@@ -213,6 +244,17 @@ public:
 
     uint64_t get_counter(const PerfEvent& event) const;
 
+    /**
+     * The factor to scale the event's count by to make up for the time it wasn't on the
+     * PMU when multiplexing (see scale_factor), always 1 if not multiplexing, and NaN
+     * if the event never ran or failed to be set up.
+     */
+    double get_scale(const PerfEvent& event) const;
+
+    /** get_counter() and get_scale() for an event already mapped to its counter slot */
+    uint64_t get_counter_at(ssize_t slot) const;
+    double get_scale_at(ssize_t slot) const;
+
     /**
      * Return a new StampDelta with every contained element having the minimum
      * value between the left and right arguments.
@@ -220,6 +262,8 @@ public:
      * As a special rule, if either argument is empty, the other argument is returned
      * without applying the function, this facilitates typical use with an initial
      * empty object followed by accumulation.
+     *
+     * Not supported for multiplexed counters.
      */
     template <typename F>
     static StampDelta apply(const StampDelta& l, const StampDelta& r, F f) {
@@ -228,6 +272,7 @@ public:
         if (r.empty)
             return l;
         assert(l.config == r.config);
+        assert(l.mux_after == Stamp::NO_MUX && r.mux_after == Stamp::NO_MUX);
         event_counts new_counts            = event_counts::apply(l.counters, r.counters, f);
         return StampDelta{*l.config, {f(l.tsc_delta, r.tsc_delta)}, new_counts};
     }
@@ -240,12 +285,16 @@ const PerfEvent DUMMY_EVENT_NANOS = PerfEvent("nanos", "nanos");
 
 /**
  * Manages PMU events.
+ *
+ * Each EventManager owns its counters, which are opened by prepare() for the calling
+ * thread, so a thread that wants to take stamps needs its own (prepared) EventManager.
  */
 class EventManager {
     /** event to counter index */
     std::map<PerfEvent, size_t> event_map;
     std::vector<PerfEvent> event_vec;
     std::vector<bool> setup_results;
+    CounterSet counters;
     size_t next_counter;
     bool prepared;
 
@@ -261,7 +310,7 @@ public:
         if (event_map.count(event)) {
             return true;
         }
-        if (event_map.size() == MAX_COUNTERS) {
+        if (event_map.size() == counters.capacity()) {
             return false;
         }
         event_map.insert({event, next_counter++});
@@ -271,12 +320,14 @@ public:
 
     void prepare() {
         assert(event_map.size() == event_vec.size());
-        setup_results   = setup_counters(event_vec);
+        setup_results   = counters.setup(event_vec);
         size_t failures = std::count(setup_results.begin(), setup_results.end(), false);
         if (failures > 0) {
             fprintf(stderr, "%zu events failed to be configured\n", failures);
         }
-        vprint("EventManager configured %zu events\n", (setup_results.size() - failures));
+        vprint("EventManager configured %zu events%s%s\n", (setup_results.size() - failures),
+                counters.size() == 0 ? "" : counters.uses_read() ? " (read with read(), no rdpmc)" : " (read with rdpmc)",
+                counters.is_multiplexed() ? ", multiplexed" : "");
         prepared = true;
     }
 
@@ -300,13 +351,36 @@ public:
         if (!setup_results.at(idx)) {
             return -1;
         }
-        return idx;
+        // the events that were set up occupy consecutive slots, skipping any that failed
+        return std::count(setup_results.begin(), setup_results.begin() + idx, true);
     }
 
     /** number of unique configured events */
     size_t get_count() {
         return event_map.size();
     }
+
+    /** the configured events, in counter slot order */
+    const std::vector<PerfEvent>& get_events() const {
+        return event_vec;
+    }
+
+    event_counts read_counters() const {
+        return counters.read();
+    }
+
+    void read_mux(mux_counts& out) const {
+        counters.read_mux(out);
+    }
+
+    bool is_multiplexed() const {
+        return counters.is_multiplexed();
+    }
+
+    /** stop or restart counting, see CounterSet::set_enabled */
+    void set_enabled(bool enabled) {
+        counters.set_enabled(enabled);
+    }
 };
 
 /**
@@ -390,10 +464,29 @@ public:
 class StampConfig {
 public:
     constexpr static size_t MAX_RETRIES = 10;
+    /* how many stamps calibrate() takes, and how many of those are discarded as warmup */
+    constexpr static size_t CAL_STAMPS = 2000;
+    constexpr static size_t CAL_WARMUP = 200;
 
     EventManager em;
     MSRManager mm;
     uint64_t retry_gap;
+    /* the counter increments caused by the stamps of one sample (see calibrate()) */
+    event_counts overhead;
+    /* record the duration of each payload call (see LatencyColumn) */
+    bool record_latency = false;
+    /* true if the counters are multiplexed, see em.is_multiplexed() */
+    bool multiplexed = false;
+    /*
+     * With multiplexed counters, the counts of the stamps taken with stamp(true), i.e.,
+     * the samples, since the last clear_mux_log(), reserved ahead with reserve_mux() so
+     * that taking a sample doesn't allocate.
+     */
+    mutable std::vector<mux_counts> mux_log;
+    /* the counts of the other stamps, which are only needed until a few stamps later */
+    constexpr static uint32_t MUX_SCRATCH = 4, MUX_SCRATCH_BIT = 1u << 31;
+    mutable mux_counts mux_scratch[MUX_SCRATCH];
+    mutable uint32_t scratch_next = 0;
 
     StampConfig () : retry_gap{-1u} {}
 
@@ -401,19 +494,109 @@ public:
      * After updating the config to the state you want, call prepare() once which
      * does any global configuration needed to support the configured stamps, such
      * as programming PMU events.
+     *
+     * Since the counters are per-thread, this should be called on the thread that
+     * will take the stamps.
      */
     void prepare() {
         em.prepare();
         mm.prepare();
-        // dirty hack - estimate retry gap based on number of events and magic
-        // numbers
-        retry_gap = 30 + 50 * em.get_count();
+        multiplexed = em.is_multiplexed();
+        calibrate();
+    }
+
+    /**
+     * Forget the multiplexed counts of all the stamps taken so far, which must no longer
+     * be used.
+     */
+    void clear_mux_log() const {
+        mux_log.clear();
+    }
+
+    /** make room in mux_log for count more samples */
+    void reserve_mux(size_t count) const {
+        if (multiplexed) {
+            mux_log.reserve(mux_log.size() + count);
+        }
     }
 
-    // take the stamp.
-    Stamp stamp() const {
+    /** the multiplexed counts of the stamp with the given mux_idx */
+    const mux_counts& mux_at(uint32_t mux_idx) const {
+        return mux_idx & MUX_SCRATCH_BIT ? mux_scratch[mux_idx & ~MUX_SCRATCH_BIT] : mux_log[mux_idx];
+    }
+
+    /**
+     * Measure what taking stamps costs on this machine with the configured counters
+     * and MSRs: the TSC gap across reading the counters sets retry_gap (at the
+     * retry_pct percentile), and the median counter deltas between back-to-back
+     * samples, taken as the sampling loop does (including the warmup stamp), are the
+     * per-sample overhead. Multiplexed counts aren't corrected for overhead, so it
+     * stays zero for them.
+     */
+    void calibrate() {
+        retry_gap = -1;
+        std::vector<uint64_t> gaps;
+        std::vector<std::vector<uint64_t>> deltas(MAX_COUNTERS);
+        Stamp prev;
+        for (size_t i = 0; i < CAL_STAMPS; i++) {
+            if (!no_warm) stamp();
+            Stamp s = stamp();
+            if (i >= CAL_WARMUP) {
+                gaps.push_back(s.tsc - s.tsc_before);
+                auto d = calc_delta(prev.counters, s.counters);
+                for (size_t c = 0; c < MAX_COUNTERS; c++) {
+                    deltas[c].push_back(d.counts[c]);
+                }
+            }
+            prev = s;
+        }
+
+        auto pct = [](std::vector<uint64_t>& v, double p) {
+            size_t idx = std::min(v.size() - 1, (size_t)(p / 100. * v.size()));
+            std::nth_element(v.begin(), v.begin() + idx, v.end());
+            return v[idx];
+        };
+        retry_gap = pct(gaps, retry_pct);
+        uint64_t median_gap = pct(gaps, 50);
+        for (size_t c = 0; c < MAX_COUNTERS; c++) {
+            overhead.counts[c] = pct(deltas[c], 50);
+        }
+
+        vprint("Stamp calibration: median gap %zu, p%.1f gap %zu cycles (retry gap)\n",
+                (size_t)median_gap, retry_pct, (size_t)retry_gap);
+        auto& events = em.get_events();
+        for (size_t c = 0; c < (multiplexed ? 0 : events.size()); c++) {
+            vprint("  %-30s %10zu per sample\n", events[c].name, (size_t)overhead.counts[c]);
+        }
+        if (subtract_overhead && !multiplexed) {
+            vprint("  (subtracted from the Cycles and INSTRU columns)\n");
+        }
+    }
+
+    /**
+     * The per-sample stamp overhead to subtract from the count of event for the columns
+     * that correct for it (see EventColumn::correct_overhead): zero unless overhead
+     * subtraction is on and the counters aren't multiplexed.
+     */
+    uint64_t overhead_of(const PerfEvent& event) const {
+        if (!subtract_overhead || multiplexed) {
+            return 0;
+        }
+        ssize_t idx = em.get_mapping(event);
+        return idx == -1 ? 0 : overhead.counts[idx];
+    }
+
+    /**
+     * Take the stamp. Multiplexed counts are only kept for good if keep is true, and
+     * otherwise are overwritten after a few more stamps.
+     */
+    Stamp stamp(bool keep = false) const {
+        if (HEDLEY_UNLIKELY(multiplexed)) {
+            return stamp_mux(keep);
+        }
+
         auto tsc_before = rdtsc();
-        auto counters = read_counters();
+        auto counters = em.read_counters();
         auto tsc = rdtsc();
 
         Stamp s(tsc, counters, tsc_before, 0);
@@ -423,10 +606,10 @@ public:
             return s;
         }
 
-        size_t retries = 1;
+        uint32_t retries = 1;
         do {
             tsc_before = rdtsc();
-            counters = read_counters();
+            counters = em.read_counters();
             tsc = rdtsc();
         } while (tsc - tsc_before > retry_gap && retries++ < MAX_RETRIES);
 
@@ -436,25 +619,69 @@ public:
         return s;
     }
 
+    /* stamp() for multiplexed counters, which go in a new mux_log entry if kept */
+    HEDLEY_NEVER_INLINE
+    Stamp stamp_mux(bool keep) const {
+        uint32_t idx = keep ? mux_log.size() : MUX_SCRATCH_BIT | scratch_next;
+        mux_counts& mux = keep ? mux_log.emplace_back() : mux_scratch[scratch_next];
+        if (!keep) {
+            scratch_next = (scratch_next + 1) % MUX_SCRATCH;
+        }
+        uint32_t retries = 0;
+        uint64_t tsc_before, tsc;
+        do {
+            tsc_before = rdtsc();
+            em.read_mux(mux);
+            tsc = rdtsc();
+        } while (tsc - tsc_before > retry_gap && retries++ < MAX_RETRIES);
+
+        Stamp s(tsc, event_counts{}, tsc_before, retries, idx);
+        mm.do_stamp(s);
+        return s;
+    }
+
     /**
      * Create a StampDelta from the given before/after stamps
      * which should have been created by this StampConfig.
      */
     StampDelta delta(const Stamp& before, const Stamp& after) const {
+        if (multiplexed) {
+            return StampDelta(*this, after.tsc - before.tsc, {}, before.mux_idx, after.mux_idx);
+        }
         return StampDelta(*this, after.tsc - before.tsc, calc_delta(before.counters, after.counters));
     }
 };
 
 uint64_t StampDelta::get_counter(const PerfEvent& event) const {
-    const EventManager& em = config->em;
-    ssize_t idx            = em.get_mapping(event);
-    assert(idx >= -1 && idx <= (ssize_t)MAX_COUNTERS);
+    return get_counter_at(config->em.get_mapping(event));
+}
+
+double StampDelta::get_scale(const PerfEvent& event) const {
+    return get_scale_at(config->em.get_mapping(event));
+}
+
+uint64_t StampDelta::get_counter_at(ssize_t idx) const {
+    assert(idx >= -1 && idx < (ssize_t)(mux_after == Stamp::NO_MUX ? MAX_COUNTERS : MAX_MUX_COUNTERS));
     if (idx == -1) {
         return -1;
     }
+    if (mux_after != Stamp::NO_MUX) {
+        return config->mux_at(mux_after).counts[idx] - config->mux_at(mux_before).counts[idx];
+    }
     return this->counters.counts[idx];
 }
 
+double StampDelta::get_scale_at(ssize_t idx) const {
+    if (idx == -1) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    if (mux_after == Stamp::NO_MUX) {
+        return 1;
+    }
+    const mux_counts &b = config->mux_at(mux_before), &a = config->mux_at(mux_after);
+    return scale_factor(a.enabled[idx] - b.enabled[idx], a.running[idx] - b.running[idx]);
+}
+
 struct BenchResults {
     StampDelta delta;
     Stamp after;
@@ -471,6 +698,9 @@ struct ColFailed : std::runtime_error {
     ColFailed(std::string colval) : std::runtime_error("column failed"), colval_{std::move(colval)} {}
 };
 
+struct RunResult;
+struct BatchContext;
+
 /**
  * A Column object represents a thing which knows how to print a column of data.
  * It injects what it wants into the Stamp object and then gets it back out after.
@@ -511,6 +741,11 @@ public:
      */
     virtual bool is_post_output() const { return post_output; }
 
+    /** post-output columns implement this to output their data for one repeat */
+    virtual void print_post(CsvEmitter& out, size_t repeat, const RunResult& result) const {
+        throw std::logic_error("unimplemented print_post");
+    }
+
     double get_final_value(const BenchResults& results) const {
         auto val = get_value(results);
         if (val.second) {
@@ -520,6 +755,14 @@ public:
         }
     }
 
+    /**
+     * Evaluate this column for every row of a batch of samples at once, writing one value
+     * per row to out, exactly as get_final_value() would. The default implementation
+     * calls get_final_value() for each row; subclasses override it with whole-array
+     * kernels where they can.
+     */
+    virtual void get_values(const BatchContext& batch, double* out) const;
+
     virtual void print(FILE* f, const BenchResults& results) const { print(f, get_final_value(results)); }
 
     void print(FILE* f, double val) const { print(f, formatted_string(val)); }
@@ -551,13 +794,56 @@ public:
 class EventColumn : public Column {
 public:
     PerfEvent top, bottom;
+    /*
+     * True if the stamp overhead is subtracted from this column's count with
+     * SUBTRACT_OVERHEAD. Only plain counts are corrected: in a ratio the overhead would
+     * also have to come off the other side (for nanos, the TSC time of the stamps).
+     */
+    bool correct_overhead;
+
+    EventColumn(const char* heading, const char* format, PerfEvent top, PerfEvent bottom, bool correct_overhead = false)
+        : Column{heading, format}, top{top}, bottom{bottom}, correct_overhead{correct_overhead} {}
+
+    /* one of the column's events, mapped to its counter slot in some StampConfig */
+    struct Operand {
+        bool nanos;
+        /* the counter slot, -1 if the event failed to be set up */
+        ssize_t slot;
+        /* subtracted from the count, see correct_overhead */
+        uint64_t overhead;
+    };
+
+    /* the column's events mapped once by resolve(), for evaluating many deltas */
+    struct Resolved {
+        Operand top, bottom;
+    };
+
+    Resolved resolve(const StampConfig& config) const {
+        return {operand(config, top), is_ratio() ? operand(config, bottom) : Operand{}};
+    }
 
-    EventColumn(const char* heading, const char* format, PerfEvent top, PerfEvent bottom)
-        : Column{heading, format}, top{top}, bottom{bottom} {}
+    /** the value of this column over delta, which must come from the config r was resolved in */
+    double value(const Resolved& r, const StampDelta& delta) const {
+        return value(r.top, delta) / (is_ratio() ? value(r.bottom, delta) : 1.);
+    }
 
     virtual std::pair<double, bool> get_value(const BenchResults& results) const override {
-        double ratio = value(results.delta, top) / (is_ratio() ? value(results.delta, bottom) : 1.);
-        return {ratio, true};
+        return {value(resolve(results.delta.get_config()), results.delta), true};
+    }
+
+    /**
+     * The largest multiplexing scale factor of the events behind this column, i.e., how
+     * much its value was extrapolated, or NaN if one of them never ran.
+     */
+    double scale(const StampDelta& delta) const {
+        double ret = 1;
+        for (auto& e : {top, bottom}) {
+            if (e != NoEvent && e != DUMMY_EVENT_NANOS) {
+                double s = delta.get_scale(e);
+                ret = std::isnan(s) ? s : std::max(ret, s);
+            }
+        }
+        return ret;
     }
 
     void update_config(StampConfig& sc) const override {
@@ -565,27 +851,37 @@ public:
         sc.em.add_event(bottom);
     }
 
+    void get_values(const BatchContext& batch, double* out) const override;
+
     /** true if this value is a ratio (no need to normalize), false otherwise */
     bool is_ratio() const {
         return bottom != NoEvent;  // lol
     }
 
 private:
-    double value(const StampDelta& delta, const PerfEvent& e) const {
+    Operand operand(const StampConfig& config, const PerfEvent& e) const {
         if (e == DUMMY_EVENT_NANOS) {
+            return {true, 0, 0};
+        }
+        return {false, config.em.get_mapping(e), correct_overhead ? config.overhead_of(e) : 0};
+    }
+
+    double value(const Operand& op, const StampDelta& delta) const {
+        if (op.nanos) {
             return delta.get_nanos();
         }
-        auto v = delta.get_counter(e);
-        if (v == (uint64_t)-1) {
+        if (op.slot == -1) {
             throw ColFailed("fail");
         }
-        return v;
+        auto v = delta.get_counter_at(op.slot);
+        v = v > op.overhead ? v - op.overhead : 0;
+        return v * delta.get_scale_at(op.slot);
     }
 };
 
 EventColumn EVENT_COLUMNS[] = {
 
-        {"INSTRU", "%*.2f", INST_RETIRED_ANY, NoEvent},
+        {"INSTRU", "%*.2f", INST_RETIRED_ANY, NoEvent, true},
         {"IPC", "%*.2f", INST_RETIRED_ANY, CPU_CLK_UNHALTED_THREAD},
         {"UPC", "%*.2f", UOPS_ISSUED_ANY, CPU_CLK_UNHALTED_THREAD},
         {"UOPS", "%*.2f", UOPS_ISSUED_ANY, NoEvent},
@@ -597,7 +893,7 @@ EventColumn EVENT_COLUMNS[] = {
         {"L1_MISS", "%*.1f", MEM_LOAD_RETIRED_L1_MISS, NoEvent},
         {"L1_REPL", "%*.1f", L1D_REPLACEMENT, NoEvent},
 
-        {"Cycles", "%*.2f", CPU_CLK_UNHALTED_THREAD, NoEvent},
+        {"Cycles", "%*.2f", CPU_CLK_UNHALTED_THREAD, NoEvent, true},
         {"Unhalt_GHz", "%*.3f", CPU_CLK_UNHALTED_THREAD, DUMMY_EVENT_NANOS},
         // {"Unhalt_GHz", "%*.3f", CPU_CLK_UNHALTED_REF_TSC, DUMMY_EVENT_NANOS},
 
@@ -612,6 +908,45 @@ EventColumn EVENT_COLUMNS[] = {
 
 };
 
+/**
+ * The multiplexing scale factor of an event column, named <column>_scale, or whether the
+ * column is valid at all, named <column>_valid: 0 if one of its events never made it
+ * onto the PMU during the interval, so there is no value, 1 otherwise.
+ */
+class ScaleColumn : public Column {
+    const EventColumn& col;
+    bool valid;
+
+public:
+    ScaleColumn(const char* heading, const EventColumn& col, bool valid)
+        : Column{heading, valid ? "%*.0f" : "%*.3f"}, col{col}, valid{valid} {}
+
+    void update_config(StampConfig& sc) const override {
+        col.update_config(sc);
+    }
+
+    virtual std::pair<double, bool> get_value(const BenchResults& results) const override {
+        double scale = col.scale(results.delta);
+        return {valid ? !std::isnan(scale) : scale, true};
+    }
+};
+
+/* the _scale and _valid columns for each of EVENT_COLUMNS */
+std::vector<ScaleColumn>& scale_columns() {
+    static std::vector<std::string> headings;
+    static std::vector<ScaleColumn> ret;
+    if (ret.empty()) {
+        for (auto& c : EVENT_COLUMNS) {
+            headings.push_back(std::string(c.get_header()) + "_scale");
+            headings.push_back(std::string(c.get_header()) + "_valid");
+        }
+        for (size_t i = 0; i < headings.size(); i++) {
+            ret.emplace_back(headings[i].c_str(), EVENT_COLUMNS[i / 2], i % 2);
+        }
+    }
+    return ret;
+}
+
 /**
  * The simplest column just lets you specify an "extractor" function to return the value given a
  * BenchResults object.
@@ -619,25 +954,38 @@ EventColumn EVENT_COLUMNS[] = {
 class SimpleColumn : public Column {
 public:
     using extractor_fn = std::function<double(const BenchResults& ir)>;
+    /* the batch version of extractor, used by get_values() */
+    using batch_fn = void (*)(const BatchContext& batch, double* out);
     extractor_fn extractor;
+    batch_fn batch_extractor;
 
-    SimpleColumn(const char* heading, extractor_fn extractor)
-        : Column{heading}, extractor{extractor} {}
+    SimpleColumn(const char* heading, extractor_fn extractor, batch_fn batch_extractor)
+        : Column{heading}, extractor{extractor}, batch_extractor{batch_extractor} {}
 
     virtual std::pair<double, bool> get_value(const BenchResults& results) const override {
         return {extractor(results), true};
     }
+
+    void get_values(const BatchContext& batch, double* out) const override { batch_extractor(batch, out); }
 };
 
 using BR = const BenchResults&;
+using BC = const BatchContext&;
+
+void batch_tsc_delta(BC b, double* out);
+void batch_tscb(BC b, double* out);
+void batch_tsca(BC b, double* out);
+void batch_tscg(BC b, double* out);
+void batch_retries(BC b, double* out);
+void batch_nanos(BC b, double* out);
 
 SimpleColumn BASIC_COLUMNS[] = {
-        {"tsc-delta",  [](BR r) {return (double)r.delta.get_tsc(); }},
-        {"tscb",    [](BR r) { return (double)r.after.tsc_before - r.start_tsc; }}, // tsc before read_counters
-        {"tsca",    [](BR r) { return (double)r.after.tsc - r.start_tsc; }},        // tsc after  read_counters
-        {"tscg",    [](BR r) { return (double)r.after.tsc - r.after.tsc_before; }}, // tscb/a gap
-        {"retries", [](BR r) { return (double)r.after.retries; }},                  // how many times the counters were re-read
-        {"nanos",   [](BR r) { return r.delta.get_nanos(); }}
+        {"tsc-delta",  [](BR r) {return (double)r.delta.get_tsc(); }, batch_tsc_delta},
+        {"tscb",    [](BR r) { return (double)r.after.tsc_before - r.start_tsc; }, batch_tscb}, // tsc before read_counters
+        {"tsca",    [](BR r) { return (double)r.after.tsc - r.start_tsc; }, batch_tsca},        // tsc after  read_counters
+        {"tscg",    [](BR r) { return (double)r.after.tsc - r.after.tsc_before; }, batch_tscg}, // tscb/a gap
+        {"retries", [](BR r) { return (double)r.after.retries; }, batch_retries},               // how many times the counters were re-read
+        {"nanos",   [](BR r) { return r.delta.get_nanos(); }, batch_nanos}
 };
 
 template <class T>
@@ -676,6 +1024,23 @@ MSRColumn MSR_COLUMNS[] = {
     {"volts", 0x198, 32, 47, 1. / 8192.}
 };
 
+/**
+ * A post-output column with a histogram of the latency of every payload call in the
+ * repeat, in TSC cycles.
+ */
+class LatencyColumn : public Column {
+public:
+    LatencyColumn(const char* heading) : Column{heading, nullptr, true} {}
+
+    void update_config(StampConfig& sc) const override {
+        sc.record_latency = true;
+    }
+
+    void print_post(CsvEmitter& out, size_t repeat, const RunResult& result) const override;
+};
+
+LatencyColumn LATENCY_COLUMN{"lathist"};
+
 using ColList = std::vector<Column*>;
 
 /**
@@ -690,7 +1055,9 @@ ColList get_all_columns() {
     };
     add(BASIC_COLUMNS);
     add(EVENT_COLUMNS);
+    add(scale_columns());
     add(MSR_COLUMNS);
+    ret.push_back(&LATENCY_COLUMN);
     return ret;
 }
 
@@ -707,219 +1074,1853 @@ size_t period_cycles;
 size_t resolution_cycles;
 size_t payload_extra_cycles;
 
-void runOne(const test_description* test,
-            const StampConfig& config,
-            const ColList& columns,
-            const ColList& post_columns,
-            const RunArgs& bargs) {
+/** the timing parameters of a run, which a campaign cell can override */
+struct RunParams {
+    size_t test_cycles, period_cycles, resolution_cycles, payload_extra_cycles;
 
-    /* the main benchmark loop */
-    std::vector<BenchResults> result_vector;
+    static RunParams current() {
+        return {::test_cycles, ::period_cycles, ::resolution_cycles, ::payload_extra_cycles};
+    }
 
-    auto args = bargs.get_args();
+    void apply() const {
+        ::test_cycles          = test_cycles;
+        ::period_cycles        = period_cycles;
+        ::resolution_cycles    = resolution_cycles;
+        ::payload_extra_cycles = payload_extra_cycles;
+    }
+};
 
-    struct Sample {
-        uint64_t tsc, period, sdeadline;
-        uint64_t payload_spins, total_spins;
-        uint64_t payload_start_tsc, payload_end_tsc;
-        Stamp stamp;
-    };
+/** one stamp plus the bookkeeping about what the sampling loop was doing before it */
+struct Sample {
+    uint64_t tsc, period, phase, sdeadline;
+    /* the scheduled interval since the previous sample, which varies only in adaptive mode */
+    uint64_t interval;
+    uint64_t payload_spins, total_spins;
+    uint64_t payload_start_tsc, payload_end_tsc;
+    Stamp stamp;
+};
 
-    struct RunResult {
-        std::vector<Sample> samples;
-        uint64_t start_tsc;
-        RunResult(size_t sample_count) : samples(sample_count) {}
-    };
+/** all the samples from one repeat */
+struct RunResult {
+    std::vector<Sample> samples;
+    uint64_t start_tsc;
+    /* the duration of every payload call, only allocated if a post-output column wants it */
+    std::unique_ptr<LatencyHistogram> latency;
+    RunResult(size_t sample_count, bool record_latency = false)
+        : samples(sample_count), latency{record_latency ? new LatencyHistogram : nullptr} {}
+};
 
-    std::vector<RunResult> allresults;
-    allresults.reserve(bargs.repeat_count);
+/* how the sampling loop waits when it isn't running the payload */
+static IdleMode idle_mode;
 
-    for (size_t repeat = 0; repeat < bargs.repeat_count; repeat++) {
+/*
+ * Check that an IDLE_MODE sleep can happen at all in sample intervals of the given
+ * length: a sleep longer than the interval is a usage error, and one that only fails to
+ * fit because of the measured oversleep margin gets a warning.
+ */
+static void check_idle_fits(uint64_t interval, const char* where) {
+    usageCheck(idle_mode.kind != IDLE_SLEEP || idle_mode.sleep_cycles < interval,
+            "the IDLE_MODE sleep of %.1f us is longer than TEST_RES (%.1f us)%s",
+            idle_mode.sleep_ns / 1000., 1000000. * interval / tsc_freq, where);
+    if (!idle_sleep_fits(idle_mode, interval)) {
+        fprintf(stderr, "Warning: the IDLE_MODE sleep of %.1f us plus its %.1f us margin doesn't fit in "
+                "TEST_RES (%.1f us)%s, so the sampler will never sleep\n", idle_mode.sleep_ns / 1000.,
+                1000000. * idle_mode.sleep_margin / tsc_freq, 1000000. * interval / tsc_freq, where);
+    }
+}
 
-        const size_t samples_max = test_cycles / resolution_cycles + 2;
-        allresults.emplace_back(samples_max);
-        auto& stamps = allresults.back().samples;
+/* the payload schedule, if SCHEDULE was given */
+static bool use_schedule;
+static Schedule schedule;
 
-        if (!(test->flags & NO_VZ)) {
-            _mm256_zeroupper();
-        }
-        hot_wait(1000000000ull);
+/* adaptive resolution configuration */
+static bool adaptive;
+static size_t coarse_cycles;
+static size_t adapt_hold_cycles;
+static double adapt_thresh;
+static ColList adapt_columns;
 
-        config.stamp();  // warm
-        uint64_t tsc = rdtsc(), sample_deadline = tsc, period_deadline = tsc;
-        size_t rpos = 0, period = 0;
-        allresults.back().start_tsc = tsc;
-
-        while (rpos < samples_max) {
-            bool first = true;
-            auto payload_deadline = period_deadline + payload_extra_cycles;
-
-            period_deadline += period_cycles;
-            while (tsc < period_deadline && rpos < samples_max) {
-                sample_deadline += resolution_cycles;
-                uint64_t total_spins = 0, payload_spins = 0, payload_start_tsc = rdtsc(), payload_end_tsc = 0;
-                do {
-                    // while waiting to take a sample we either execute the
-                    // busy wait
-                    if (first || tsc < payload_deadline) {
-                        _mm_lfence();
-                        test->call_f(args);
-                        payload_spins++;
-                        tsc = payload_end_tsc = rdtsc();
-                        first = false;
-                    } else {
-                        tsc = rdtsc();
-                    }
-                    total_spins++;
-                } while (tsc < sample_deadline);
+/**
+ * Picks the sampling interval in adaptive mode: coarse (ADAPT_RES) while the watched
+ * columns (ADAPT_COLS) are stable, and the fine TEST_RES for ADAPT_HOLD_US after any of
+ * them changes by more than ADAPT_THRESH (relative) from one sample to the next, or when
+ * a payload phase boundary is less than one coarse interval away.
+ */
+class AdaptiveResolution {
+    /* a watched column, with its events resolved if it is an EventColumn */
+    struct Watch {
+        const Column* col;
+        const EventColumn* ec;
+        EventColumn::Resolved events;
+    };
 
-                if (!no_warm) config.stamp();  // warming, reduces outliers
-                stamps[rpos++] = {tsc, period, sample_deadline, payload_spins, total_spins,
-                        payload_start_tsc, payload_end_tsc, config.stamp()};
-            }
+    const StampConfig& config;
+    Stamp prev;
+    std::vector<Watch> watches;
+    std::vector<double> last;
+    uint64_t fine_until;
 
-            period++;
+public:
+    /* the start of a test is a phase boundary, so we start out fine */
+    AdaptiveResolution(const StampConfig& config, uint64_t start_tsc)
+        : config{config}, last(adapt_columns.size(), std::numeric_limits<double>::quiet_NaN()),
+          fine_until{start_tsc + adapt_hold_cycles} {
+        // resolve the slots of the watched event columns once, rather than per sample
+        for (auto col : adapt_columns) {
+            auto ec = dynamic_cast<const EventColumn*>(col);
+            watches.push_back({col, ec, ec ? ec->resolve(config) : EventColumn::Resolved{}});
         }
     }
 
-
-
-    for (size_t repeat = 0; repeat < bargs.repeat_count; repeat++) {
-        printf("repeat,us,period,sdl,payspin,totspin,paytime");
-        for (auto col : columns) {
-            if (prefix_cols) {
-                printf(",%s %s", test->name, col->get_header());
-            } else {
-                printf(",%s", col->get_header());
+    /**
+     * Given the sample just taken and the TSC of the next phase boundary, return the
+     * interval to use for the next sample.
+     */
+    uint64_t next_interval(const Sample& s, uint64_t next_boundary) {
+        if (prev.tsc != (uint64_t)-1) {
+            StampDelta delta = config.delta(prev, s.stamp);
+            for (size_t c = 0; c < watches.size(); c++) {
+                auto& w = watches[c];
+                double v;
+                try {
+                    v = w.ec ? w.ec->value(w.events, delta)
+                             : w.col->get_final_value(BenchResults{delta, s.stamp, RunArgs{}, 0});
+                } catch (ColFailed&) {
+                    v = std::numeric_limits<double>::quiet_NaN();
+                }
+                if (std::fabs(v - last[c]) > adapt_thresh * std::fabs(last[c])) {
+                    fine_until = s.tsc + adapt_hold_cycles;
+                }
+                last[c] = v;
             }
         }
-        printf("\n");
+        prev = s.stamp;
 
-        const auto& results = allresults.at(repeat);
-        const auto& samples = results.samples;
-
-        for (size_t i = 1; i < samples.size(); i++) {
-            const auto& result = samples.at(i);
-            StampDelta delta = config.delta(samples.at(i - 1).stamp, result.stamp);
-
-            printf("%zu,%.3f,%zu,%zu,%zu,%zu,%zu", repeat, 1000000. * (result.tsc - results.start_tsc) / tsc_freq,
-                    result.period, result.sdeadline - results.start_tsc, result.payload_spins, result.total_spins,
-                    result.payload_spins ? (result.payload_end_tsc  - result.payload_start_tsc) / result.payload_spins : 0);
-            BenchResults br{delta, result.stamp, bargs, results.start_tsc};
-            for (auto column : columns) {
-                double val = column->get_final_value(br);
-                // printf("\nvalue for %s %f\n", column->get_header(), val);
-                ssize_t ival = val;
-                if ((double)ival == val) {
-                    // integer value
-                    printf(",%zd", ival);
-                } else {
-                    printf(",%.3f", val);
-                }
-            }
-            printf("\n");
+        if (next_boundary < s.tsc + coarse_cycles) {
+            fine_until = std::max(fine_until, next_boundary + adapt_hold_cycles);
         }
+        return s.tsc < fine_until ? resolution_cycles : coarse_cycles;
     }
+};
 
-
+/* pre-run conditioning configuration, see condition() */
+static bool cond_fixed;
+static uint64_t cond_poll_cycles, cond_window_cycles, cond_timeout_cycles;
+static double cond_tol;
+/* the package temperature limit in degrees C, or NaN to not check the temperature */
+static double cond_max_temp;
+/* the Unhalt_GHz column, if it is in COLS */
+static const Column* cond_ghz_col;
+
+static constexpr uint32_t MSR_IA32_PACKAGE_THERM_STATUS = 0x1B1;
+static constexpr uint32_t MSR_TEMPERATURE_TARGET        = 0x1A2;
+
+/* TjMax in degrees C from MSR_TEMPERATURE_TARGET, or NaN if it can't be read */
+static double read_tjmax() {
+    uint64_t target;
+    if (read_msr_cur_cpu(MSR_TEMPERATURE_TARGET, &target)) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    return get_bits(target, 16, 23);
 }
 
-int main(int argc, char** argv) {
-    summary     = getenv_bool("SUMMARY");
-    verbose     = !getenv_bool("QUIET");
-    debug       = getenv_bool("DEBUG");
-    prefix_cols = getenv_bool("PREFIX_COLS");
-    no_warm     = getenv_bool("NO_WARM");
-
-    bool dump_tests_flag = getenv_bool("DUMPTESTS");
-    bool do_list_events  = getenv_bool("LIST_EVENTS");  // list the events and quit
-    bool include_slow    = getenv_bool("INCLUDE_SLOW");
-    std::string collist  = getenv_generic<std::string>(
-            "COLS", "tsc-delta,nanos,Cycles,INSTRU,IPC,UPC,Unhalt_GHz");
-
-    constexpr size_t SIZE_INC_DEFAULT = 256 * 1024;
-    constexpr size_t SIZE_STOP_DEFAULT = 20 * 1024 * 1024;
-    size_t size_inc    = getenv_int("INC", SIZE_INC_DEFAULT);
-    size_t size_start  = getenv_int("START",  size_inc);
-    size_t size_stop   = getenv_int("STOP",  SIZE_STOP_DEFAULT);
-    int pincpu         = getenv_int("PINCPU",  0);
-    size_t iters       = getenv_int("ITERS", 100);
-
-    test_cycles          = getenv_longlong("TEST_CYC",   1ull *  100ull * 1000ull * 1000ull);
-    period_cycles        = getenv_longlong("TEST_PER",            10ull * 1000ull * 1000ull);
-    resolution_cycles    = getenv_longlong("TEST_RES",                      10ull * 1000ull);
-    payload_extra_cycles = getenv_longlong("TEST_EXTRA",                                  0);
+/* the package temperature in degrees C, or NaN if it can't be read */
+static double read_package_temp() {
+    uint64_t status;
+    double tjmax = read_tjmax();
+    if (std::isnan(tjmax) || read_msr_cur_cpu(MSR_IA32_PACKAGE_THERM_STATUS, &status)) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    // the digital readout is the number of degrees below TjMax
+    return tjmax - get_bits(status, 16, 22);
+}
 
-    // size
+/*
+ * Keep the core busy with 1000 dependent imuls, i.e., 3000 cycles on every recent core
+ * (a chain of adds would be less reliable, since newer cores can fold add immediates).
+ */
+static constexpr double IMUL_CHAIN_CYCLES = 3000;
+static void imul_chain() {
+    uint64_t x = 1;
+    asm volatile (".rept 1000\n\timul %0, %0\n\t.endr" : "+r"(x));
+}
 
-    if (size_inc != SIZE_INC_DEFAULT || size_stop != SIZE_STOP_DEFAULT) {
-        throw std::runtime_error("adjusting the size stop/stop/inc is not supported ");
+/**
+ * Bring the core to a steady state before a repeat starts sampling. Rather than spinning
+ * for a fixed time, run a warm-up loop and measure the frequency every COND_POLL_US,
+ * from the Unhalt_GHz column if it is in COLS and works, otherwise from the speed of a
+ * chain of dependent imuls. Conditioning ends once the frequency has stayed within a
+ * relative COND_TOL for COND_WINDOW_US and the package temperature (if the thermal MSRs
+ * can be read) is at most COND_MAX_TEMP, or after COND_TIMEOUT_MS with a warning. While
+ * the package is too hot we sleep rather than spin, so it can cool down.
+ *
+ * CONDITION=fixed restores the old fixed-length spin instead.
+ */
+static void condition(const StampConfig& config) {
+    if (cond_fixed) {
+        hot_wait(1000000000ull);
+        return;
     }
 
-    assert(iters > 0);
-
-    if (verbose)
-        set_verbose(true);  // set perf-timer to verbose too
+    const uint64_t start = rdtsc(), deadline = start + cond_timeout_cycles;
+    uint64_t stable_since = start;
+    double lo = NAN, hi = NAN, temp = NAN;
+    Stamp prev = config.stamp();
+    while (true) {
+        size_t chains = 0;
+        do {
+            imul_chain();
+            chains++;
+        } while (rdtsc() < prev.tsc + cond_poll_cycles);
+        Stamp cur = config.stamp();
+
+        double ghz = NAN;
+        if (cond_ghz_col) {
+            try {
+                ghz = cond_ghz_col->get_final_value({config.delta(prev, cur), cur, RunArgs{}, 0});
+            } catch (ColFailed&) {
+            }
+        }
+        if (!(ghz > 0)) {
+            ghz = chains * IMUL_CHAIN_CYCLES / (1000000000. * (cur.tsc - prev.tsc) / tsc_freq);
+        }
 
-    if (dump_tests_flag) {
-        dump_tests();
-        exit(EXIT_SUCCESS);
-    }
+        if (!std::isnan(cond_max_temp) && (temp = read_package_temp()) > cond_max_temp) {
+            // too hot: let the package cool down, and start the stable window over
+            usleep(1000000. * cond_poll_cycles / tsc_freq);
+            lo = hi = NAN;
+            cur = config.stamp();
+            stable_since = cur.tsc;
+        } else if (std::isnan(lo) || std::max(hi, ghz) > std::min(lo, ghz) * (1. + cond_tol)) {
+            lo = hi = ghz;
+            stable_since = prev.tsc;
+        } else {
+            lo = std::min(lo, ghz);
+            hi = std::max(hi, ghz);
+        }
+        prev = cur;
 
-    if (do_list_events) {
-        list_events();
-        exit(EXIT_SUCCESS);
+        if (!std::isnan(lo) && cur.tsc - stable_since >= cond_window_cycles) {
+            vprint("Conditioned in %.1f ms: %.3f GHz, %.0f C\n", 1000. * (cur.tsc - start) / tsc_freq, ghz, temp);
+            return;
+        }
+        if (cur.tsc >= deadline) {
+            fprintf(stderr, "Warning: conditioning timed out after %.1f ms (last %.3f GHz, %.0f C)\n",
+                    1000. * (cur.tsc - start) / tsc_freq, ghz, temp);
+            return;
+        }
     }
+}
 
-    usageCheck(argc == 1 || argc == 2, "Must provide 0 or 1 arguments");
+/** the default start gate for sample_loop: start right away */
+struct StartNow {
+    uint64_t operator()() const { return rdtsc(); }
+};
 
-    std::vector<test_description> tests;
+/**
+ * The pinned sampling loop for a single repeat: runs the payload according to the
+ * duty cycle configuration and takes a stamp every resolution_cycles, handing each
+ * Sample to sink as soon as it is taken.
+ *
+ * With a schedule, the payload is whatever test the current phase of the schedule
+ * names, run continuously, and one period is one pass through the schedule.
+ *
+ * In adaptive mode the interval between stamps varies (see AdaptiveResolution) and the
+ * loop ends after test_cycles rather than after a fixed number of samples, so fewer
+ * than samples_max samples may be taken.
+ *
+ * Once warmed up, the loop calls gate(), which returns when sampling should start and
+ * the TSC value to use as the start of the sample schedule.
+ *
+ * start_tsc is written before the first sample is passed to sink. If latency isn't null,
+ * the duration of every payload call is recorded in it.
+ */
+template <typename S, typename G = StartNow>
+void sample_loop(const test_description* test, const StampConfig& config, const bench_args& args,
+        uint64_t& start_tsc, LatencyHistogram* latency, S&& sink, G&& gate = G{}) {
+    const size_t samples_max = test_cycles / resolution_cycles + 2;
 
-    if (argc > 1) {
-        tests = get_by_list(argv[1]);
-    } else {
-        // all tests
-        for (auto t : get_all()) {
-            if ((include_slow || !(t.flags & SLOW))) {
-                tests.push_back(t);
+    if (!(test->flags & NO_VZ)) {
+        _mm256_zeroupper();
+    }
+    condition(config);
+    config.reserve_mux(samples_max);
+
+    config.stamp();  // warm
+    uint64_t tsc = gate(), sample_deadline = tsc, period_deadline = tsc;
+    size_t rpos = 0, period = 0;
+    start_tsc = tsc;
+
+    const uint64_t end_tsc = tsc + test_cycles + resolution_cycles;
+    AdaptiveResolution adapt(config, tsc);
+    PhaseCursor cursor(schedule, tsc);
+    uint64_t interval = resolution_cycles;
+    auto more = [&] { return rpos < samples_max && (!adaptive || sample_deadline < end_tsc); };
+
+    while (more()) {
+        bool first = true;
+        auto payload_deadline = period_deadline + payload_extra_cycles;
+
+        period_deadline += period_cycles;
+        while (tsc < period_deadline && more()) {
+            sample_deadline += interval;
+            uint64_t total_spins = 0, payload_spins = 0, payload_start_tsc = rdtsc(), payload_end_tsc = 0;
+            uint64_t last_tsc = payload_start_tsc;
+            do {
+                // while waiting to take a sample we either execute the
+                // payload or idle
+                const test_description* payload = use_schedule ? cursor.at(tsc)
+                        : (first || tsc < payload_deadline) ? test : nullptr;
+                if (payload) {
+                    _mm_lfence();
+                    payload->call_f(args);
+                    payload_spins++;
+                    tsc = payload_end_tsc = rdtsc();
+                    first = false;
+                    if (latency) {
+                        latency->record(tsc - last_tsc);
+                    }
+                } else {
+                    tsc = idle_step(idle_mode, sample_deadline);
+                }
+                last_tsc = tsc;
+                total_spins++;
+            } while (tsc < sample_deadline);
+
+            if (!no_warm) config.stamp();  // warming, reduces outliers
+            Sample s{tsc, period, cursor.index(), sample_deadline, interval, payload_spins, total_spins,
+                    payload_start_tsc, payload_end_tsc, config.stamp(true)};
+            sink(s);
+            rpos++;
+            if (adaptive) {
+                uint64_t boundary = use_schedule ? cursor.next_deadline()
+                        : tsc < payload_deadline ? payload_deadline : period_deadline;
+                interval = adapt.next_interval(s, boundary);
             }
         }
-    }
 
-    pinToCpu(pincpu);
+        period++;
+    }
+}
 
-    ColList allcolumns, columns, post_columns;
-    for (auto requested : split(collist, ",")) {
-        if (requested.empty()) {
+void LatencyColumn::print_post(CsvEmitter& out, size_t repeat, const RunResult& result) const {
+    assert(result.latency);
+    const auto& hist = *result.latency;
+    out.put("repeat,lat_lo,lat_hi,count,cum_pct\n");
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LatencyHistogram::BUCKETS; i++) {
+        uint64_t count = hist.bucket_count(i);
+        if (!count) {
             continue;
         }
-        bool found = false;
-        for (auto& col : get_all_columns()) {
-            if (requested == col->get_header()) {
-                allcolumns.push_back(col);
-                found = true;
-                break;
-            }
+        seen += count;
+        for (uint64_t v : {(uint64_t)repeat, hist.bucket_low(i), hist.bucket_high(i), count}) {
+            out.put_uint(v);
+            out.put(',');
         }
-        usageCheck(found, "No column named %s", requested.c_str());
+        out.put_fixed3(100. * seen / hist.count());
+        out.put('\n');
+    }
+    vprint("Payload latency, repeat %zu: %zu calls, p50 %zu p99 %zu p99.9 %zu max %zu cycles\n", repeat,
+            (size_t)hist.count(), (size_t)hist.value_at_percentile(50), (size_t)hist.value_at_percentile(99),
+            (size_t)hist.value_at_percentile(99.9), (size_t)hist.value_at_percentile(100));
+}
+
+/* the cpus to sample on concurrently in multi-cpu mode, empty otherwise */
+static std::vector<int> sample_cpus;
+/* true if rows include the cpu they were sampled on (multi-cpu and SMT modes) */
+static bool cpu_column;
+/* true if sweeping over working set sizes (START to STOP), so rows include the size */
+static bool size_sweep;
+
+/** the names of the fixed leading fields of each row */
+const char* const FIXED_HEADINGS[] = {"repeat", "us", "period", "sdl", "payspin", "totspin", "paytime"};
+
+/** the fixed headings actually output: cpu and interval only appear in the modes that vary them */
+std::vector<std::string> fixed_headings() {
+    std::vector<std::string> ret;
+    for (auto h : FIXED_HEADINGS) {
+        ret.push_back(h);
+        if (ret.back() == "repeat" && cpu_column) {
+            ret.push_back("cpu");
+        }
+        if (ret.back() == (cpu_column ? "cpu" : "repeat") && size_sweep) {
+            ret.push_back("size");
+        }
+        if (ret.back() == "period" && use_schedule) {
+            ret.push_back("phase");
+        }
+        if (ret.back() == "sdl" && adaptive) {
+            ret.push_back("interval");
+        }
+    }
+    return ret;
+}
+
+/** the values that make up one output row */
+struct RowValues {
+    size_t repeat;
+    /* the sampling cpu, only output in multi-cpu mode */
+    int cpu = -1;
+    /* the working set size, only output when sweeping sizes */
+    size_t size = 0;
+    double us;
+    uint64_t period, sdl, payspin, totspin, paytime;
+    /* the schedule phase, only output with a schedule */
+    uint64_t phase;
+    /* the sampling interval, only output in adaptive mode */
+    uint64_t interval;
+    /* one value per column */
+    std::vector<double> vals;
+};
+
+std::string column_heading(const test_description* test, const Column* col) {
+    return prefix_cols ? std::string(test->name) + " " + col->get_header() : col->get_header();
+}
+
+void print_header(CsvEmitter& out, const test_description* test, const ColList& columns) {
+    bool first = true;
+    for (auto& h : fixed_headings()) {
+        if (!first) {
+            out.put(',');
+        }
+        out.put(h.c_str());
+        first = false;
+    }
+    for (auto col : columns) {
+        out.put(',');
+        out.put(column_heading(test, col).c_str());
+    }
+    out.put('\n');
+}
+
+/** fill in the fields of row that come straight from sample result rather than from columns */
+void eval_fixed(size_t repeat, const Sample& result, uint64_t start_tsc, RowValues& row) {
+    row.repeat  = repeat;
+    row.us      = 1000000. * (result.tsc - start_tsc) / tsc_freq;
+    row.period  = result.period;
+    row.phase   = result.phase;
+    row.sdl     = result.sdeadline - start_tsc;
+    row.interval = result.interval;
+    row.payspin = result.payload_spins;
+    row.totspin = result.total_spins;
+    row.paytime = result.payload_spins ? (result.payload_end_tsc  - result.payload_start_tsc) / result.payload_spins : 0;
+}
+
+/** evaluate the row for sample result, whose deltas are relative to prev */
+void eval_row(size_t repeat, const Sample& prev, const Sample& result, uint64_t start_tsc,
+        const StampConfig& config, const ColList& columns, const RunArgs& bargs, RowValues& row) {
+    eval_fixed(repeat, result, start_tsc, row);
+    row.size = bargs.size;
+
+    BenchResults br{config.delta(prev.stamp, result.stamp), result.stamp, bargs, start_tsc};
+    row.vals.resize(columns.size());
+    for (size_t c = 0; c < columns.size(); c++) {
+        row.vals[c] = columns[c]->get_final_value(br);
+    }
+}
+
+/**
+ * The stamps of a repeat's samples stored column-wise, so that columns can be evaluated
+ * for all rows at once by whole-array kernels.
+ */
+struct SampleBatch {
+    std::vector<uint64_t> tsc, tsc_before, retries;
+    /*
+     * One array per configured counter slot, and with multiplexed counters the same for
+     * their enabled and running times, which are otherwise empty.
+     */
+    std::vector<std::vector<uint64_t>> counters, enabled, running;
+
+    /** load count samples taken with config, reusing the existing arrays */
+    void load(const Sample* samples, size_t count, const StampConfig& config) {
+        size_t counter_count = config.em.get_events().size();
+        tsc.resize(count);
+        tsc_before.resize(count);
+        retries.resize(count);
+        for (auto arrays : {&counters, &enabled, &running}) {
+            arrays->resize(arrays == &counters || config.multiplexed ? counter_count : 0);
+            for (auto& c : *arrays) {
+                c.resize(count);
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            const Stamp& stamp = samples[i].stamp;
+            tsc[i]        = stamp.tsc;
+            tsc_before[i] = stamp.tsc_before;
+            retries[i]    = stamp.retries;
+            if (config.multiplexed) {
+                const mux_counts& mux = config.mux_at(stamp.mux_idx);
+                for (size_t c = 0; c < counter_count; c++) {
+                    counters[c][i] = mux.counts[c];
+                    enabled[c][i]  = mux.enabled[c];
+                    running[c][i]  = mux.running[c];
+                }
+            } else {
+                for (size_t c = 0; c < counter_count; c++) {
+                    counters[c][i] = stamp.counters.counts[c];
+                }
+            }
+        }
+    }
+};
+
+/** a batch of count samples to evaluate columns over: row i covers samples i and i + 1 */
+struct BatchContext {
+    const Sample* samples;
+    size_t count;
+    const SampleBatch& batch;
+    const StampConfig& config;
+    const RunArgs& args;
+    uint64_t start_tsc;
+
+    size_t rows() const { return count ? count - 1 : 0; }
+};
+
+void Column::get_values(const BatchContext& b, double* out) const {
+    for (size_t i = 0; i < b.rows(); i++) {
+        const Stamp& after = b.samples[i + 1].stamp;
+        BenchResults br{b.config.delta(b.samples[i].stamp, after), after, b.args, b.start_tsc};
+        out[i] = get_final_value(br);
+    }
+}
+
+void EventColumn::get_values(const BatchContext& b, double* out) const {
+    auto values = [&](const Operand& op, double* dst) {
+        if (op.nanos) {
+            batch_nanos(b, dst);
+            return;
+        }
+        ssize_t idx = op.slot;
+        if (idx == -1) {
+            throw ColFailed("fail");
+        }
+        batch_delta(b.batch.counters[idx].data(), b.count, op.overhead, dst);
+        if (!b.config.multiplexed) {
+            return;
+        }
+        auto& enabled = b.batch.enabled[idx];
+        auto& running = b.batch.running[idx];
+        for (size_t i = 0; i < b.rows(); i++) {
+            dst[i] *= scale_factor(enabled[i + 1] - enabled[i], running[i + 1] - running[i]);
+        }
+    };
+    Resolved r = resolve(b.config);
+    values(r.top, out);
+    if (is_ratio()) {
+        std::vector<double> bottom_vals(b.rows());
+        values(r.bottom, bottom_vals.data());
+        batch_divide(out, bottom_vals.data(), b.rows(), out);
+    }
+}
+
+void batch_tsc_delta(BC b, double* out) {
+    batch_delta(b.batch.tsc.data(), b.count, 0, out);
+}
+
+void batch_tscb(BC b, double* out) {
+    for (size_t i = 0; i < b.rows(); i++) {
+        out[i] = (double)b.batch.tsc_before[i + 1] - b.start_tsc;
+    }
+}
+
+void batch_tsca(BC b, double* out) {
+    for (size_t i = 0; i < b.rows(); i++) {
+        out[i] = (double)b.batch.tsc[i + 1] - b.start_tsc;
+    }
+}
+
+void batch_tscg(BC b, double* out) {
+    for (size_t i = 0; i < b.rows(); i++) {
+        out[i] = (double)b.batch.tsc[i + 1] - b.batch.tsc_before[i + 1];
+    }
+}
+
+void batch_retries(BC b, double* out) {
+    for (size_t i = 0; i < b.rows(); i++) {
+        out[i] = (double)b.batch.retries[i + 1];
+    }
+}
+
+void batch_nanos(BC b, double* out) {
+    batch_tsc_delta(b, out);
+    batch_mul_div(out, b.rows(), 1000000000., tsc_freq, out);
+}
+
+/**
+ * Evaluate every row of one repeat's samples, calling f(row) for each in order. Each
+ * column is evaluated over a chunk of rows at a time (see Column::get_values), with the
+ * chunk small enough that its arrays stay in cache.
+ */
+template <typename F>
+void eval_repeat(size_t repeat, const std::vector<Sample>& samples, uint64_t start_tsc,
+        const StampConfig& config, const ColList& columns, const RunArgs& bargs, F&& f) {
+    constexpr size_t CHUNK_ROWS = 1024;
+    const size_t total_rows = samples.empty() ? 0 : samples.size() - 1;
+
+    SampleBatch batch;
+    std::vector<double> vals(columns.size() * CHUNK_ROWS);
+    RowValues row;
+    row.vals.resize(columns.size());
+
+    for (size_t first = 0; first < total_rows; first += CHUNK_ROWS) {
+        const size_t rows = std::min(CHUNK_ROWS, total_rows - first);
+        // rows first .. first + rows - 1 need samples first .. first + rows
+        batch.load(&samples[first], rows + 1, config);
+        BatchContext ctx{&samples[first], rows + 1, batch, config, bargs, start_tsc};
+        for (size_t c = 0; c < columns.size(); c++) {
+            columns[c]->get_values(ctx, &vals[c * CHUNK_ROWS]);
+        }
+        for (size_t i = 0; i < rows; i++) {
+            eval_fixed(repeat, samples[first + i + 1], start_tsc, row);
+            row.size = bargs.size;
+            for (size_t c = 0; c < columns.size(); c++) {
+                row.vals[c] = vals[c * CHUNK_ROWS + i];
+            }
+            f(row);
+        }
+    }
+}
+
+void print_row(CsvEmitter& out, const RowValues& row) {
+    out.put_uint(row.repeat);
+    out.put(',');
+    if (row.cpu >= 0) {
+        out.put_uint(row.cpu);
+        out.put(',');
+    }
+    if (size_sweep) {
+        out.put_uint(row.size);
+        out.put(',');
+    }
+    out.put_fixed3(row.us);
+    out.put(',');
+    out.put_uint(row.period);
+    if (use_schedule) {
+        out.put(',');
+        out.put_uint(row.phase);
+    }
+    out.put(',');
+    out.put_uint(row.sdl);
+    if (adaptive) {
+        out.put(',');
+        out.put_uint(row.interval);
+    }
+    for (uint64_t v : {row.payspin, row.totspin, row.paytime}) {
+        out.put(',');
+        out.put_uint(v);
+    }
+    for (double val : row.vals) {
+        out.put(',');
+        out.put_value(val);
+    }
+    out.put('\n');
+}
+
+/* if non-empty, write a binary trace per test into this directory instead of printing CSV */
+static std::string trace_dir;
+
+/**
+ * Writes rows to a binary trace file (see trace-file.hpp) rather than printing them.
+ */
+class TraceOutput {
+    TraceWriter writer;
+    size_t rows;
+
+    static std::vector<TraceColumn> trace_columns(const test_description* test, const ColList& columns) {
+        std::vector<TraceColumn> ret;
+        for (auto& h : fixed_headings()) {
+            ret.push_back({h, h == "us" ? TRACE_FIXED3 : TRACE_UINT});
+        }
+        for (auto col : columns) {
+            ret.push_back({column_heading(test, col), TRACE_VALUE});
+        }
+        return ret;
+    }
+
+    static TraceInfo trace_info() {
+        auto fm = get_family_model();
+        return {(double)tsc_freq, fm.family, fm.model, fm.stepping, get_brand_string()};
     }
 
-    std::copy_if(allcolumns.begin(), allcolumns.end(), std::back_inserter(columns),
+public:
+    /** when sweeping sizes there is one trace per test and size, named like test-size.trace */
+    TraceOutput(const test_description* test, const ColList& columns, const RunArgs& bargs, size_t row_capacity)
+        : writer{trace_dir + "/" + test->name + (size_sweep ? "-" + std::to_string(bargs.size) : "") + ".trace",
+                 trace_columns(test, columns), row_capacity, trace_info()},
+          rows{0} {
+        vprint("Writing trace to %s\n", writer.get_path().c_str());
+    }
+
+    void add(const RowValues& row) {
+        size_t c = 0;
+        writer.set(c++, rows, (uint64_t)row.repeat);
+        if (row.cpu >= 0) {
+            writer.set(c++, rows, (uint64_t)row.cpu);
+        }
+        if (size_sweep) {
+            writer.set(c++, rows, (uint64_t)row.size);
+        }
+        writer.set(c++, rows, row.us);
+        writer.set(c++, rows, row.period);
+        if (use_schedule) {
+            writer.set(c++, rows, row.phase);
+        }
+        writer.set(c++, rows, row.sdl);
+        if (adaptive) {
+            writer.set(c++, rows, row.interval);
+        }
+        writer.set(c++, rows, row.payspin);
+        writer.set(c++, rows, row.totspin);
+        writer.set(c++, rows, row.paytime);
+        for (double val : row.vals) {
+            writer.set(c++, rows, val);
+        }
+        writer.set_row_count(++rows);
+    }
+};
+
+/** output a row to the trace, if any, otherwise as CSV */
+void output_row(TraceOutput* trace, CsvEmitter& out, const RowValues& row) {
+    if (trace) {
+        trace->add(row);
+    } else {
+        print_row(out, row);
+    }
+}
+
+/* streaming mode configuration */
+static bool stream_mode;
+static size_t stream_buf;
+static int writer_cpu;
+static cpu_set_t initial_affinity;
+
+/**
+ * Pin the calling (writer) thread away from the sampling cpu: to writer_cpu if it was
+ * specified, otherwise to every cpu in the original affinity mask except pincpu.
+ */
+void pin_writer(int pincpu) {
+    cpu_set_t set;
+    if (writer_cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(writer_cpu, &set);
+    } else {
+        set = initial_affinity;
+        CPU_CLR(pincpu, &set);
+        if (CPU_COUNT(&set) == 0) {
+            fprintf(stderr, "WARNING: no cpu other than %d available, stream writer shares the sampling cpu\n", pincpu);
+            return;
+        }
+    }
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        fprintf(stderr, "WARNING: pinning the stream writer failed: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Run one repeat in streaming mode: the calling (pinned) thread samples into a fixed-size
+ * SPSC ring and a writer thread drains it, computes deltas and prints rows while the
+ * test is still running. Memory use depends only on STREAM_BUF, not on TEST_CYC.
+ */
+void stream_repeat(size_t repeat,
+                   const test_description* test,
+                   const StampConfig& config,
+                   const ColList& columns,
+                   const ColList& post_columns,
+                   const RunArgs& bargs,
+                   SpscRing<Sample>& ring,
+                   TraceOutput* trace) {
+    const int sample_cpu = sched_getcpu();
+    std::atomic<bool> done{false};
+    uint64_t start_tsc = 0;
+    // holds only what the post-output columns need, not the samples
+    std::unique_ptr<RunResult> post(post_columns.empty() ? nullptr : new RunResult(0, config.record_latency));
+
+    ring.reset();
+
+    std::thread writer([&]() {
+        pin_writer(sample_cpu);
+        CsvEmitter out(csv_out);
+        Sample prev, cur;
+        RowValues row;
+        bool have_prev = false;
+        if (!trace) {
+            print_header(out, test, columns);
+        }
+        while (true) {
+            // check done before popping so that we don't miss samples pushed just before it was set
+            bool finished = done.load(std::memory_order_acquire);
+            if (!ring.try_pop(cur)) {
+                if (finished) {
+                    break;
+                }
+                // caught up with the sampler: a good time to get what we have out the door
+                if (out.pending()) {
+                    out.flush();
+                }
+                _mm_pause();
+                continue;
+            }
+            if (have_prev) {
+                eval_row(repeat, prev, cur, start_tsc, config, columns, bargs, row);
+                output_row(trace, out, row);
+            }
+            prev      = cur;
+            have_prev = true;
+        }
+    });
+
+    size_t stalls = 0;
+    auto args = bargs.get_args();
+    sample_loop(test, config, args, start_tsc, post ? post->latency.get() : nullptr, [&](const Sample& s) {
+        while (HEDLEY_UNLIKELY(!ring.try_push(s))) {
+            stalls++;
+            _mm_pause();
+        }
+    });
+
+    done.store(true, std::memory_order_release);
+    writer.join();
+
+    if (post) {
+        post->start_tsc = start_tsc;
+        CsvEmitter out(csv_out);
+        for (auto col : post_columns) {
+            col->print_post(out, repeat, *post);
+        }
+    }
+
+    if (stalls) {
+        fprintf(stderr, "WARNING: stream ring (%zu samples) was full %zu times in repeat %zu, "
+                "sample timing was perturbed: increase STREAM_BUF\n", ring.capacity(), stalls, repeat);
+    }
+}
+
+/* transition detection mode configuration */
+static bool transitions_mode;
+static double trans_thresh;
+static size_t trans_settle;
+
+/* cross-repeat aggregation configuration */
+static bool aggregate;
+static bool align_transition;
+static std::string align_col;
+static double align_thresh;
+
+/**
+ * Find the first transition in series, the per-sample values of a frequency column such
+ * as Unhalt_GHz, with the same TransitionDetector as TRANSITIONS mode (thresh relative,
+ * TRANS_SETTLE samples to settle). Returns the index of the sample that starts the first
+ * transition to settle at a new level, or -1 if there is none.
+ */
+ssize_t find_transition(const std::vector<double>& series, double thresh) {
+    // each sample goes in as one tick at series[i] GHz, so the start TSC is its index
+    TransitionDetector detector(1., thresh, 10, trans_settle);
+    Transition t;
+    for (size_t i = 0; i < series.size(); i++) {
+        if (detector.add(i + 1, 1, series[i], t)) {
+            return t.start_tsc;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Aggregates the rows of many repeats into per-bucket summaries: every column of every
+ * bucket gets a constant-size quantile sketch, so memory depends on the number of buckets
+ * (samples per repeat) and columns, but not on the number of repeats.
+ */
+class RepeatAggregator {
+    using Sketch = PSquareSketch<3>;
+    static const PSquareSpec<3> spec;
+
+    size_t bucket_count, col_count;
+    std::vector<Sketch> sketches;  // bucket-major
+    std::vector<double> us_sum;
+    std::vector<uint32_t> rows_seen;
+
+public:
+    RepeatAggregator(size_t bucket_count, size_t col_count)
+        : bucket_count{bucket_count}, col_count{col_count}, sketches(bucket_count * col_count),
+          us_sum(bucket_count), rows_seen(bucket_count) {}
+
+    /** add the given row to bucket, rows falling outside the buckets are ignored */
+    void add(ssize_t bucket, const RowValues& row) {
+        if (bucket < 0 || (size_t)bucket >= bucket_count) {
+            return;
+        }
+        assert(row.vals.size() == col_count);
+        us_sum[bucket] += row.us;
+        rows_seen[bucket]++;
+        Sketch* bs = &sketches[bucket * col_count];
+        for (size_t c = 0; c < col_count; c++) {
+            if (!std::isnan(row.vals[c])) {
+                bs[c].add(spec, row.vals[c]);
+            }
+        }
+    }
+
+    void print(CsvEmitter& out, const test_description* test, const ColList& columns) const {
+        out.put("bucket,us,n");
+        for (auto col : columns) {
+            for (auto suffix : {"min", "p10", "med", "p90", "max"}) {
+                out.put(',');
+                out.put((column_heading(test, col) + "_" + suffix).c_str());
+            }
+        }
+        out.put('\n');
+        for (size_t b = 0; b < bucket_count; b++) {
+            if (!rows_seen[b]) {
+                continue;
+            }
+            out.put_uint(b);
+            out.put(',');
+            out.put_fixed3(us_sum[b] / rows_seen[b]);
+            out.put(',');
+            out.put_uint(rows_seen[b]);
+            const Sketch* bs = &sketches[b * col_count];
+            for (size_t c = 0; c < col_count; c++) {
+                for (double v : {bs[c].min(), bs[c].quantile(spec, 0), bs[c].quantile(spec, 1),
+                                 bs[c].quantile(spec, 2), bs[c].max()}) {
+                    out.put(',');
+                    out.put_value(v);
+                }
+            }
+            out.put('\n');
+        }
+    }
+};
+
+const PSquareSpec<3> RepeatAggregator::spec{{0.1, 0.5, 0.9}};
+
+/**
+ * Run all repeats and print only the per-bucket aggregate. Only one repeat's samples are
+ * held in memory at a time.
+ */
+void run_aggregated(const test_description* test,
+                    const StampConfig& config,
+                    const ColList& columns,
+                    const RunArgs& bargs,
+                    size_t samples_max) {
+    const size_t rows_per_repeat = samples_max - 1;
+    ssize_t align_idx = -1;
+    if (align_transition) {
+        auto it = std::find_if(columns.begin(), columns.end(),
+                [](const Column* c) { return align_col == c->get_header(); });
+        if (it == columns.end()) {
+            throw std::runtime_error("ALIGN=transition needs the ALIGN_COL column (" + align_col + ") in COLS");
+        }
+        align_idx = it - columns.begin();
+    }
+
+    // when aligning on transitions, the transition in every repeat lands on the same bucket: the
+    // middle one, so there is room on both sides
+    const size_t anchor = align_transition ? rows_per_repeat / 2 : 0;
+    RepeatAggregator agg(align_transition ? 2 * anchor + 1 : rows_per_repeat, columns.size());
+
+    auto args = bargs.get_args();
+    std::vector<Sample> samples(samples_max);
+    std::vector<RowValues> rows(rows_per_repeat);
+    std::vector<double> series(rows_per_repeat);
+    size_t unaligned = 0;
+
+    for (size_t repeat = 0; repeat < bargs.repeat_count; repeat++) {
+        uint64_t start_tsc;
+        size_t rpos = 0;
+        sample_loop(test, config, args, start_tsc, nullptr, [&](const Sample& s) { samples[rpos++] = s; });
+
+        size_t r = 0;
+        eval_repeat(repeat, samples, start_tsc, config, columns, bargs, [&](const RowValues& row) { rows[r++] = row; });
+
+        ssize_t offset = 0;
+        if (align_transition) {
+            for (size_t i = 0; i < rows_per_repeat; i++) {
+                series[i] = rows[i].vals[align_idx];
+            }
+            ssize_t t = find_transition(series, align_thresh);
+            if (t < 0) {
+                unaligned++;
+                continue;
+            }
+            offset = (ssize_t)anchor - t;
+        }
+
+        for (size_t i = 0; i < rows_per_repeat; i++) {
+            agg.add(i + offset, rows[i]);
+        }
+    }
+
+    if (unaligned) {
+        fprintf(stderr, "WARNING: no transition found in %s in %zu of %zu repeats, those repeats were dropped\n",
+                align_col.c_str(), unaligned, bargs.repeat_count);
+    }
+
+    CsvEmitter out(csv_out);
+    agg.print(out, test, columns);
+}
+
+/* how far in the future the shared start deadline is set, once all threads are ready */
+static double sync_us;
+
+/** everything one sampler thread produces in multi-cpu mode, including its own counters */
+struct CpuRun {
+    int cpu;
+    const test_description* test;
+    StampConfig config;
+    std::vector<RunResult> results;
+};
+
+/**
+ * Run the sampling loop concurrently on every cpu in runs (whose cpu and test must be
+ * filled in), one pinned thread per cpu, each with its own counters. Every repeat, the
+ * threads warm up independently, meet at a barrier and then all start sampling at the
+ * same TSC deadline, so sample i of every cpu was scheduled for the same instant.
+ *
+ * If any thread fails, the barrier is aborted so the others stop too, and once all
+ * threads have exited the first failure is thrown.
+ */
+void sample_multi(std::vector<CpuRun>& runs,
+                  const ColList& columns,
+                  const RunArgs& bargs,
+                  size_t samples_max) {
+    std::vector<int> cpus;
+    for (auto& run : runs) {
+        cpus.push_back(run.cpu);
+    }
+    std::mutex setup_lock;
+
+    run_pinned(cpus, sync_us * tsc_freq / 1000000., [&](size_t i, const StartGate& gate) {
+        CpuRun& run = runs[i];
+        {
+            // event resolution in jevents isn't thread-safe
+            std::lock_guard<std::mutex> guard(setup_lock);
+            for (auto& col : columns) {
+                col->update_config(run.config);
+            }
+            run.config.prepare();
+        }
+        run.config.reserve_mux(bargs.repeat_count * samples_max);
+
+        auto args = bargs.get_args();
+        for (size_t repeat = 0; repeat < bargs.repeat_count; repeat++) {
+            run.results.emplace_back(samples_max);
+            auto& result = run.results.back();
+            size_t rpos = 0;
+            sample_loop(run.test, run.config, args, result.start_tsc, nullptr,
+                    [&](const Sample& s) { result.samples[rpos++] = s; }, gate);
+        }
+    });
+}
+
+/**
+ * Output the samples of all runs as a single trace with a cpu column, interleaved by
+ * sample index: sample i of every cpu, in CPUS order, then sample i + 1. Samples with
+ * the same index were scheduled for the same instant, but actually ran a little apart.
+ */
+void print_multi(const std::vector<CpuRun>& runs,
+                 const test_description* test,
+                 const ColList& columns,
+                 const RunArgs& bargs,
+                 size_t samples_max) {
+    std::unique_ptr<TraceOutput> trace;
+    if (!trace_dir.empty()) {
+        trace.reset(new TraceOutput(test, columns, bargs, bargs.repeat_count * (samples_max - 1) * runs.size()));
+    }
+
+    CsvEmitter out(csv_out);
+    RowValues row;
+    for (size_t repeat = 0; repeat < bargs.repeat_count; repeat++) {
+        if (!trace) {
+            print_header(out, test, columns);
+        }
+        for (size_t i = 1; i < samples_max; i++) {
+            for (auto& run : runs) {
+                const auto& result = run.results.at(repeat);
+                eval_row(repeat, result.samples[i - 1], result.samples[i], result.start_tsc, run.config, columns, bargs, row);
+                row.cpu = run.cpu;
+                output_row(trace.get(), out, row);
+            }
+        }
+        out.flush();
+    }
+}
+
+/**
+ * Multi-cpu mode: run test on every cpu in sample_cpus at once.
+ */
+void run_multi(const test_description* test,
+               const ColList& columns,
+               const RunArgs& bargs,
+               size_t samples_max) {
+    std::vector<CpuRun> runs(sample_cpus.size());
+    for (size_t t = 0; t < runs.size(); t++) {
+        runs[t].cpu  = sample_cpus[t];
+        runs[t].test = test;
+    }
+    sample_multi(runs, columns, bargs, samples_max);
+    print_multi(runs, test, columns, bargs, samples_max);
+}
+
+/* SMT sibling mode: the test to run on the sibling of pincpu, and the sibling itself */
+static const test_description* sibling_test;
+static int sibling_cpu;
+
+/** the mean of every column over all the samples of all repeats in run */
+std::vector<double> column_means(const CpuRun& run, const ColList& columns, const RunArgs& bargs) {
+    std::vector<double> sums(columns.size());
+    std::vector<size_t> counts(columns.size());
+    for (size_t repeat = 0; repeat < run.results.size(); repeat++) {
+        const auto& result = run.results[repeat];
+        eval_repeat(repeat, result.samples, result.start_tsc, run.config, columns, bargs, [&](const RowValues& row) {
+            for (size_t c = 0; c < columns.size(); c++) {
+                if (!std::isnan(row.vals[c])) {
+                    sums[c] += row.vals[c];
+                    counts[c]++;
+                }
+            }
+        });
+    }
+    for (size_t c = 0; c < columns.size(); c++) {
+        sums[c] = counts[c] ? sums[c] / counts[c] : std::numeric_limits<double>::quiet_NaN();
+    }
+    return sums;
+}
+
+/**
+ * SMT sibling mode: first run the sibling test alone on the hyperthread sibling of the
+ * pinned cpu, as a baseline, then run test on the pinned cpu and the sibling test on the
+ * sibling together. The paired run is output as a multi-cpu trace, and a summary of what
+ * the sibling pays for sharing its core (and what the primary gets) goes to stderr.
+ */
+void run_smt(const test_description* test,
+             const ColList& columns,
+             const RunArgs& bargs,
+             size_t samples_max,
+             int pincpu) {
+    std::vector<CpuRun> alone(1), paired(2);
+    alone[0].cpu   = sibling_cpu;
+    alone[0].test  = sibling_test;
+    paired[0].cpu  = pincpu;
+    paired[0].test = test;
+    paired[1].cpu  = sibling_cpu;
+    paired[1].test = sibling_test;
+
+    vprint("SMT baseline: %s alone on cpu %d\n", sibling_test->name, sibling_cpu);
+    sample_multi(alone, columns, bargs, samples_max);
+    vprint("SMT paired  : %s on cpu %d with %s on cpu %d\n", test->name, pincpu, sibling_test->name, sibling_cpu);
+    sample_multi(paired, columns, bargs, samples_max);
+
+    print_multi(paired, test, columns, bargs, samples_max);
+
+    std::vector<const char*> headers;
+    for (auto col : columns) {
+        headers.push_back(col->get_header());
+    }
+    print_smt_summary(test->name, pincpu, sibling_test->name, sibling_cpu, headers, column_means(alone[0], columns, bargs),
+            column_means(paired[1], columns, bargs), column_means(paired[0], columns, bargs));
+}
+
+ssize_t find_column(const ColList& columns, const char* name) {
+    auto it = std::find_if(columns.begin(), columns.end(), [=](const Column* c) { return !strcmp(c->get_header(), name); });
+    return it == columns.end() ? -1 : it - columns.begin();
+}
+
+/**
+ * Transition mode: rather than the samples, print one record for each frequency
+ * transition found in each repeat (see TransitionDetector).
+ */
+void print_transitions(const std::vector<RunResult>& allresults,
+                       const StampConfig& config,
+                       const ColList& columns,
+                       const RunArgs& bargs) {
+    ssize_t cycles_idx = find_column(columns, "Cycles"), tsc_idx = find_column(columns, "tsc-delta");
+    assert(cycles_idx >= 0 && tsc_idx >= 0);
+
+    const double tsc_ghz = tsc_freq / 1e9;
+    auto us = [&](double ticks) { return ticks / tsc_ghz / 1000.; };
+
+    CsvEmitter out(csv_out);
+    for (size_t repeat = 0; repeat < allresults.size(); repeat++) {
+        out.put("repeat,start_tsc,start_us,halt_us,old_ghz,new_ghz,settle_us\n");
+        const auto& results = allresults[repeat];
+        const auto& samples = results.samples;
+        TransitionDetector detector(tsc_ghz, trans_thresh, 10, trans_settle);
+        Transition t;
+        size_t found = 0, i = 1;
+        eval_repeat(repeat, samples, results.start_tsc, config, columns, bargs, [&](const RowValues& row) {
+            if (detector.add(samples[i++].stamp.tsc, row.vals[tsc_idx], row.vals[cycles_idx], t)) {
+                out.put_uint(repeat);
+                out.put(',');
+                out.put_uint(t.start_tsc);
+                out.put(',');
+                out.put_fixed3(us(t.start_tsc - results.start_tsc));
+                for (double v : {us(t.halt_tsc), t.old_ghz, t.new_ghz, us(t.settle_tsc)}) {
+                    out.put(',');
+                    out.put_fixed3(v);
+                }
+                out.put('\n');
+                found++;
+            }
+        });
+        if (detector.in_transition()) {
+            fprintf(stderr, "WARNING: repeat %zu ended during an unsettled transition\n", repeat);
+        }
+        vprint("Found %zu transitions in repeat %zu\n", found, repeat);
+        out.flush();
+    }
+}
+
+/* licence summary mode: the steady-state Unhalt_GHz of each test run so far, by name */
+static bool licence_summary;
+static std::map<std::string, double> licence_ghz;
+
+/**
+ * The steady-state Unhalt_GHz of a run: the mean over all repeats of the samples in the
+ * second half of the test period during which only the payload ran, or NaN if none did.
+ */
+double steady_state_ghz(const std::vector<RunResult>& results, const StampConfig& config,
+                        const ColList& columns, const RunArgs& bargs) {
+    const int ghz = find_column(columns, "Unhalt_GHz");
+    const double half_us = 500000. * test_cycles / tsc_freq;
+    double sum = 0;
+    size_t count = 0;
+    for (size_t repeat = 0; repeat < results.size(); repeat++) {
+        const auto& result = results[repeat];
+        eval_repeat(repeat, result.samples, result.start_tsc, config, columns, bargs, [&](const RowValues& row) {
+            if (row.us >= half_us && row.payspin && row.payspin == row.totspin && !std::isnan(row.vals[ghz])) {
+                sum += row.vals[ghz];
+                count++;
+            }
+        });
+    }
+    return count ? sum / count : std::numeric_limits<double>::quiet_NaN();
+}
+
+/** print the licence matrix of steady-state frequencies for the lic_ tests that were run */
+void print_licence_summary() {
+    struct Cell { const char *cls, *width; };
+#define LICENCE_CELL(cls, w, instr) {#cls, #w},
+    const Cell cells[] = { LICENCE_MATRIX_X(LICENCE_CELL) };
+#undef LICENCE_CELL
+    const char* const widths[] = {"xmm", "ymm", "zmm"};
+
+    fprintf(stderr, "Licence summary: steady-state Unhalt_GHz (payload-only samples in the second half of each run)\n");
+    fprintf(stderr, "%-6s", "class");
+    for (auto w : widths) {
+        fprintf(stderr, " %6s lat %5s tput", w, w);
+    }
+    fprintf(stderr, "\n");
+    std::string last_class;
+    for (auto& cell : cells) {
+        if (cell.cls == last_class) {
+            continue;
+        }
+        last_class = cell.cls;
+        fprintf(stderr, "%-6s", cell.cls);
+        for (auto w : widths) {
+            for (auto kind : {"lat", "tput"}) {
+                auto it = licence_ghz.find(string_format("lic_%s_%s_%s", cell.cls, w, kind));
+                if (it == licence_ghz.end()) {
+                    fprintf(stderr, " %10s", "-");
+                } else {
+                    fprintf(stderr, " %10.3f", it->second);
+                }
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+/* multi-pass mode: the events of the columns are split over passes which each fit on the PMU */
+static bool multipass;
+
+/** one pass of multi-pass mode: the columns whose events it counts, and the config to count them */
+struct Pass {
+    ColList columns;
+    /* the index in COLS of each of columns */
+    std::vector<size_t> col_idx;
+    /* the events of the columns, other than the anchor */
+    std::vector<PerfEvent> events;
+    StampConfig config;
+};
+
+static std::vector<std::unique_ptr<Pass>> passes;
+
+/* counted in every pass, so their frequency transitions can be lined up */
+const PerfEvent& PASS_ANCHOR = CPU_CLK_UNHALTED_THREAD;
+
+/**
+ * Split the events of the columns into passes, first fit: each pass has the anchor and
+ * the events of as many columns as the kernel will open along with it as one group, so
+ * incompatible events (e.g., ones restricted to the same counter) end up in different
+ * passes. All of a column's events go in the same pass. Columns without events go in the
+ * first pass, as do those whose events don't fit even on their own, which then fail
+ * there as usual. The counters of each pass are set up and calibrated, then disabled
+ * until the pass runs.
+ */
+void plan_passes(const ColList& columns) {
+    passes.clear();
+    passes.emplace_back(new Pass);
+    for (size_t c = 0; c < columns.size(); c++) {
+        StampConfig scratch;
+        columns[c]->update_config(scratch);
+        std::vector<PerfEvent> events;
+        for (auto& e : scratch.em.get_events()) {
+            if (e != PASS_ANCHOR) {
+                events.push_back(e);
+            }
+        }
+
+        // the pass's events plus ours, or empty if they don't fit
+        auto with = [&events](const std::vector<PerfEvent>& pass_events) {
+            std::vector<PerfEvent> all{PASS_ANCHOR};
+            all.insert(all.end(), pass_events.begin(), pass_events.end());
+            for (auto& e : events) {
+                if (std::find(all.begin(), all.end(), e) == all.end()) {
+                    all.push_back(e);
+                }
+            }
+            return events_fit(all) ? all : std::vector<PerfEvent>{};
+        };
+        Pass* home = passes.front().get();
+        std::vector<PerfEvent> all;
+        if (!events.empty()) {
+            auto it = std::find_if(passes.begin(), passes.end(), [&](auto& p) { return !(all = with(p->events)).empty(); });
+            if (it != passes.end()) {
+                home = it->get();
+            } else if (!(all = with({})).empty()) {
+                passes.emplace_back(new Pass);
+                home = passes.back().get();
+            }
+        }
+        home->columns.push_back(columns[c]);
+        home->col_idx.push_back(c);
+        if (!all.empty()) {
+            home->events.assign(all.begin() + 1, all.end());
+        }
+    }
+
+    for (size_t p = 0; p < passes.size(); p++) {
+        Pass& pass = *passes[p];
+        pass.config.em.add_event(PASS_ANCHOR);
+        for (auto col : pass.columns) {
+            col->update_config(pass.config);
+        }
+        pass.config.prepare();
+        pass.config.em.set_enabled(false);
+        std::string names;
+        for (auto col : pass.columns) {
+            names += std::string(names.empty() ? "" : ",") + col->get_header();
+        }
+        vprint("Pass %zu: %zu events for %s\n", p, pass.config.em.get_count(), names.c_str());
+    }
+}
+
+/**
+ * Multi-pass mode: run each repeat once per pass with only that pass's counters enabled,
+ * and merge the passes into one row per sample, each column's value coming from the pass
+ * that counted it. Every pass runs the same schedule from its own start, so sample i of
+ * each is at the same point in the test, and rows are matched by index. If the anchor's
+ * frequency shows a transition (by ALIGN_THRESH, as for ALIGN=transition) in both the
+ * first pass and another, that pass is shifted so the transitions line up. Samples that
+ * a shifted pass doesn't cover have no value for its columns.
+ */
+void run_multipass(const test_description* test, const ColList& columns, const RunArgs& bargs, size_t samples_max) {
+    std::unique_ptr<TraceOutput> trace;
+    if (!trace_dir.empty()) {
+        trace.reset(new TraceOutput(test, columns, bargs, bargs.repeat_count * (samples_max - 1)));
+    }
+
+    auto args = bargs.get_args();
+    std::vector<Sample> samples(samples_max);
+    std::vector<std::vector<RowValues>> rows(passes.size());
+    std::vector<double> anchor_ghz;
+    CsvEmitter out(csv_out);
+
+    for (size_t repeat = 0; repeat < bargs.repeat_count; repeat++) {
+        std::vector<ssize_t> transition(passes.size(), -1);
+        for (size_t p = 0; p < passes.size(); p++) {
+            Pass& pass = *passes[p];
+            uint64_t start_tsc;
+            size_t rpos = 0;
+            pass.config.em.set_enabled(true);
+            sample_loop(test, pass.config, args, start_tsc, nullptr, [&](const Sample& s) { samples[rpos++] = s; });
+            pass.config.em.set_enabled(false);
+
+            ssize_t anchor = pass.config.em.get_mapping(PASS_ANCHOR);
+            if (anchor >= 0) {
+                anchor_ghz.resize(samples_max - 1);
+                for (size_t i = 0; i + 1 < samples_max; i++) {
+                    const Stamp &a = samples[i].stamp, &b = samples[i + 1].stamp;
+                    anchor_ghz[i] = (double)(b.counters.counts[anchor] - a.counters.counts[anchor]) * tsc_freq
+                            / (b.tsc - a.tsc) / 1000000000.;
+                }
+                transition[p] = find_transition(anchor_ghz, align_thresh);
+            }
+
+            rows[p].clear();
+            eval_repeat(repeat, samples, start_tsc, pass.config, pass.columns, bargs,
+                    [&](const RowValues& row) { rows[p].push_back(row); });
+        }
+
+        if (!trace) {
+            print_header(out, test, columns);
+        }
+        std::vector<ssize_t> shift(passes.size());
+        for (size_t p = 1; p < passes.size(); p++) {
+            if (transition[0] >= 0 && transition[p] >= 0) {
+                shift[p] = transition[p] - transition[0];
+            }
+            if (shift[p]) {
+                vprint("Repeat %zu: pass %zu shifted by %zd samples to line up its transition\n", repeat, p, shift[p]);
+            }
+        }
+        for (size_t i = 0; i < rows[0].size(); i++) {
+            RowValues row = rows[0][i];
+            row.vals.assign(columns.size(), std::numeric_limits<double>::quiet_NaN());
+            for (size_t p = 0; p < passes.size(); p++) {
+                ssize_t j = i + shift[p];
+                if (j >= 0 && j < (ssize_t)rows[p].size()) {
+                    for (size_t k = 0; k < passes[p]->columns.size(); k++) {
+                        row.vals[passes[p]->col_idx[k]] = rows[p][j].vals[k];
+                    }
+                }
+            }
+            output_row(trace.get(), out, row);
+        }
+        out.flush();
+    }
+}
+
+void runOne(const test_description* test,
+            const StampConfig& config,
+            const ColList& columns,
+            const ColList& post_columns,
+            const RunArgs& bargs) {
+
+    const size_t samples_max = test_cycles / resolution_cycles + 2;
+
+    // the samples of the last test are done with
+    config.clear_mux_log();
+    config.reserve_mux(bargs.repeat_count * samples_max);
+
+    if (multipass) {
+        run_multipass(test, columns, bargs, samples_max);
+        return;
+    }
+
+    if (sibling_test) {
+        run_smt(test, columns, bargs, samples_max, sched_getcpu());
+        return;
+    }
+
+    if (!sample_cpus.empty()) {
+        run_multi(test, columns, bargs, samples_max);
+        return;
+    }
+
+    if (aggregate) {
+        run_aggregated(test, config, columns, bargs, samples_max);
+        return;
+    }
+
+    std::unique_ptr<TraceOutput> trace;
+    if (!trace_dir.empty()) {
+        trace.reset(new TraceOutput(test, columns, bargs, bargs.repeat_count * (samples_max - 1)));
+    }
+
+    if (stream_mode) {
+        SpscRing<Sample> ring(stream_buf);
+        for (size_t repeat = 0; repeat < bargs.repeat_count; repeat++) {
+            stream_repeat(repeat, test, config, columns, post_columns, bargs, ring, trace.get());
+        }
+        return;
+    }
+
+    auto args = bargs.get_args();
+
+    std::vector<RunResult> allresults;
+    allresults.reserve(bargs.repeat_count);
+
+    for (size_t repeat = 0; repeat < bargs.repeat_count; repeat++) {
+        allresults.emplace_back(samples_max, config.record_latency);
+        auto& result = allresults.back();
+        size_t rpos = 0;
+        sample_loop(test, config, args, result.start_tsc, result.latency.get(),
+                [&](const Sample& s) { result.samples[rpos++] = s; });
+        result.samples.resize(rpos);
+    }
+
+    if (transitions_mode) {
+        print_transitions(allresults, config, columns, bargs);
+        return;
+    }
+
+    if (licence_summary) {
+        licence_ghz[test->name] = steady_state_ghz(allresults, config, columns, bargs);
+    }
+
+    CsvEmitter out(csv_out);
+    for (size_t repeat = 0; repeat < bargs.repeat_count; repeat++) {
+        if (!trace) {
+            print_header(out, test, columns);
+        }
+
+        const auto& results = allresults.at(repeat);
+
+        eval_repeat(repeat, results.samples, results.start_tsc, config, columns, bargs,
+                [&](const RowValues& row) { output_row(trace.get(), out, row); });
+        for (auto col : post_columns) {
+            col->print_post(out, repeat, results);
+        }
+        out.flush();
+    }
+}
+
+/**
+ * Parse the size in the environment variable var: a byte count with an optional K, M or
+ * G (binary) suffix, like 32K.
+ */
+size_t getenv_size(const char* var, const std::string& def) {
+    std::string text = getenv_generic<std::string>(var, def);
+    size_t pos = 0;
+    double value = -1;
+    try {
+        value = std::stod(text, &pos);
+    } catch (std::exception&) {
+    }
+    std::string suffix = string_toupper(text.substr(std::min(pos, text.size())));
+    double mult = suffix == "" ? 1 : suffix == "K" ? 1 << 10 : suffix == "M" ? 1 << 20 : suffix == "G" ? 1 << 30 : -1;
+    usageCheck(value >= 0 && mult > 0, "Bad size %s=%s, expected bytes with an optional K, M or G suffix", var, text.c_str());
+    return value * mult;
+}
+
+/**
+ * The working set sizes from START to STOP: each step adds INC bytes, or with INC=xN
+ * multiplies by N. Sizes are rounded down to whole payload chunks.
+ */
+std::vector<size_t> working_set_sizes() {
+    size_t start = getenv_size("START", "256K"), stop = getenv_size("STOP", std::to_string(start));
+    std::string inc_text = getenv_generic<std::string>("INC", "256K");
+    double mult = 0;
+    size_t inc = 0;
+    if (!inc_text.empty() && inc_text[0] == 'x') {
+        mult = std::atof(inc_text.c_str() + 1);
+        usageCheck(mult > 1, "INC=xN needs N > 1, not %s", inc_text.c_str());
+    } else {
+        inc = getenv_size("INC", "256K");
+        usageCheck(inc > 0, "INC must be positive");
+    }
+    usageCheck(start >= MEM_CHUNK_BYTES, "START must be at least %zu bytes", MEM_CHUNK_BYTES);
+    usageCheck(stop >= start, "STOP must not be less than START");
+
+    std::vector<size_t> ret;
+    for (double size = start; size <= stop; size = mult ? size * mult : size + inc) {
+        size_t rounded = (size_t)size / MEM_CHUNK_BYTES * MEM_CHUNK_BYTES;
+        if (ret.empty() || rounded != ret.back()) {
+            ret.push_back(rounded);
+        }
+    }
+    return ret;
+}
+
+/** a page-aligned buffer of the given size, faulted in up front */
+char_span alloc_buffer(size_t size) {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        throw std::runtime_error(string_format("mmap of a %zu byte buffer failed: %s", size, strerror(errno)));
+    }
+    madvise(p, size, MADV_HUGEPAGE);
+    memset(p, 1, size);
+    return {(char*)p, size};
+}
+
+/** the columns named in a COLS list, split into normal and post-output columns */
+struct ColumnSet {
+    ColList all, columns, post_columns;
+};
+
+ColumnSet parse_columns(const std::string& collist) {
+    ColumnSet ret;
+    for (auto requested : split(collist, ",")) {
+        if (requested.empty()) {
+            continue;
+        }
+        bool found = false;
+        for (auto& col : get_all_columns()) {
+            if (requested == col->get_header()) {
+                ret.all.push_back(col);
+                found = true;
+                break;
+            }
+        }
+        usageCheck(found, "No column named %s", requested.c_str());
+    }
+
+    std::copy_if(ret.all.begin(), ret.all.end(), std::back_inserter(ret.columns),
                  [](auto& c) { return !c->is_post_output(); });
-    std::copy_if(allcolumns.begin(), allcolumns.end(), std::back_inserter(post_columns),
+    std::copy_if(ret.all.begin(), ret.all.end(), std::back_inserter(ret.post_columns),
                  [](auto& c) { return c->is_post_output(); });
 
-    vprint("Found %zu normal columns and %zu post-output columns\n", columns.size(), post_columns.size());
+    vprint("Found %zu normal columns and %zu post-output columns\n", ret.columns.size(), ret.post_columns.size());
+    return ret;
+}
 
-    StampConfig config;
+/* the mode checks that depend on the columns */
+void check_columns(const ColumnSet& cs) {
+    usageCheck(!licence_summary || find_column(cs.columns, "Unhalt_GHz") >= 0, "LICENCE_SUMMARY needs the Unhalt_GHz column in COLS");
+    usageCheck(cs.post_columns.empty() || (sample_cpus.empty() && !sibling_test && !aggregate && !transitions_mode && !multipass),
+               "post-output columns (like lathist) can't be combined with CPUS, SIBLING, AGGREGATE, TRANSITIONS or MULTIPASS");
+    usageCheck(!transitions_mode || (find_column(cs.columns, "Cycles") >= 0 && find_column(cs.columns, "tsc-delta") >= 0),
+               "TRANSITIONS needs the Cycles and tsc-delta columns in COLS");
+}
+
+/* prepare config to take the stamps the given columns need, on the calling thread */
+void prepare_config(StampConfig& config, const ColumnSet& cs) {
     // we give each column a chance to update the StampConfig with what it needs
-    for (auto& col : allcolumns) {
+    for (auto& col : cs.all) {
         col->update_config(config);
     }
     config.prepare();
+}
+
+/* drop the tests this cpu can't run, rather than die with SIGILL */
+void drop_unsupported(std::vector<test_description>& tests) {
+    tests.erase(std::remove_if(tests.begin(), tests.end(), [](const test_description& t) {
+        const char* isa = t.f ? missing_isa(t) : nullptr;
+        if (isa) {
+            fprintf(stderr, "Skipping %s: needs %s, which this cpu doesn't support\n", t.name, isa);
+        }
+        return isa;
+    }), tests.end());
+}
+
+/* the columns and stamp configuration for one COLS list in a campaign */
+struct CellSetup {
+    ColumnSet colset;
+    StampConfig config;
+};
+
+/**
+ * Campaign mode: run the campaign at path (see run_campaign), each cell with the
+ * current settings overridden by its own. Each distinct COLS list is set up once and
+ * reused by every cell that has it, with its counters disabled between its cells so
+ * only the running cell's group is on the PMU. Returns the number of workers that failed.
+ */
+int run_campaign_cells(const std::string& path, const std::string& dir, const std::vector<int>& cpus,
+                       const std::string& default_cols, const std::vector<size_t>& sizes, RunArgs args) {
+    const RunParams defaults = RunParams::current();
+    std::map<std::string, std::unique_ptr<CellSetup>> setups;
+    return run_campaign(path, dir, cpus, tsc_freq, verbose, [&](const CampaignCell& cell, FILE* out) {
+        RunParams params = defaults;
+        params.test_cycles          = cell.test_cycles          >= 0 ? cell.test_cycles          : params.test_cycles;
+        params.period_cycles        = cell.period_cycles        >= 0 ? cell.period_cycles        : params.period_cycles;
+        params.resolution_cycles    = cell.resolution_cycles    >= 0 ? cell.resolution_cycles    : params.resolution_cycles;
+        params.payload_extra_cycles = cell.payload_extra_cycles >= 0 ? cell.payload_extra_cycles : params.payload_extra_cycles;
+        usageCheck(params.resolution_cycles > 0 && params.period_cycles > 0,
+                "TEST_RES and TEST_PER must be positive (in campaign cell %s)", cell.name.c_str());
+        params.apply();
+        if (cell.resolution_cycles >= 0) {
+            check_idle_fits(params.resolution_cycles, (" in campaign cell " + cell.name).c_str());
+        }
+
+        std::string cols = cell.cols.empty() ? default_cols : cell.cols;
+        auto& setup = setups[cols];
+        if (!setup) {
+            setup.reset(new CellSetup{parse_columns(cols), {}});
+            check_columns(setup->colset);
+            prepare_config(setup->config, setup->colset);
+        } else {
+            setup->config.em.set_enabled(true);
+        }
+        ssize_t ghz_idx = find_column(setup->colset.columns, "Unhalt_GHz");
+        cond_ghz_col = ghz_idx >= 0 ? setup->colset.columns[ghz_idx] : nullptr;
+
+        std::vector<test_description> tests = get_by_list(cell.tests);
+        drop_unsupported(tests);
+
+        vprint("Campaign cell %s: %zu tests, COLS=%s\n", cell.name.c_str(), tests.size(), cols.c_str());
+        csv_out = out;
+        for (auto& t : tests) {
+            for (size_t size : sizes) {
+                args.size = size;
+                runOne(&t, setup->config, setup->colset.columns, setup->colset.post_columns, args);
+            }
+        }
+        csv_out = stdout;
+        setup->config.em.set_enabled(false);
+    });
+}
+
+int main(int argc, char** argv) {
+    summary     = getenv_bool("SUMMARY");
+    verbose     = !getenv_bool("QUIET");
+    debug       = getenv_bool("DEBUG");
+    prefix_cols = getenv_bool("PREFIX_COLS");
+    no_warm     = getenv_bool("NO_WARM");
+    subtract_overhead = getenv_bool("SUBTRACT_OVERHEAD");
+    retry_pct   = getenv_generic<double>("RETRY_PCT", 99.);
+    usageCheck(retry_pct > 0 && retry_pct <= 100, "RETRY_PCT must be in (0, 100]");
+    stream_mode = getenv_bool("STREAM");
+    stream_buf  = getenv_longlong("STREAM_BUF", 16384);
+    writer_cpu  = getenv_int("WRITER_CPU", -1);
+    trace_dir   = getenv_generic<std::string>("TRACE_DIR", "");
+    aggregate   = getenv_bool("AGGREGATE");
+    align_col   = getenv_generic<std::string>("ALIGN_COL", "Unhalt_GHz");
+    align_thresh = getenv_generic<double>("ALIGN_THRESH", 0.05);
+
+    sample_cpus = parse_cpu_list(getenv_generic<std::string>("CPUS", ""));
+    sync_us     = getenv_generic<double>("SYNC_US", 100.);
+    adaptive    = getenv_bool("ADAPTIVE");
+    transitions_mode = getenv_bool("TRANSITIONS");
+    trans_thresh = getenv_generic<double>("TRANS_THRESH", 0.05);
+    trans_settle = getenv_int("TRANS_SETTLE", 5);
+    adapt_thresh = getenv_generic<double>("ADAPT_THRESH", 0.02);
+    licence_summary = getenv_bool("LICENCE_SUMMARY");
+    multipass   = getenv_bool("MULTIPASS");
+
+    std::string align = getenv_generic<std::string>("ALIGN", "index");
+    usageCheck(align == "index" || align == "transition", "ALIGN must be index or transition, not %s", align.c_str());
+    align_transition = align == "transition";
+
+    bool dump_tests_flag = getenv_bool("DUMPTESTS");
+    bool do_list_events  = getenv_bool("LIST_EVENTS");  // list the events and quit
+    bool include_slow    = getenv_bool("INCLUDE_SLOW");
+    std::string collist  = getenv_generic<std::string>(
+            "COLS", "tsc-delta,nanos,Cycles,INSTRU,IPC,UPC,Unhalt_GHz");
+
+    std::vector<size_t> sizes = working_set_sizes();
+    size_sweep = sizes.size() > 1;
+    int pincpu         = getenv_int("PINCPU",  0);
+    size_t iters       = getenv_int("ITERS", 100);
+
+    test_cycles          = getenv_longlong("TEST_CYC",   1ull *  100ull * 1000ull * 1000ull);
+    period_cycles        = getenv_longlong("TEST_PER",            10ull * 1000ull * 1000ull);
+    resolution_cycles    = getenv_longlong("TEST_RES",                      10ull * 1000ull);
+    // for the licence summary, by default the payload runs for the whole test
+    payload_extra_cycles = getenv_longlong("TEST_EXTRA",           licence_summary ? test_cycles : 0);
+    coarse_cycles        = getenv_longlong("ADAPT_RES",                  20 * resolution_cycles);
+
+    assert(iters > 0);
+
+    if (verbose)
+        set_verbose(true);  // set perf-timer to verbose too
+    set_force_read(getenv_bool("PERF_READ"));
+    set_multiplex(getenv_bool("PERF_MULTIPLEX"));
+
+    if (dump_tests_flag) {
+        dump_tests();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (do_list_events) {
+        list_events();
+        exit(EXIT_SUCCESS);
+    }
+
+    usageCheck(argc == 1 || argc == 2, "Must provide 0 or 1 arguments");
+
+    // a PAYLOAD is registered as the test "payload", so it can be used anywhere a test name can
+    static std::unique_ptr<JitPayload> jit_payload;
+    std::string payload_spec = getenv_generic<std::string>("PAYLOAD", "");
+    if (!payload_spec.empty()) {
+        jit_payload.reset(new JitPayload(payload_spec));
+        test_description payload{"payload", jit_payload->function(), jit_payload->spec().c_str(), jit_payload->info().isa};
+        usageCheck(!missing_isa(payload), "PAYLOAD needs %s, which this cpu doesn't support", missing_isa(payload));
+        register_test(payload);
+    }
+
+    std::vector<test_description> tests;
+
+    std::string campaign_path = getenv_generic<std::string>("CAMPAIGN", "");
+    std::string campaign_dir  = getenv_generic<std::string>("CAMPAIGN_DIR", "results");
+    std::vector<int> campaign_cpus = parse_cpu_list(getenv_generic<std::string>("CAMPAIGN_CPUS", ""));
+    bool campaign = !campaign_path.empty();
+
+    std::string schedule_path = getenv_generic<std::string>("SCHEDULE", "");
+    use_schedule = !schedule_path.empty();
+    if (use_schedule) {
+        // the schedule decides what runs, so there is just the one "test"
+        usageCheck(argc == 1, "SCHEDULE replaces the TEST_NAME argument");
+        tests.push_back({"schedule", nullptr, "the phases in SCHEDULE", NONE});
+    } else if (campaign) {
+        // each cell of the campaign names its own tests
+        usageCheck(argc == 1, "CAMPAIGN replaces the TEST_NAME argument");
+    } else if (argc > 1) {
+        tests = get_by_list(argv[1]);
+    } else if (licence_summary) {
+        // the whole licence matrix
+        tests = get_by_list("@lic");
+    } else {
+        // all tests
+        for (auto t : get_all()) {
+            if ((include_slow || !(t.flags & SLOW))) {
+                tests.push_back(t);
+            }
+        }
+    }
+
+    drop_unsupported(tests);
+    usageCheck(campaign || !tests.empty(), "No tests left to run on this cpu");
+
+    if (sched_getaffinity(0, sizeof(initial_affinity), &initial_affinity)) {
+        CPU_ZERO(&initial_affinity);
+    }
+
+    std::string sibling_name = getenv_generic<std::string>("SIBLING", "");
+    if (!sibling_name.empty()) {
+        sibling_test = get_by_name(sibling_name);
+        usageCheck(sibling_test, "No test named %s (from SIBLING)", sibling_name.c_str());
+        usageCheck(!missing_isa(*sibling_test), "The SIBLING test %s needs %s, which this cpu doesn't support",
+                sibling_name.c_str(), missing_isa(*sibling_test));
+        sibling_cpu = getenv_int("SIBLING_CPU", -1);
+        if (sibling_cpu < 0) {
+            sibling_cpu = find_smt_sibling(pincpu, initial_affinity);
+        }
+        usageCheck(sibling_cpu >= 0, "No SMT sibling found for cpu %d, is SMT enabled?", pincpu);
+        usageCheck(sample_cpus.empty() && !stream_mode && !aggregate, "SIBLING can't be combined with CPUS, STREAM or AGGREGATE");
+    }
+    cpu_column = !sample_cpus.empty() || sibling_test;
+
+    pinToCpu(pincpu);
+
+    ColumnSet colset = parse_columns(collist);
+    const ColList& columns = colset.columns;
+    const ColList& post_columns = colset.post_columns;
+
+    // campaign cells open their own counters, one cell at a time (see run_cells)
+    StampConfig config;
+    if (multipass && !campaign) {
+        plan_passes(columns);
+    } else if (!campaign) {
+        prepare_config(config, colset);
+    }
 
     // run the whole test repeat_count times, each of which calls the test function iters times
-    unsigned repeat_count = 3;
+    int repeat_count = getenv_int("REPEATS", 3);
+    usageCheck(repeat_count > 0, "REPEATS must be positive");
+    usageCheck(!aggregate || (!stream_mode && trace_dir.empty()), "AGGREGATE can't be combined with STREAM or TRACE_DIR");
+    usageCheck(sample_cpus.empty() || (!stream_mode && !aggregate), "CPUS can't be combined with STREAM or AGGREGATE");
+    usageCheck(!adaptive || (sample_cpus.empty() && !sibling_test && !aggregate),
+               "ADAPTIVE can't be combined with CPUS, SIBLING or AGGREGATE");
+    usageCheck(!transitions_mode || (sample_cpus.empty() && !sibling_test && !aggregate && !stream_mode && trace_dir.empty()),
+               "TRANSITIONS can't be combined with CPUS, SIBLING, AGGREGATE, STREAM or TRACE_DIR");
+    usageCheck(!licence_summary || (sample_cpus.empty() && !sibling_test && !aggregate && !stream_mode && !transitions_mode),
+               "LICENCE_SUMMARY can't be combined with CPUS, SIBLING, AGGREGATE, STREAM or TRANSITIONS");
+    usageCheck(!size_sweep || (!sibling_test && !aggregate && !transitions_mode && !licence_summary),
+               "a size sweep (STOP > START) can't be combined with SIBLING, AGGREGATE, TRANSITIONS or LICENCE_SUMMARY");
+    usageCheck(trans_settle > 0, "TRANS_SETTLE must be positive");
+    usageCheck(!campaign || (!use_schedule && !licence_summary && !adaptive && trace_dir.empty()),
+               "CAMPAIGN can't be combined with SCHEDULE, LICENCE_SUMMARY, ADAPTIVE or TRACE_DIR");
+    usageCheck(campaign_cpus.empty() || (campaign && sample_cpus.empty() && !sibling_test),
+               "CAMPAIGN_CPUS needs CAMPAIGN, and can't be combined with CPUS or SIBLING");
+    usageCheck(!multipass || (sample_cpus.empty() && !sibling_test && !aggregate && !stream_mode && !adaptive
+               && !transitions_mode && !licence_summary && !campaign && !getenv_bool("PERF_MULTIPLEX")),
+               "MULTIPASS can't be combined with CPUS, SIBLING, AGGREGATE, STREAM, ADAPTIVE, TRANSITIONS, "
+               "LICENCE_SUMMARY, CAMPAIGN or PERF_MULTIPLEX");
+    // the multiplexed counts of each stamp stay with the sampling thread (see StampConfig::mux_log)
+    usageCheck(!stream_mode || !getenv_bool("PERF_MULTIPLEX"), "STREAM can't be combined with PERF_MULTIPLEX");
+    check_columns(colset);
 
     bool freq_forced = true;
     tsc_freq = getenv_generic<double>("MHZ", 0.0) * 1000000;
@@ -928,19 +2929,130 @@ int main(int argc, char** argv) {
         freq_forced = false;
     }
 
+    idle_mode = parse_idle_mode(getenv_generic<std::string>("IDLE_MODE", "spin"), tsc_freq);
+    check_idle_fits(resolution_cycles, "");
+
+    if (use_schedule) {
+        schedule      = load_schedule(schedule_path, tsc_freq);
+        for (auto& phase : schedule.phases) {
+            usageCheck(!missing_isa(*phase.test), "The SCHEDULE test %s needs %s, which this cpu doesn't support",
+                    phase.test->name, missing_isa(*phase.test));
+        }
+        period_cycles = schedule.loop_cycles();
+        test_cycles   = period_cycles * schedule.loop_count;
+    }
+
+    if (adaptive) {
+        std::string adapt_list = getenv_generic<std::string>("ADAPT_COLS", "Unhalt_GHz,IPC");
+        for (auto col : columns) {
+            auto names = split(adapt_list, ",");
+            if (std::find(names.begin(), names.end(), col->get_header()) != names.end()) {
+                adapt_columns.push_back(col);
+            }
+        }
+        usageCheck(!adapt_columns.empty(), "ADAPTIVE needs at least one of the ADAPT_COLS (%s) in COLS", adapt_list.c_str());
+        usageCheck(coarse_cycles >= resolution_cycles, "ADAPT_RES must not be smaller than TEST_RES");
+        adapt_hold_cycles = getenv_generic<double>("ADAPT_HOLD_US", 50.) * tsc_freq / 1000000.;
+    }
+
+    std::string cond = getenv_generic<std::string>("CONDITION", "adaptive");
+    usageCheck(cond == "adaptive" || cond == "fixed", "CONDITION must be adaptive or fixed, not %s", cond.c_str());
+    cond_fixed          = cond == "fixed";
+    cond_poll_cycles    = getenv_generic<double>("COND_POLL_US",    1000.) * tsc_freq / 1000000.;
+    cond_window_cycles  = getenv_generic<double>("COND_WINDOW_US", 20000.) * tsc_freq / 1000000.;
+    cond_timeout_cycles = getenv_generic<double>("COND_TIMEOUT_MS", 1000.) * tsc_freq / 1000.;
+    cond_tol            = getenv_generic<double>("COND_TOL", 0.02);
+    usageCheck(cond_poll_cycles > 0 && cond_tol >= 0, "COND_POLL_US must be positive and COND_TOL not negative");
+    {
+        // by default, stay 10 degrees below TjMax, if we can read the thermal MSRs at all
+        double tjmax = read_tjmax();
+        cond_max_temp = getenv_generic<double>("COND_MAX_TEMP", tjmax - 10);
+        if (std::isnan(read_package_temp())) {
+            cond_max_temp = NAN;
+        }
+        ssize_t ghz_idx = find_column(columns, "Unhalt_GHz");
+        cond_ghz_col = ghz_idx >= 0 ? columns[ghz_idx] : nullptr;
+    }
+
     if (verbose) {
         fprintf(stderr, "inner loops  : %10zu\n", iters);
         fprintf(stderr, "pinned cpu   : %10d\n", pincpu);
+        if (!sample_cpus.empty()) {
+            fprintf(stderr, "sample cpus  : %10s\n", getenv_generic<std::string>("CPUS", "").c_str());
+        }
+        if (sibling_test) {
+            fprintf(stderr, "smt sibling  : %10d running %s\n", sibling_cpu, sibling_test->name);
+        }
         fprintf(stderr, "current cpu  : %10d\n", sched_getcpu());
-        fprintf(stderr, "start size   : %10zu bytes\n", size_start);
-        fprintf(stderr, "stop size    : %10zu bytes\n", size_stop);
-        fprintf(stderr, "inc size     : %10zu bytes\n", size_inc);
+        fprintf(stderr, "start size   : %10zu bytes\n", sizes.front());
+        fprintf(stderr, "stop size    : %10zu bytes (%zu sizes)\n", sizes.back(), sizes.size());
         fprintf(stderr, "tsc freq     : %10.1f MHz%s\n", tsc_freq / 1000000., freq_forced ? " (forced)" : "");
         fprintf(stderr, "test period  : %10.3f us\n", 1000000. * test_cycles       / tsc_freq);
         fprintf(stderr, "duty period  : %10.3f us\n", 1000000. * period_cycles     / tsc_freq);
         fprintf(stderr, "resolution   : %10.3f us\n", 1000000. * resolution_cycles / tsc_freq);
-        fprintf(stderr, "payload extra: %10.3f us\n", 1000000. * payload_extra_cycles / tsc_freq);
+        if (adaptive) {
+            fprintf(stderr, "coarse res   : %10.3f us\n", 1000000. * coarse_cycles / tsc_freq);
+            fprintf(stderr, "adapt hold   : %10.3f us\n", 1000000. * adapt_hold_cycles / tsc_freq);
+            fprintf(stderr, "adapt thresh : %10.3f\n", adapt_thresh);
+        }
+        if (jit_payload) {
+            fprintf(stderr, "jit payload  : %10zu bytes, %zu instructions\n", jit_payload->info().code.size(),
+                    jit_payload->info().instructions);
+        }
+        if (use_schedule) {
+            fprintf(stderr, "schedule     : %10s (%zu phases, %zu loops)\n", schedule_path.c_str(),
+                    schedule.phases.size(), schedule.loop_count);
+        } else {
+            fprintf(stderr, "payload extra: %10.3f us\n", 1000000. * payload_extra_cycles / tsc_freq);
+        }
+        if (cond_fixed) {
+            fprintf(stderr, "conditioning : %10s\n", "fixed");
+        } else {
+            fprintf(stderr, "conditioning : %10s (window %.1f ms within %.1f%%, timeout %.0f ms, max temp %s)\n",
+                    cond_ghz_col ? "Unhalt_GHz" : "imul chain", 1000. * cond_window_cycles / tsc_freq, 100. * cond_tol,
+                    1000. * cond_timeout_cycles / tsc_freq,
+                    std::isnan(cond_max_temp) ? "unavailable" : string_format("%.0f C", cond_max_temp).c_str());
+        }
         fprintf(stderr, "warmup stamp : %10s\n", no_warm ? "no" : "yes");
+        if (!campaign) {
+            fprintf(stderr, "retry gap    : %10zu cycles (p%.1f of stamp cost)\n",
+                    (size_t)(multipass ? passes.front()->config : config).retry_gap, retry_pct);
+        }
+        if (multipass) {
+            fprintf(stderr, "passes       : %10zu\n", passes.size());
+        }
+        fprintf(stderr, "sub overhead : %10s\n", subtract_overhead ? "yes" : "no");
+        fprintf(stderr, "idle mode    : %10s\n", idle_mode.to_string().c_str());
+        fprintf(stderr, "repeats      : %10d\n", repeat_count);
+        if (aggregate) {
+            fprintf(stderr, "aggregate    : %10s\n", align_transition ? "transition" : "index");
+        }
+        if (transitions_mode) {
+            fprintf(stderr, "transitions  : thresh %.3f, settle %zu samples\n", trans_thresh, trans_settle);
+        }
+        fprintf(stderr, "stream mode  : %10s\n", stream_mode ? "yes" : "no");
+        if (stream_mode) {
+            fprintf(stderr, "stream buf   : %10zu samples\n", stream_buf);
+        }
+        if (!trace_dir.empty()) {
+            fprintf(stderr, "trace dir    : %s\n", trace_dir.c_str());
+        }
+        if (campaign) {
+            fprintf(stderr, "campaign     : %10s -> %s%s\n", campaign_path.c_str(), campaign_dir.c_str(),
+                    campaign_cpus.empty() ? "" : string_format(" (%zu workers)", campaign_cpus.size()).c_str());
+        }
+    }
+
+    RunArgs args{0., (size_t)repeat_count, iters, 0, alloc_buffer(sizes.back()), alloc_buffer(sizes.back())};
+
+    if (campaign) {
+        int failed = run_campaign_cells(campaign_path, campaign_dir, campaign_cpus, collist, sizes, args);
+        if (failed) {
+            fprintf(stderr, "%d campaign workers failed, rerun to retry their remaining cells\n", failed);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Campaign done\n");
+        return EXIT_SUCCESS;
     }
 
     if (!summary) {
@@ -948,9 +3060,18 @@ int main(int argc, char** argv) {
                 columns.size(), (size_t)clock() * 1000u / CLOCKS_PER_SEC);
     }
 
-    RunArgs args{0., repeat_count, iters};
     for (auto t : tests) {
-        runOne(&t, config, columns, post_columns, args);
+        for (size_t size : sizes) {
+            args.size = size;
+            if (size_sweep) {
+                vprint("Working set: %zu bytes\n", size);
+            }
+            runOne(&t, config, columns, post_columns, args);
+        }
+    }
+
+    if (licence_summary) {
+        print_licence_summary();
     }
 
     fprintf(stderr, "Benchmark done\n");
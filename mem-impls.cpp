@@ -0,0 +1,68 @@
+/**
+ * Memory-bound payloads: loads, stores, copies and non-temporal stores over the buffers
+ * in bench_args.
+ */
+
+#include "mem-impls.hpp"
+#include "algo-common.hpp"
+
+/* the start of the next chunk of each buffer for the calling thread */
+static void next_chunk(const bench_args& args, char*& src, char*& dst) {
+    static thread_local size_t offset;
+    if (offset + MEM_CHUNK_BYTES > args.src.size()) {
+        offset = 0;
+    }
+    src = args.src.data() + offset;
+    dst = args.dst.data() + offset;
+    offset += MEM_CHUNK_BYTES;
+}
+
+/* the aligned move for each width: there is no vmovdqa for zmm */
+#define MOV_xmm "vmovdqa"
+#define MOV_ymm "vmovdqa"
+#define MOV_zmm "vmovdqa64"
+
+#define BYTES_xmm "16"
+#define BYTES_ymm "32"
+#define BYTES_zmm "64"
+
+#define BODY_load(w)  MOV_##w " mem_off(%0), %%" #w "0\n\t"
+#define BODY_store(w) MOV_##w " %%" #w "0, mem_off(%1)\n\t"
+#define BODY_copy(w)  MOV_##w " mem_off(%0), %%" #w "0\n\t" MOV_##w " %%" #w "0, mem_off(%1)\n\t"
+#define BODY_nt(w)    "vmovntdq %%" #w "0, mem_off(%1)\n\t"
+
+/* non-temporal stores are weakly ordered, so each call fences its own */
+#define TAIL_load  ""
+#define TAIL_store ""
+#define TAIL_copy  ""
+#define TAIL_nt    "sfence\n\t"
+
+/**
+ * One chunk of kind accesses at width w, 256 bytes per loop iteration. src and dst both
+ * advance, whether or not kind uses them.
+ */
+#define MAKE_MEM(kind, w)                                  \
+void mem_##kind##_##w(bench_args args) {                   \
+    char *src, *dst;                                       \
+    next_chunk(args, src, dst);                            \
+    char* end = src + MEM_CHUNK_BYTES;                     \
+    asm volatile (                                         \
+        "1:\n\t"                                           \
+        ".set mem_off, 0\n\t"                              \
+        ".rept 256 / " BYTES_##w "\n\t"                    \
+        BODY_##kind(w)                                     \
+        ".set mem_off, mem_off + " BYTES_##w "\n\t"        \
+        ".endr\n\t"                                        \
+        "add $256, %0\n\t"                                 \
+        "add $256, %1\n\t"                                 \
+        "cmp %2, %0\n\t"                                   \
+        "jb 1b\n\t"                                        \
+        TAIL_##kind                                        \
+        "vzeroupper\n\t"                                   \
+        : "+r"(src), "+r"(dst)                             \
+        : "r"(end)                                         \
+        : "memory"                                         \
+    );                                                     \
+}
+
+MEM_MATRIX_X(MAKE_MEM)
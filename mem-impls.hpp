@@ -0,0 +1,35 @@
+#ifndef MEM_IMPLS_H_
+#define MEM_IMPLS_H_
+
+#include "common-cxx.hpp"
+
+/**
+ * Each call of a memory payload covers the next MEM_CHUNK_BYTES of its buffers, wrapping
+ * back to the start at the end of the working set, so a call takes about as long at any
+ * working set size. Working set sizes are multiples of this.
+ */
+constexpr size_t MEM_CHUNK_BYTES = 4096;
+
+/**
+ * The memory payloads: f(kind, width) for each access kind (load, store, copy and
+ * non-temporal store) and vector width.
+ */
+#define MEM_MATRIX_X(f) \
+    f(load,  xmm) \
+    f(load,  ymm) \
+    f(load,  zmm) \
+    f(store, xmm) \
+    f(store, ymm) \
+    f(store, zmm) \
+    f(copy,  xmm) \
+    f(copy,  ymm) \
+    f(copy,  zmm) \
+    f(nt,    xmm) \
+    f(nt,    ymm) \
+    f(nt,    zmm) \
+
+#define DECLARE_MEM(kind, w) bench_fn mem_##kind##_##w;
+
+MEM_MATRIX_X(DECLARE_MEM)
+
+#endif
@@ -68,7 +68,6 @@ int get_rfile(int cpu) {
     }
 
     if (rfile_array[cpu] == 0) {
-        printf("opening file for cpu %d\n", cpu);
         char filename[64] = {};
         int ret = snprintf(filename, 64, "/dev/cpu/%d/msr", cpu);
         if (ret == 0) {
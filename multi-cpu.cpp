@@ -0,0 +1,131 @@
+/*
+ * multi-cpu.cpp
+ */
+
+#include "multi-cpu.hpp"
+#include "cpuid.hpp"
+#include "misc.hpp"
+#include "tsc-support.hpp"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <map>
+#include <mutex>
+#include <thread>
+
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> ret;
+    for (auto& item : split(list, ",")) {
+        if (item.empty()) {
+            continue;
+        }
+        auto range = split(item, "-");
+        int first = std::stoi(range.at(0)), last = range.size() > 1 ? std::stoi(range.at(1)) : first;
+        if (range.size() > 2 || first < 0 || last < first) {
+            throw std::runtime_error("bad cpu list entry: " + item);
+        }
+        for (int c = first; c <= last; c++) {
+            ret.push_back(c);
+        }
+    }
+    return ret;
+}
+
+void pinToCpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        assert("pinning failed" && false);
+    }
+}
+
+int find_smt_sibling(int cpu, const cpu_set_t& allowed) {
+    int shift = get_smt_shift();
+    if (shift < 0) {
+        throw std::runtime_error("can't determine the SMT topology: cpuid leaf 0xb not supported");
+    }
+    std::map<int, uint32_t> apic_ids;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed)) {
+            pinToCpu(c);
+            if (sched_getcpu() == c) {
+                apic_ids[c] = get_x2apic_id();
+            }
+        }
+    }
+    if (!apic_ids.count(cpu)) {
+        throw std::runtime_error("cpu " + std::to_string(cpu) + " is not available");
+    }
+    for (auto& e : apic_ids) {
+        if (e.first != cpu && (e.second >> shift) == (apic_ids[cpu] >> shift)) {
+            return e.first;
+        }
+    }
+    return -1;
+}
+
+void run_pinned(const std::vector<int>& cpus, uint64_t sync_cycles,
+                const std::function<void(size_t, const StartGate&)>& body) {
+    SpinBarrier barrier(cpus.size());
+    std::atomic<uint64_t> start_deadline{0};
+    std::mutex error_lock;
+    std::string first_error;
+
+    const StartGate gate = [&]() {
+        barrier.arrive_and_wait([&] { start_deadline.store(rdtsc() + sync_cycles, std::memory_order_relaxed); });
+        uint64_t deadline = start_deadline.load(std::memory_order_relaxed);
+        while (rdtsc() < deadline) {
+        }
+        return deadline;
+    };
+
+    auto fail = [&](int cpu, const char* what) {
+        std::lock_guard<std::mutex> guard(error_lock);
+        if (first_error.empty()) {
+            first_error = "thread on cpu " + std::to_string(cpu) + " failed: " + what;
+        }
+        barrier.abort();
+    };
+
+    auto thread = [&](size_t i) {
+        try {
+            pinToCpu(cpus[i]);
+            if (sched_getcpu() != cpus[i]) {
+                throw std::runtime_error("failed to pin thread to cpu " + std::to_string(cpus[i]));
+            }
+            body(i, gate);
+        } catch (BarrierAborted&) {
+            // another thread failed, and that's the error reported
+        } catch (std::exception& e) {
+            fail(cpus[i], e.what());
+        } catch (...) {
+            fail(cpus[i], "unknown exception");
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < cpus.size(); i++) {
+        threads.emplace_back(thread, i);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    if (!first_error.empty()) {
+        throw std::runtime_error(first_error);
+    }
+}
+
+void print_smt_summary(const char* test, int cpu, const char* sibling_test, int sibling_cpu,
+                       const std::vector<const char*>& headers, const std::vector<double>& base,
+                       const std::vector<double>& sib, const std::vector<double>& prim) {
+    fprintf(stderr, "SMT summary: %s on cpu %d, sibling %s on cpu %d (means over all samples)\n",
+            test, cpu, sibling_test, sibling_cpu);
+    fprintf(stderr, "%-14s %14s %14s %10s %14s\n", "column", "sibling alone", "sibling paired", "change", "primary paired");
+    for (size_t c = 0; c < headers.size(); c++) {
+        fprintf(stderr, "%-14s %14.3f %14.3f %9.1f%% %14.3f\n", headers[c],
+                base[c], sib[c], 100. * (sib[c] - base[c]) / base[c], prim[c]);
+    }
+}
@@ -0,0 +1,111 @@
+/*
+ * multi-cpu.hpp
+ *
+ * Running on several cpus at once: cpu lists, pinning, finding SMT siblings, and a set
+ * of pinned threads that can start sampling at the same TSC deadline.
+ */
+
+#ifndef MULTI_CPU_H_
+#define MULTI_CPU_H_
+
+#include <sched.h>
+
+#include <atomic>
+#include <cinttypes>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <immintrin.h>
+
+/** thrown by SpinBarrier::arrive_and_wait once the barrier has been aborted */
+struct BarrierAborted : std::runtime_error {
+    BarrierAborted() : std::runtime_error("barrier aborted") {}
+};
+
+/**
+ * A reusable spinning barrier for a fixed number of threads.
+ *
+ * A thread that won't arrive again (e.g., because it failed) must call abort(), which
+ * releases the threads waiting now and makes every later arrival throw BarrierAborted.
+ */
+class SpinBarrier {
+    const size_t count;
+    std::atomic<size_t> waiting;
+    std::atomic<size_t> generation;
+    std::atomic<bool> aborted;
+
+public:
+    explicit SpinBarrier(size_t count) : count{count}, waiting{0}, generation{0}, aborted{false} {}
+
+    /**
+     * Wait until all threads have arrived. The last thread to arrive calls on_last
+     * before releasing the others, so its effects are visible to all of them.
+     */
+    template <typename F>
+    void arrive_and_wait(F on_last) {
+        size_t gen = generation.load(std::memory_order_acquire);
+        if (aborted.load(std::memory_order_acquire)) {
+            throw BarrierAborted();
+        }
+        if (waiting.fetch_add(1, std::memory_order_acq_rel) + 1 == count) {
+            on_last();
+            waiting.store(0, std::memory_order_relaxed);
+            generation.store(gen + 1, std::memory_order_release);
+        } else {
+            while (generation.load(std::memory_order_acquire) == gen) {
+                if (aborted.load(std::memory_order_acquire)) {
+                    throw BarrierAborted();
+                }
+                _mm_pause();
+            }
+        }
+    }
+
+    void abort() {
+        aborted.store(true, std::memory_order_release);
+    }
+};
+
+/**
+ * Parse a cpu list like "0,2,4-7".
+ */
+std::vector<int> parse_cpu_list(const std::string& list);
+
+void pinToCpu(int cpu);
+
+/**
+ * Find the hyperthread sibling of cpu among the cpus in allowed, by comparing the core
+ * part of the x2APIC ids. Returns -1 if there is no sibling (e.g., SMT is disabled).
+ */
+int find_smt_sibling(int cpu, const cpu_set_t& allowed);
+
+/**
+ * Passed to the body of each thread by run_pinned: waits until every thread has called
+ * it, then spins until a shared TSC deadline and returns it.
+ */
+using StartGate = std::function<uint64_t()>;
+
+/**
+ * Run body(i, gate) on one thread per cpu in cpus, thread i pinned to cpus[i]. Each call
+ * to gate meets the other threads at a barrier and then all of them start at the same
+ * TSC deadline, sync_cycles after the last one arrived, so every thread calls gate the
+ * same number of times.
+ *
+ * If any thread fails, the barrier is aborted so the others stop too (gate throws
+ * BarrierAborted, which body should let through), and once all threads have exited the
+ * first failure is thrown.
+ */
+void run_pinned(const std::vector<int>& cpus, uint64_t sync_cycles,
+                const std::function<void(size_t, const StartGate&)>& body);
+
+/**
+ * Print the SMT summary to stderr: the mean of every column for the sibling test alone
+ * (base), and for the sibling and primary tests running together (sib and prim).
+ */
+void print_smt_summary(const char* test, int cpu, const char* sibling_test, int sibling_cpu,
+                       const std::vector<const char*>& headers, const std::vector<double>& base,
+                       const std::vector<double>& sib, const std::vector<double>& prim);
+
+#endif // #ifndef MULTI_CPU_H_
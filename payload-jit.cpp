@@ -0,0 +1,137 @@
+/*
+ * payload-jit.cpp
+ */
+
+#include "payload-jit.hpp"
+#include "x86-encoder.hpp"
+#include "misc.hpp"
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* a sanity limit on the size of the unrolled code */
+static constexpr size_t MAX_PAYLOAD_BYTES = 64 * 1024 * 1024;
+
+static std::runtime_error spec_error(const std::string& problem) {
+    return std::runtime_error("bad PAYLOAD: " + problem);
+}
+
+static std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos) {
+        return "";
+    }
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+/* the repeat count of a "rep N" statement, or 0 if stmt isn't one */
+static size_t rep_count(const std::string& stmt) {
+    if (stmt.compare(0, 3, "rep") != 0 || stmt.size() < 5 || !isspace(stmt[3])) {
+        return 0;
+    }
+    std::string count = trim(stmt.substr(3));
+    size_t pos = 0;
+    long long n = -1;
+    try {
+        n = std::stoll(count, &pos);
+    } catch (std::exception&) {
+    }
+    if (n <= 0 || pos != count.size()) {
+        throw spec_error("bad repeat count in '" + stmt + "'");
+    }
+    return n;
+}
+
+/*
+ * Assemble the list starting at pos into out, returning the position after it: the end
+ * of the spec for the top level, or just after the closing brace for a nested list.
+ */
+static size_t parse_list(const std::string& spec, size_t pos, bool nested, AssembledPayload& out) {
+    while (true) {
+        while (pos < spec.size() && (isspace(spec[pos]) || spec[pos] == ';')) {
+            pos++;
+        }
+        if (pos < spec.size() && spec[pos] == '#') {
+            pos = spec.find('\n', pos);
+            pos = pos == std::string::npos ? spec.size() : pos;
+            continue;
+        }
+        if (pos == spec.size()) {
+            if (nested) {
+                throw spec_error("missing }");
+            }
+            return pos;
+        }
+        if (spec[pos] == '}') {
+            if (!nested) {
+                throw spec_error("unexpected }");
+            }
+            return pos + 1;
+        }
+
+        size_t end = spec.find_first_of(";\n{}#", pos);
+        end = end == std::string::npos ? spec.size() : end;
+        std::string stmt = trim(spec.substr(pos, end - pos));
+        pos = end;
+
+        if (size_t count = rep_count(stmt)) {
+            if (pos == spec.size() || spec[pos] != '{') {
+                throw spec_error("expected { after '" + stmt + "'");
+            }
+            AssembledPayload body;
+            pos = parse_list(spec, pos + 1, true, body);
+            if (body.code.size() && count > (MAX_PAYLOAD_BYTES - out.code.size()) / body.code.size()) {
+                throw spec_error(string_format("more than %zu bytes of code", MAX_PAYLOAD_BYTES));
+            }
+            for (size_t i = 0; i < count; i++) {
+                out.code.insert(out.code.end(), body.code.begin(), body.code.end());
+            }
+            out.instructions += count * body.instructions;
+            out.isa = out.isa | body.isa;
+        } else {
+            if (pos < spec.size() && spec[pos] == '{') {
+                throw spec_error("unexpected { after '" + stmt + "'");
+            }
+            out.isa = out.isa | encode_instruction(stmt, out.code);
+            out.instructions++;
+            if (out.code.size() > MAX_PAYLOAD_BYTES) {
+                throw spec_error(string_format("more than %zu bytes of code", MAX_PAYLOAD_BYTES));
+            }
+        }
+    }
+}
+
+AssembledPayload assemble_payload(const std::string& spec) {
+    AssembledPayload ret;
+    parse_list(spec, 0, false, ret);
+    return ret;
+}
+
+JitPayload::JitPayload(const std::string& spec) : spec_{spec}, assembled{assemble_payload(spec)} {
+    std::vector<uint8_t> code = assembled.code;
+    code.push_back(0xC3); // ret
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    mapped = (code.size() + page - 1) / page * page;
+    mem = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error(std::string("mmap for the PAYLOAD code failed: ") + strerror(errno));
+    }
+    memcpy(mem, code.data(), code.size());
+    // never writable and executable at the same time
+    if (mprotect(mem, mapped, PROT_READ | PROT_EXEC)) {
+        int err = errno;
+        munmap(mem, mapped);
+        throw std::runtime_error(std::string("mprotect for the PAYLOAD code failed: ") + strerror(err));
+    }
+}
+
+JitPayload::~JitPayload() {
+    munmap(mem, mapped);
+}
@@ -0,0 +1,60 @@
+/*
+ * payload-jit.hpp
+ *
+ * Payloads assembled at runtime from a text spec (the PAYLOAD variable) rather than
+ * compiled in. A spec is a list of instructions (in the syntax of x86-encoder.hpp)
+ * separated by semicolons or newlines, where rep N { ... } repeats the enclosed list
+ * N times, unrolled like .rept, and # starts a comment running to the end of the line:
+ *
+ *     rep 1000 { vpord zmm0, zmm0, zmm1 }; vzeroupper
+ */
+
+#ifndef PAYLOAD_JIT_H_
+#define PAYLOAD_JIT_H_
+
+#include "common-cxx.hpp"
+#include "impl-list.hpp"
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+struct AssembledPayload {
+    std::vector<uint8_t> code;
+    /* the number of instructions after rep expansion */
+    size_t instructions = 0;
+    /* the ISA extensions beyond AVX2 that any instruction needs (see encode_instruction) */
+    AlgoFlags isa = NONE;
+};
+
+/**
+ * Assemble the given spec, not including the final ret. Throws std::runtime_error if
+ * the spec is malformed, has an instruction that can't be encoded, or is too big.
+ */
+AssembledPayload assemble_payload(const std::string& spec);
+
+/**
+ * A spec assembled into an executable mapping, callable as a bench_fn for as long as
+ * this object lives.
+ */
+class JitPayload {
+    std::string spec_;
+    AssembledPayload assembled;
+    void* mem;
+    size_t mapped;
+
+public:
+    explicit JitPayload(const std::string& spec);
+    ~JitPayload();
+
+    JitPayload(const JitPayload&) = delete;
+    JitPayload& operator=(const JitPayload&) = delete;
+
+    bench_fn* function() const { return reinterpret_cast<bench_fn*>(mem); }
+
+    const std::string& spec() const { return spec_; }
+
+    const AssembledPayload& info() const { return assembled; }
+};
+
+#endif // #ifndef PAYLOAD_JIT_H_
@@ -2,6 +2,7 @@
 #include "perf-timer.hpp"
 #include "misc.hpp"
 #include "perf-timer-events.hpp"
+#include "hedley.h"
 
 extern "C" {
 #include "jevents/rdpmc.h"
@@ -12,11 +13,19 @@ extern "C" {
 #include <string.h>
 #include <linux/perf_event.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
 
+#include <array>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
 static bool verbose;
 static bool debug; // lots of output
+static bool force_read;
+static bool multiplex;
 
 struct event_ctx {
     event_ctx(PerfEvent event, struct perf_event_attr attr, struct rdpmc_ctx jevent_ctx) :
@@ -30,8 +39,6 @@ struct event_ctx {
     struct rdpmc_ctx jevent_ctx;
 };
 
-std::vector<event_ctx> contexts;
-
 /**
  * If true, echo debugging info about the perf timer operation to stderr.
  * Defaults to false.
@@ -40,6 +47,14 @@ void set_verbose(bool v) {
     verbose = v;
 }
 
+void set_force_read(bool f) {
+    force_read = f;
+}
+
+void set_multiplex(bool m) {
+    multiplex = m;
+}
+
 #define vprint(...) do { if (verbose) fprintf(stderr, __VA_ARGS__ ); } while(false)
 
 /**
@@ -92,15 +107,145 @@ void list_events() {
     }
 }
 
-std::vector<bool> setup_counters(const std::vector<PerfEvent>& events) {
+/*
+ * What the rdpmc fast path needs from the mmap page of each counter, as of the page's
+ * seqlock value in lock: if the lock is still the same, so are the others.
+ */
+struct rdpmc_snapshot {
+    struct perf_event_mmap_page* page[MAX_COUNTERS];
+    uint32_t lock[MAX_COUNTERS];
+    /* the counter to pass to rdpmc, i.e., the page's index - 1 */
+    uint32_t counter[MAX_COUNTERS];
+    uint64_t offset[MAX_COUNTERS];
+    uint16_t pmc_width[MAX_COUNTERS];
+    /* false until the first take_snapshot() that finds all the counters on the PMU */
+    bool valid;
+};
+
+/*
+ * Refresh the snapshot, reading each page under its seqlock. Returns false if a counter
+ * isn't on the PMU (index 0), in which case the fast path can't be used.
+ */
+static bool take_snapshot(const std::vector<event_ctx>& contexts, rdpmc_snapshot& snap) {
+    snap.valid = false;
+    for (size_t i = 0; i < contexts.size(); i++) {
+        struct perf_event_mmap_page* buf = contexts[i].jevent_ctx.buf;
+        uint32_t seq, index;
+        do {
+            seq = buf->lock;
+            asm volatile("" ::: "memory");
+            index               = buf->index;
+            snap.offset[i]      = buf->offset;
+            snap.pmc_width[i]   = buf->pmc_width;
+            asm volatile("" ::: "memory");
+        } while (buf->lock != seq);
+        if (index == 0) {
+            return false;
+        }
+        snap.page[i]    = buf;
+        snap.lock[i]    = seq;
+        snap.counter[i] = index - 1;
+    }
+    snap.valid = true;
+    return true;
+}
+
+/*
+ * The fast path for N counters: all the rdpmcs back to back, between two loads of every
+ * page's lock, with a single check at the end that all the locks matched the snapshot
+ * both times. The folds unroll everything, so there are no loops or per-counter branches.
+ */
+template <size_t... I>
+static bool read_fast(rdpmc_snapshot& snap, event_counts& ret, std::index_sequence<I...>) {
+    uint32_t changed = !snap.valid;
+    changed |= (0u | ... | (snap.page[I]->lock ^ snap.lock[I]));
+    asm volatile("" ::: "memory");
+    uint64_t raw[sizeof...(I)] = {__builtin_ia32_rdpmc(snap.counter[I])...};
+    asm volatile("" ::: "memory");
+    changed |= (0u | ... | (snap.page[I]->lock ^ snap.lock[I]));
+    if (HEDLEY_UNLIKELY(changed)) {
+        return false;
+    }
+    ((ret.counts[I] = rdpmc_count(snap.offset[I], raw[I], snap.pmc_width[I])), ...);
+    return true;
+}
+
+template <size_t N>
+static bool read_fast_n(rdpmc_snapshot& snap, event_counts& ret) {
+    return read_fast(snap, ret, std::make_index_sequence<N>{});
+}
+
+/* read_fast_n<N + 1> at index N, for every N below MAX_COUNTERS */
+template <size_t... N>
+static constexpr auto make_fast_readers(std::index_sequence<N...>) {
+    return std::array<bool (*)(rdpmc_snapshot&, event_counts&), sizeof...(N)>{read_fast_n<N + 1>...};
+}
+
+static constexpr auto fast_readers = make_fast_readers(std::make_index_sequence<MAX_COUNTERS>{});
+
+CounterSet::CounterSet() : snapshot{new rdpmc_snapshot{}} {}
+
+CounterSet::~CounterSet() {
+    for (auto& c : contexts) {
+        rdpmc_close(&c.jevent_ctx);
+    }
+}
+
+CounterSet::CounterSet(CounterSet&& other) : contexts{std::move(other.contexts)}, use_read{other.use_read},
+        multiplexed{other.multiplexed}, fast_read{other.fast_read}, snapshot{new rdpmc_snapshot{}} {
+    std::swap(snapshot, other.snapshot);
+    other.contexts.clear();
+    other.fast_read = nullptr;
+}
+
+CounterSet& CounterSet::operator=(CounterSet&& other) {
+    if (this != &other) {
+        for (auto& c : contexts) {
+            rdpmc_close(&c.jevent_ctx);
+        }
+        contexts = std::move(other.contexts);
+        use_read = other.use_read;
+        multiplexed = other.multiplexed;
+        fast_read = other.fast_read;
+        std::swap(snapshot, other.snapshot);
+        other.contexts.clear();
+        other.fast_read = nullptr;
+    }
+    return *this;
+}
+
+/*
+ * The layout of a group read(): with PERF_FORMAT_GROUP and PERF_FORMAT_TOTAL_TIME_RUNNING
+ * that's the number of events, the time the group has been on the PMU, and then the value
+ * of each event, leader first, in the order they joined the group.
+ */
+constexpr uint64_t GROUP_READ_FORMAT = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+/*
+ * Without rdpmc, the index in the mmap page is always 0, so check that the group led by
+ * leader is actually on the PMU by reading it: a pinned group that can't be scheduled is
+ * in error state and reads as nothing, and one that never got on the PMU hasn't run.
+ */
+static bool group_running(int leader_fd) {
+    uint64_t buf[2 + MAX_COUNTERS];
+    ssize_t bytes = ::read(leader_fd, buf, sizeof(buf));
+    return bytes >= (ssize_t)(2 * sizeof(uint64_t)) && buf[1] != 0;
+}
+
+std::vector<bool> CounterSet::setup(const std::vector<PerfEvent>& events) {
 
     std::vector<bool> results;
 
+    if (contexts.empty()) {
+        multiplexed = multiplex;
+    }
+
     for (auto& e : events) {
         bool ok = false;
 
-        if (contexts.size() == MAX_COUNTERS) {
-            fprintf(stderr, "Unable to program event %s, MAX_COUNTERS (%zu) reached\n", e.name, MAX_COUNTERS);
+        if (contexts.size() == capacity()) {
+            fprintf(stderr, "Unable to program event %s, %s (%zu) reached\n", e.name,
+                    multiplexed ? "MAX_MUX_COUNTERS" : "MAX_COUNTERS", capacity());
         } else {
             // fprintf(stderr, "Enabling event %s (%s)\n", e->short_name, e->name);
             struct perf_event_attr attr = {};
@@ -110,18 +255,38 @@ std::vector<bool> setup_counters(const std::vector<PerfEvent>& events) {
                 fprintf(stderr, "jevents error %2d: %s\n", err, jevent_error_to_string(err));
                 fprintf(stderr, "jevents details : %s\n", jevent_get_error_details());
             } else {
+                // the first event leads a group holding all the others, so they are scheduled
+                // together, and can all be read at once with read() on the leader, unless
+                // multiplexing, where each event is on its own so the kernel can rotate them
+                struct rdpmc_ctx* leader = contexts.empty() || multiplexed ? nullptr : &contexts.front().jevent_ctx;
                 struct rdpmc_ctx ctx = {};
                 attr.sample_period = 0;
-                // pinned makes the counter stay on the CPU and fail fast if it can't be allocated: we
-                // can check right away if index == 0 which means failure
-                attr.pinned = 1;
-                // attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
-                int ret;
-                if ((ret = rdpmc_open_attr(&attr, &ctx, 0)) || ctx.buf->index == 0) {
+                // pinned makes the group stay on the CPU and fail fast if it can't be allocated: we
+                // can check right away if index == 0 which means failure (only the leader can be pinned)
+                attr.pinned = !leader && !multiplexed;
+                attr.read_format = multiplexed ? PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING : GROUP_READ_FORMAT;
+                int ret = rdpmc_open_attr(&attr, &ctx, leader);
+                if (!ret && contexts.empty()) {
+                    // without rdpmc (e.g., cap_user_rdpmc is off) the index is always 0
+                    use_read = force_read || !ctx.buf->cap_user_rdpmc;
+                }
+                // a multiplexed event is off the PMU whenever it's rotated out, which isn't a failure
+                auto on_pmu = [&] {
+                    return multiplexed || (use_read ? group_running(leader ? leader->fd : ctx.fd) : ctx.buf->index != 0);
+                };
+                if (ret || !on_pmu()) {
                     fprintf(stderr, "Failed to program event '%s' (reason: %s). \n\tResolved to: ", e.name,
-                            ret ? "rdpmc_open_attr failed" : "no index, probably too many or incompatible events");
+                            ret ? "rdpmc_open_attr failed" : "not on the PMU, probably too many or incompatible events");
                     printf_perf_attr(stderr, &attr);
                     fprintf(stderr, "\n");
+                    if (!ret) {
+                        rdpmc_close(&ctx);
+                        if (leader) {
+                            // a member that can't be scheduled puts the pinned group in error
+                            // state, so once it is gone get the rest of the group going again
+                            ioctl(leader->fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+                        }
+                    }
                 } else {
                     contexts.emplace_back(e, attr, ctx);
                     ok = true;
@@ -144,6 +309,12 @@ std::vector<bool> setup_counters(const std::vector<PerfEvent>& events) {
         }
     }
 
+    // the fast path needs rdpmc and a group that's always on the PMU, and it skips the debug output
+    fast_read = use_read || multiplexed || debug || contexts.empty() ? nullptr : fast_readers[contexts.size() - 1];
+    if (fast_read) {
+        take_snapshot(contexts, *snapshot);
+    }
+
     assert(results.size() == events.size());
     return results;
 }
@@ -155,8 +326,11 @@ std::vector<bool> setup_counters(const std::vector<PerfEvent>& events) {
  * Read the current value of a running performance counter.
  * This should only be called from the same thread/process as opened
  * the context. For new threads please create a new context.
+ *
+ * If enabled and running aren't null, they get the time the counter has
+ * been enabled and running, brought up to date from the TSC.
  */
-unsigned long long rdpmc_readx(event_ctx *ctx)
+unsigned long long rdpmc_readx(const event_ctx *ctx, uint64_t *enabled = nullptr, uint64_t *running = nullptr)
 {
     typedef uint64_t u64;
 #define rmb() asm volatile("" ::: "memory")
@@ -167,6 +341,10 @@ unsigned long long rdpmc_readx(event_ctx *ctx)
 	struct perf_event_mmap_page *buf = ctx->jevent_ctx.buf;
 	unsigned index;
     bool lockok = true;
+    bool user_time = false;
+    u64 cyc = 0, time_offset = 0;
+    uint32_t time_mult = 0;
+    uint16_t time_shift = 0;
 
 	do {
 		seq = buf->lock;
@@ -175,6 +353,13 @@ unsigned long long rdpmc_readx(event_ctx *ctx)
 		offset = buf->offset;
         time_enabled = buf->time_enabled;
         time_running = buf->time_running;
+        if (enabled && buf->cap_user_time) {
+            user_time   = true;
+            cyc         = rdtsc();
+            time_offset = buf->time_offset;
+            time_mult   = buf->time_mult;
+            time_shift  = buf->time_shift;
+        }
 		if (index == 0) { /* rdpmc not allowed */
             val = 0;
             rmb();
@@ -189,8 +374,23 @@ unsigned long long rdpmc_readx(event_ctx *ctx)
 		rmb();
 	} while (buf->lock != seq);
 
-    u64 res  = val + offset;
-    u64 res2 = (res << (64 - buf->pmc_width)) >> (64 - buf->pmc_width);
+    u64 res2 = rdpmc_count(offset, val, buf->pmc_width);
+
+    if (enabled) {
+        if (user_time) {
+            // the times are as of the last time the kernel updated the page, so add the
+            // time since then, converted from TSC ticks as perf_event.h describes
+            u64 quot  = cyc >> time_shift;
+            u64 rem   = cyc & (((u64)1 << time_shift) - 1);
+            u64 delta = time_offset + quot * time_mult + ((rem * time_mult) >> time_shift);
+            time_enabled += delta;
+            if (index) {
+                time_running += delta;
+            }
+        }
+        *enabled = time_enabled;
+        *running = time_running;
+    }
 
     if (debug) {
         vprint("read counter %-30s ", ctx->event.name);
@@ -198,7 +398,6 @@ unsigned long long rdpmc_readx(event_ctx *ctx)
         APPEND_LOCAL(lockok, 1);
         APPEND_LOCAL(val, 013);
         APPEND_LOCAL(offset, 013);
-        // APPEND_LOCAL(res, 013);
         APPEND_LOCAL(res2, 012);
         APPEND_LOCAL(time_enabled, 08);
         APPEND_LOCAL(time_running, 08);
@@ -209,18 +408,155 @@ unsigned long long rdpmc_readx(event_ctx *ctx)
 }
 
 
-event_counts read_counters() {
+/*
+ * Read the whole group with one read() on the leader (see GROUP_READ_FORMAT): the values
+ * are in the order of contexts.
+ */
+static event_counts read_group(const std::vector<event_ctx>& contexts) {
+    uint64_t buf[2 + MAX_COUNTERS];
+    ssize_t bytes = ::read(contexts.front().jevent_ctx.fd, buf, sizeof(buf));
+    if (bytes < (ssize_t)(sizeof(uint64_t) * (2 + contexts.size())) || buf[0] != contexts.size()) {
+        // e.g., a pinned group in error state reads as 0 bytes
+        throw std::runtime_error("reading the perf event group failed, it may not be scheduled on the PMU");
+    }
     event_counts ret{uninit_tag{}};
+    for (size_t i = 0; i < contexts.size(); i++) {
+        ret.counts[i] = buf[2 + i];
+    }
+    return ret;
+}
+
+/*
+ * Read each multiplexed counter with its own read(), which gives its value followed
+ * by the time it has been enabled and running (PERF_FORMAT_TOTAL_TIME_ENABLED and
+ * PERF_FORMAT_TOTAL_TIME_RUNNING).
+ */
+static void read_each(const std::vector<event_ctx>& contexts, mux_counts& ret) {
+    for (size_t i = 0; i < contexts.size(); i++) {
+        uint64_t buf[3];
+        if (::read(contexts[i].jevent_ctx.fd, buf, sizeof(buf)) != sizeof(buf)) {
+            throw std::runtime_error(std::string("reading perf event ") + contexts[i].event.name + " failed");
+        }
+        ret.counts[i]  = buf[0];
+        ret.enabled[i] = buf[1];
+        ret.running[i] = buf[2];
+    }
+}
+
+event_counts CounterSet::read() const {
+    assert(!multiplexed);
+    if (use_read && !contexts.empty()) {
+        return read_group(contexts);
+    }
+    event_counts ret{uninit_tag{}};
+    if (fast_read) {
+        // if a page changed (e.g., the group was rescheduled), refresh the snapshot and
+        // try again, and if a counter is off the PMU, fall back to the slow path below
+        for (int tries = 0; tries < 3; tries++) {
+            if (HEDLEY_LIKELY(fast_read(*snapshot, ret))) {
+                return ret;
+            }
+            if (!take_snapshot(contexts, *snapshot)) {
+                break;
+            }
+        }
+    }
     for (size_t i = 0; i < contexts.size(); i++) {
         ret.counts[i] = rdpmc_readx(&contexts[i]);
     }
     return ret;
 }
 
-size_t num_counters() {
+void CounterSet::read_mux(mux_counts& out) const {
+    assert(multiplexed);
+    if (use_read) {
+        read_each(contexts, out);
+        return;
+    }
+    for (size_t i = 0; i < contexts.size(); i++) {
+        out.counts[i] = rdpmc_readx(&contexts[i], &out.enabled[i], &out.running[i]);
+    }
+}
+
+bool CounterSet::uses_read() const {
+    return use_read;
+}
+
+bool CounterSet::is_multiplexed() const {
+    return multiplexed;
+}
+
+size_t CounterSet::capacity() const {
+    // until the first setup() the counters will follow the current set_multiplex()
+    return (contexts.empty() ? multiplex : multiplexed) ? MAX_MUX_COUNTERS : MAX_COUNTERS;
+}
+
+void CounterSet::set_enabled(bool enabled) {
+    int request = enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE;
+    if (multiplexed) {
+        for (auto& c : contexts) {
+            ioctl(c.jevent_ctx.fd, request, 0);
+        }
+    } else if (!contexts.empty()) {
+        ioctl(contexts.front().jevent_ctx.fd, request, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+bool events_fit(const std::vector<PerfEvent>& events) {
+    if (events.size() > MAX_COUNTERS) {
+        return false;
+    }
+    std::vector<int> fds;
+    bool fit = true;
+    for (auto& e : events) {
+        struct perf_event_attr attr = {};
+        if (jevent_name_to_attr(e.event_string, &attr)) {
+            fit = false;
+            break;
+        }
+        attr.pinned = fds.empty();
+        attr.read_format = GROUP_READ_FORMAT;
+        // perf_event_open directly rather than rdpmc_open_attr, which perrors on failure
+        int fd = perf_event_open(&attr, 0, -1, fds.empty() ? -1 : fds.front(), 0);
+        if (fd < 0) {
+            // these just mean the event doesn't exist or can't join the group, anything
+            // else (e.g., EACCES) will fail the real setup too, so say why
+            if (errno != EINVAL && errno != ENOENT && errno != EOPNOTSUPP) {
+                fprintf(stderr, "perf_event_open for %s failed: %s\n", e.name, strerror(errno));
+            }
+            fit = false;
+            break;
+        }
+        fds.push_back(fd);
+    }
+    fit = fit && (fds.empty() || group_running(fds.front()));
+    for (int fd : fds) {
+        close(fd);
+    }
+    return fit;
+}
+
+size_t CounterSet::size() const {
     return contexts.size();
 }
 
+CounterSet& default_counters() {
+    static CounterSet counters;
+    return counters;
+}
+
+std::vector<bool> setup_counters(const std::vector<PerfEvent>& events) {
+    return default_counters().setup(events);
+}
+
+event_counts read_counters() {
+    return default_counters().read();
+}
+
+size_t num_counters() {
+    return default_counters().size();
+}
+
 event_counts calc_delta(event_counts before, event_counts after, size_t max_event) {
     event_counts ret(uninit_tag{});
     size_t limit = std::min(max_event, MAX_COUNTERS);
@@ -3,12 +3,18 @@
 #define PERF_TIMER_H_
 
 #include <cinttypes>
+#include <cmath>
 #include <cstddef>
 #include <cstring>
+#include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
+/* the most counters in a (pinned) group, which is all event_counts has room for */
 constexpr size_t MAX_COUNTERS = 8;
+/* the most counters when they are multiplexed, see mux_counts */
+constexpr size_t MAX_MUX_COUNTERS = 16;
 
 struct PerfEvent {
     const char *name;
@@ -45,26 +51,160 @@ struct event_counts {
     }
 };
 
+/**
+ * The counts of multiplexed counters (see set_multiplex), along with the time in ns
+ * each has been enabled and running on the PMU, needed to scale them. Kept apart from
+ * event_counts so that pinned counters, which never need scaling, don't pay for it.
+ */
+struct mux_counts {
+    uint64_t counts[MAX_MUX_COUNTERS];
+    uint64_t enabled[MAX_MUX_COUNTERS];
+    uint64_t running[MAX_MUX_COUNTERS];
+};
+
+/**
+ * The factor to scale a count by given how long its counter was enabled and running
+ * over an interval: 1 if it ran the whole time, enabled / running if it was only on the PMU part of
+ * the time, and NaN if it never ran, as there is nothing to extrapolate from.
+ */
+static inline double scale_factor(uint64_t enabled_delta, uint64_t running_delta) {
+    if (running_delta >= enabled_delta) {
+        return 1;
+    }
+    return running_delta ? (double)enabled_delta / running_delta : std::numeric_limits<double>::quiet_NaN();
+}
+
+/**
+ * The count of a counter read with rdpmc: the raw pmc_width-bit counter value, sign
+ * extended, plus the offset from the perf mmap page, as perf_event.h describes. The
+ * kernel folds the counter into the offset whenever it overflows, so the result is a
+ * full 64-bit count that doesn't wrap at 2^pmc_width.
+ */
+static inline uint64_t rdpmc_count(uint64_t offset, uint64_t raw, unsigned pmc_width) {
+    int64_t pmc = (int64_t)(raw << (64 - pmc_width)) >> (64 - pmc_width);
+    return offset + pmc;
+}
+
 void set_verbose(bool verbose);
 
+/**
+ * Read the counters with a read() of the whole group rather than rdpmc, even where
+ * rdpmc is allowed. Slower, but useful to check one against the other.
+ */
+void set_force_read(bool force_read);
+
+/**
+ * Open each counter as its own non-pinned event rather than as one pinned group, so
+ * that the kernel multiplexes them when there are more than the PMU has, and track
+ * the enabled and running times needed to scale their counts (see scale_factor).
+ */
+void set_multiplex(bool multiplex);
+
 void list_events();
 
+struct event_ctx;
+struct rdpmc_snapshot;
+
 /**
- * Sets up the PMU to record the given events. Currently doesn't remove
- * any events set up earlier, so the list will keep growing (often you)
- * just set up counters once for the lifetime of the process.
+ * A set of PMU counters opened for, and readable only from, the thread that
+ * called setup(). Each thread that wants to measure itself creates its own
+ * CounterSet: reading one touches no shared state and takes no locks.
+ *
+ * The counters are opened as a single perf event group, led by the first one,
+ * so the kernel schedules them onto the PMU all together or not at all. They
+ * are read with rdpmc where the kernel allows it (cap_user_rdpmc), and otherwise
+ * with a single read() of the whole group (PERF_FORMAT_GROUP). With multiplexing
+ * on, each counter is instead its own event, and read() reads them one by one.
  *
- * Returns a list of indexes, corresponding to the past events: the index
- * is the location in event_counts where you'll find the corresponding
- * counter.
+ * The counters are closed when the CounterSet is destroyed.
+ */
+class CounterSet {
+    std::vector<event_ctx> contexts;
+    bool use_read = false;
+    bool multiplexed = false;
+    /* the rdpmc fast path, if it applies to these counters, see read() */
+    bool (*fast_read)(rdpmc_snapshot&, event_counts&) = nullptr;
+    std::unique_ptr<rdpmc_snapshot> snapshot;
+
+public:
+    CounterSet();
+    ~CounterSet();
+
+    CounterSet(const CounterSet&) = delete;
+    CounterSet& operator=(const CounterSet&) = delete;
+    CounterSet(CounterSet&&);
+    CounterSet& operator=(CounterSet&&);
+
+    /**
+     * Sets up the PMU to record the given events for the calling thread. Doesn't
+     * remove any events set up earlier, so the list will keep growing (often you
+     * just set up counters once for the lifetime of the set).
+     *
+     * Returns one entry per passed event, true if the event was programmed
+     * successfully: successful events occupy consecutive slots in event_counts in
+     * the order they were passed.
+     */
+    std::vector<bool> setup(const std::vector<PerfEvent>& events);
+
+    /**
+     * Read all the counters, must be called from the thread that called setup().
+     *
+     * With rdpmc and a pinned group, read() reuses the index and offset of every
+     * counter from the last time their mmap pages changed, and just issues one rdpmc
+     * per counter back to back, checking once that none of the pages changed.
+     *
+     * Multiplexed counters are read with read_mux() instead.
+     */
+    event_counts read() const;
+
+    /**
+     * Read multiplexed counters, with their enabled and running times, into out. Must
+     * be called from the thread that called setup().
+     */
+    void read_mux(mux_counts& out) const;
+
+    /* number of succesfully programmed counters */
+    size_t size() const;
+
+    /** true if read() uses the read() system call rather than rdpmc */
+    bool uses_read() const;
+
+    /** true if the counters were opened to be multiplexed, see set_multiplex() */
+    bool is_multiplexed() const;
+
+    /** the most counters setup() can program: MAX_MUX_COUNTERS if multiplexed, else MAX_COUNTERS */
+    size_t capacity() const;
+
+    /**
+     * Stop (false) or restart (true) counting. Disabled counters don't take up any room
+     * on the PMU, so another set can be enabled in their place.
+     */
+    void set_enabled(bool enabled);
+};
+
+/**
+ * The free functions below operate on a process-wide default CounterSet, and
+ * so have the same restriction: only the thread that called setup_counters
+ * may read them.
  */
+CounterSet& default_counters();
+
+/** default_counters().setup(events) */
 std::vector<bool> setup_counters(const std::vector<PerfEvent>& events);
 
+/** default_counters().read() */
 event_counts read_counters();
 
-/* number of succesfully programmed counters */
+/** default_counters().size() */
 size_t num_counters();
 
+/**
+ * True if the kernel will put all the events on the PMU at once, as one pinned group,
+ * found by opening them as one and closing them again. Unlike setup(), this prints
+ * nothing for events that simply don't fit or don't exist.
+ */
+bool events_fit(const std::vector<PerfEvent>& events);
+
 /**
  * Calculate the delta between two event sets, up to max_event if specified.
  *
@@ -0,0 +1,144 @@
+/*
+ * quantile-sketch.hpp
+ *
+ * Constant-memory streaming quantile estimation using the P-square algorithm
+ * (Jain & Chlamtac, "The P² algorithm for dynamic calculation of quantiles and
+ * histograms without storing observations", CACM 1985), extended to track several
+ * quantiles at once: for Q quantiles the sketch keeps 2Q+3 markers, the first and
+ * last of which are the exact minimum and maximum.
+ *
+ * Until 2Q+3 values have been seen the sketch holds them exactly and quantiles are
+ * interpolated from the sorted values.
+ */
+
+#ifndef QUANTILE_SKETCH_H_
+#define QUANTILE_SKETCH_H_
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cinttypes>
+#include <cmath>
+#include <limits>
+
+/**
+ * The quantiles tracked by a family of sketches. Kept separately from the sketches
+ * themselves since it is the same for every sketch and we may have a great many of them.
+ */
+template <size_t Q>
+struct PSquareSpec {
+    static constexpr size_t M = 2 * Q + 3;
+    /* the cumulative probability each marker tracks */
+    std::array<double, M> dp;
+
+    /** quantiles must be strictly increasing and in (0, 1) */
+    PSquareSpec(const std::array<double, Q>& quantiles) {
+        dp[0] = 0;
+        double prev = 0;
+        for (size_t i = 0; i < Q; i++) {
+            assert(quantiles[i] > prev && quantiles[i] < 1);
+            dp[2 * i + 1] = (prev + quantiles[i]) / 2;
+            dp[2 * i + 2] = quantiles[i];
+            prev = quantiles[i];
+        }
+        dp[M - 2] = (prev + 1) / 2;
+        dp[M - 1] = 1;
+    }
+};
+
+template <size_t Q>
+class PSquareSketch {
+    static constexpr size_t M = PSquareSpec<Q>::M;
+
+    /* marker heights, and actual marker positions (0-based) */
+    double q[M];
+    int32_t n[M];
+    uint32_t count;
+
+    double parabolic(size_t i, int s) const {
+        double n0 = n[i - 1], n1 = n[i], n2 = n[i + 1];
+        return q[i] + s / (n2 - n0) * ((n1 - n0 + s) * (q[i + 1] - q[i]) / (n2 - n1) +
+                                       (n2 - n1 - s) * (q[i] - q[i - 1]) / (n1 - n0));
+    }
+
+    double linear(size_t i, int s) const {
+        return q[i] + s * (q[i + s] - q[i]) / (n[i + s] - n[i]);
+    }
+
+    /* interpolated quantile over the first count (sorted) exact values */
+    double exact(double p) const {
+        double pos = p * (count - 1);
+        size_t lo  = (size_t)pos;
+        if (lo + 1 >= count) {
+            return q[count - 1];
+        }
+        return q[lo] + (pos - lo) * (q[lo + 1] - q[lo]);
+    }
+
+public:
+    PSquareSketch() : q{}, n{}, count{0} {}
+
+    uint32_t size() const { return count; }
+
+    void add(const PSquareSpec<Q>& spec, double x) {
+        if (count < M) {
+            // still in the exact phase: keep q sorted
+            size_t i = count++;
+            while (i > 0 && q[i - 1] > x) {
+                q[i] = q[i - 1];
+                i--;
+            }
+            q[i] = x;
+            if (count == M) {
+                for (size_t j = 0; j < M; j++) {
+                    n[j] = j;
+                }
+            }
+            return;
+        }
+
+        size_t k;
+        if (x < q[0]) {
+            q[0] = x;
+            k    = 0;
+        } else if (x >= q[M - 1]) {
+            q[M - 1] = x;
+            k        = M - 2;
+        } else {
+            k = 0;
+            while (x >= q[k + 1]) {
+                k++;
+            }
+        }
+        for (size_t i = k + 1; i < M; i++) {
+            n[i]++;
+        }
+        count++;
+
+        for (size_t i = 1; i < M - 1; i++) {
+            double desired = (count - 1) * spec.dp[i];
+            double d       = desired - n[i];
+            if ((d >= 1 && n[i + 1] - n[i] > 1) || (d <= -1 && n[i - 1] - n[i] < -1)) {
+                int s     = d > 0 ? 1 : -1;
+                double qp = parabolic(i, s);
+                q[i]      = (q[i - 1] < qp && qp < q[i + 1]) ? qp : linear(i, s);
+                n[i] += s;
+            }
+        }
+    }
+
+    double min() const { return count ? q[0] : std::numeric_limits<double>::quiet_NaN(); }
+
+    double max() const { return count ? (count < M ? q[count - 1] : q[M - 1]) : std::numeric_limits<double>::quiet_NaN(); }
+
+    /** the estimate of the idx-th quantile from the spec */
+    double quantile(const PSquareSpec<Q>& spec, size_t idx) const {
+        assert(idx < Q);
+        if (count == 0) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        return count < M ? exact(spec.dp[2 * idx + 2]) : q[2 * idx + 2];
+    }
+};
+
+#endif // #ifndef QUANTILE_SKETCH_H_
@@ -0,0 +1,122 @@
+/*
+ * schedule.cpp
+ */
+
+#include "schedule.hpp"
+#include "misc.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+static std::runtime_error schedule_error(const std::string& item, const std::string& problem) {
+    return std::runtime_error("bad schedule item '" + item + "': " + problem);
+}
+
+/* parse a duration like 20us or 5000cyc into TSC cycles */
+static uint64_t parse_duration(const std::string& item, const std::string& token, double tsc_freq) {
+    size_t pos = 0;
+    double value;
+    try {
+        value = std::stod(token, &pos);
+    } catch (std::exception&) {
+        throw schedule_error(item, "bad duration " + token);
+    }
+    std::string unit = token.substr(pos);
+    double cycles;
+    if (unit == "cyc") {
+        cycles = value;
+    } else if (unit == "ns") {
+        cycles = value * tsc_freq / 1e9;
+    } else if (unit == "us") {
+        cycles = value * tsc_freq / 1e6;
+    } else if (unit == "ms") {
+        cycles = value * tsc_freq / 1e3;
+    } else {
+        throw schedule_error(item, "duration " + token + " needs one of the units ns, us, ms or cyc");
+    }
+    if (!(cycles >= 1)) {
+        throw schedule_error(item, "duration must be at least one cycle");
+    }
+    return cycles;
+}
+
+/* parse a positive count like 50 (for loop) or x3 (after the x has been stripped) */
+static size_t parse_count(const std::string& item, const std::string& token) {
+    size_t pos = 0;
+    long long count = -1;
+    try {
+        count = std::stoll(token, &pos);
+    } catch (std::exception&) {
+    }
+    if (count <= 0 || pos != token.size()) {
+        throw schedule_error(item, "bad count " + token);
+    }
+    return count;
+}
+
+Schedule parse_schedule(const std::string& text, double tsc_freq) {
+    Schedule ret;
+    bool have_loop = false;
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        line = line.substr(0, line.find('#'));
+        for (auto& item : split(line, ",")) {
+            std::istringstream ts(item);
+            std::vector<std::string> tokens;
+            std::string token;
+            while (ts >> token) {
+                tokens.push_back(token);
+            }
+            if (tokens.empty()) {
+                continue;
+            }
+
+            if (tokens[0] == "loop") {
+                if (tokens.size() != 2) {
+                    throw schedule_error(item, "expected: loop COUNT");
+                }
+                if (have_loop) {
+                    throw schedule_error(item, "only one loop count is allowed");
+                }
+                ret.loop_count = parse_count(item, tokens[1]);
+                have_loop = true;
+                continue;
+            }
+
+            if (tokens.size() < 2 || tokens.size() > 3) {
+                throw schedule_error(item, "expected: TEST DURATION [xCOUNT]");
+            }
+            const test_description* test = get_by_name(tokens[0]);
+            if (!test) {
+                throw schedule_error(item, "no test named " + tokens[0]);
+            }
+            uint64_t cycles = parse_duration(item, tokens[1], tsc_freq);
+            size_t count = 1;
+            if (tokens.size() == 3) {
+                if (tokens[2][0] != 'x') {
+                    throw schedule_error(item, "expected xCOUNT, not " + tokens[2]);
+                }
+                count = parse_count(item, tokens[2].substr(1));
+            }
+            for (size_t i = 0; i < count; i++) {
+                ret.phases.push_back({test, cycles});
+            }
+        }
+    }
+    if (ret.phases.empty()) {
+        throw std::runtime_error("schedule has no phases");
+    }
+    return ret;
+}
+
+Schedule load_schedule(const std::string& path, double tsc_freq) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("can't open schedule file " + path);
+    }
+    std::stringstream contents;
+    contents << in.rdbuf();
+    return parse_schedule(contents.str(), tsc_freq);
+}
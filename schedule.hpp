@@ -0,0 +1,85 @@
+/*
+ * schedule.hpp
+ *
+ * Multi-phase payload schedules: a sequence of (test, duration) phases which are run
+ * back to back, the whole sequence repeated some number of times. The text form is a
+ * list of items separated by commas or newlines, with # starting a comment:
+ *
+ *     vporzmm_vz100 20us, dummy 500us
+ *     vporymm_vz100 100us x2   # two back-to-back phases of 100us each
+ *     loop 50
+ *
+ * Durations take one of the suffixes ns, us, ms or cyc (TSC cycles).
+ */
+
+#ifndef SCHEDULE_H_
+#define SCHEDULE_H_
+
+#include "impl-list.hpp"
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+struct SchedulePhase {
+    const test_description* test;
+    /* the length of the phase in TSC cycles */
+    uint64_t cycles;
+};
+
+struct Schedule {
+    std::vector<SchedulePhase> phases;
+    /* how many times the whole list of phases is run */
+    size_t loop_count = 1;
+
+    /** the length of one pass through all the phases, in TSC cycles */
+    uint64_t loop_cycles() const {
+        uint64_t total = 0;
+        for (auto& p : phases) {
+            total += p.cycles;
+        }
+        return total;
+    }
+};
+
+/**
+ * Parse a schedule from its text form, converting durations to TSC cycles using
+ * tsc_freq (in Hz). Throws std::runtime_error if the schedule is malformed.
+ */
+Schedule parse_schedule(const std::string& text, double tsc_freq);
+
+/** parse the schedule in the given file */
+Schedule load_schedule(const std::string& path, double tsc_freq);
+
+/**
+ * Tracks the current phase of a schedule as time passes: the first phase starts at
+ * start_tsc and after the last phase the schedule wraps around to the first.
+ */
+class PhaseCursor {
+    const std::vector<SchedulePhase>& phases;
+    size_t idx;
+    uint64_t deadline;
+
+public:
+    PhaseCursor(const Schedule& schedule, uint64_t start_tsc)
+        : phases{schedule.phases}, idx{0}, deadline{phases.empty() ? -1ull : start_tsc + phases[0].cycles} {}
+
+    /** the test to run at time tsc, which must not go backwards between calls */
+    const test_description* at(uint64_t tsc) {
+        while (tsc >= deadline) {
+            if (++idx == phases.size()) {
+                idx = 0;
+            }
+            deadline += phases[idx].cycles;
+        }
+        return phases[idx].test;
+    }
+
+    /** the index of the current phase */
+    size_t index() const { return idx; }
+
+    /** the TSC at which the current phase ends */
+    uint64_t next_deadline() const { return deadline; }
+};
+
+#endif // #ifndef SCHEDULE_H_
@@ -9,6 +9,9 @@ set -e
 # as MHZ.
 export MHZ=${MHZ:=3192}
 
+# number of repeats of each test, each written to its own -N.csv file
+export REPEATS=${REPEATS:=3}
+
 # https://stackoverflow.com/a/12694189
 SCRIPTDIR="${BASH_SOURCE%/*}"
 if [[ ! -d "$DIR" ]]; then DIR="$PWD"; fi
@@ -44,7 +47,7 @@ function run_one {
         return
     fi
     ./bench $test_name > "$TEMPDIR/temp.csv"
-    for i in {0..2}; do
+    for ((i = 0; i < REPEATS; i++)); do
         egrep -B1 "^${i}," "$TEMPDIR/temp.csv" > "$RESULTDIR/$PREFIX-$test_name${3}-${i}.csv"
     done
 }
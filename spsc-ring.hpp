@@ -0,0 +1,88 @@
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+/**
+ * A fixed-capacity, lock-free, single-producer single-consumer ring buffer.
+ *
+ * Exactly one thread may call try_push() and exactly one (other) thread may
+ * call try_pop(). The capacity is rounded up to a power of two and never
+ * changes, so memory use is constant regardless of how many elements flow
+ * through the ring.
+ *
+ * Each side keeps a cached copy of the other side's index so that in the
+ * common case push and pop touch only their own cache line.
+ */
+template <typename T>
+class SpscRing {
+    std::vector<T> buf;
+    size_t mask;
+
+    // written by the producer, read by the consumer
+    alignas(64) std::atomic<size_t> head;
+    size_t cached_tail;
+
+    // written by the consumer, read by the producer
+    alignas(64) std::atomic<size_t> tail;
+    size_t cached_head;
+
+    static size_t round_up_pow2(size_t v) {
+        size_t ret = 1;
+        while (ret < v) {
+            ret <<= 1;
+        }
+        return ret;
+    }
+
+public:
+    explicit SpscRing(size_t capacity)
+        : buf(round_up_pow2(capacity)), mask{buf.size() - 1}, head{0}, cached_tail{0}, tail{0}, cached_head{0} {
+        assert(capacity > 0);
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    size_t capacity() const { return buf.size(); }
+
+    /** producer side: returns false, without blocking, if the ring is full */
+    bool try_push(const T& val) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - cached_tail == buf.size()) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h - cached_tail == buf.size()) {
+                return false;
+            }
+        }
+        buf[h & mask] = val;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** consumer side: returns false, without blocking, if the ring is empty */
+    bool try_pop(T& out) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == cached_head) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t == cached_head) {
+                return false;
+            }
+        }
+        out = buf[t & mask];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** reset to empty: only safe when neither side is active */
+    void reset() {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        cached_head = cached_tail = 0;
+    }
+};
+
+#endif // #ifndef SPSC_RING_H_
@@ -0,0 +1,165 @@
+/*
+ * trace-file.cpp
+ */
+
+#include "trace-file.hpp"
+#include "csv-emitter.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::runtime_error trace_error(const std::string& what, const std::string& path) {
+    return std::runtime_error(what + " for trace " + path + ": " + strerror(errno));
+}
+
+static size_t align64(size_t v) {
+    return (v + 63) & ~(size_t)63;
+}
+
+TraceWriter::TraceWriter(const std::string& path, const std::vector<TraceColumn>& columns, size_t row_capacity,
+                         const TraceInfo& info)
+    : path{path}, fd{-1}, base{nullptr}, map_size{0}, header{nullptr} {
+    size_t data_offset = align64(sizeof(TraceHeader) + columns.size() * sizeof(TraceColumnDesc));
+    map_size = data_offset + columns.size() * align64(row_capacity * sizeof(uint64_t));
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw trace_error("open failed", path);
+    }
+    if (ftruncate(fd, map_size)) {
+        close(fd);
+        throw trace_error("ftruncate failed", path);
+    }
+    void* p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        throw trace_error("mmap failed", path);
+    }
+    base   = static_cast<char*>(p);
+    header = reinterpret_cast<TraceHeader*>(base);
+
+    memcpy(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header->version      = TRACE_VERSION;
+    header->column_count = columns.size();
+    header->row_count    = 0;
+    header->row_capacity = row_capacity;
+    header->data_offset  = data_offset;
+    header->tsc_freq     = info.tsc_freq;
+    header->family       = info.family;
+    header->model        = info.model;
+    header->stepping     = info.stepping;
+    strncpy(header->brand, info.brand.c_str(), sizeof(header->brand) - 1);
+
+    auto descs = reinterpret_cast<TraceColumnDesc*>(base + sizeof(TraceHeader));
+    for (size_t i = 0; i < columns.size(); i++) {
+        strncpy(descs[i].name, columns[i].name.c_str(), sizeof(descs[i].name) - 1);
+        descs[i].format = columns[i].format;
+        cols.push_back(reinterpret_cast<uint64_t*>(base + data_offset + i * align64(row_capacity * sizeof(uint64_t))));
+    }
+}
+
+TraceWriter::~TraceWriter() {
+    munmap(base, map_size);
+    close(fd);
+}
+
+void TraceWriter::set(size_t col, size_t row, double val) {
+    memcpy(cols[col] + row, &val, sizeof(val));
+}
+
+void TraceWriter::set_row_count(size_t rows) {
+    if (rows > header->row_capacity) {
+        throw std::logic_error("trace row count exceeds capacity");
+    }
+    header->row_count = rows;
+}
+
+TraceReader::TraceReader(const std::string& path) : fd{-1}, base{nullptr}, map_size{0}, header{nullptr} {
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw trace_error("open failed", path);
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        throw trace_error("stat failed", path);
+    }
+    map_size = st.st_size;
+    if (map_size < sizeof(TraceHeader)) {
+        close(fd);
+        throw std::runtime_error(path + " is too small to be a trace");
+    }
+    void* p = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        throw trace_error("mmap failed", path);
+    }
+    base   = static_cast<const char*>(p);
+    header = reinterpret_cast<const TraceHeader*>(base);
+    descs  = reinterpret_cast<const TraceColumnDesc*>(base + sizeof(TraceHeader));
+
+    std::string problem;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC))) {
+        problem = "bad magic";
+    } else if (header->version != TRACE_VERSION) {
+        problem = "unsupported version " + std::to_string(header->version);
+    } else if (header->row_count > header->row_capacity ||
+               header->data_offset + header->column_count * align64(header->row_capacity * 8) > map_size) {
+        problem = "truncated file";
+    }
+    if (!problem.empty()) {
+        munmap(p, map_size);
+        close(fd);
+        throw std::runtime_error(path + " is not a valid trace: " + problem);
+    }
+}
+
+TraceReader::~TraceReader() {
+    munmap(const_cast<char*>(base), map_size);
+    close(fd);
+}
+
+std::string TraceReader::column_name(size_t col) const {
+    const char* name = descs[col].name;
+    return std::string(name, strnlen(name, sizeof(descs[col].name)));
+}
+
+ssize_t TraceReader::find_column(const std::string& name) const {
+    for (size_t i = 0; i < column_count(); i++) {
+        if (column_name(i) == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const uint64_t* TraceReader::u64_column(size_t col) const {
+    return reinterpret_cast<const uint64_t*>(base + header->data_offset + col * align64(header->row_capacity * 8));
+}
+
+const double* TraceReader::f64_column(size_t col) const {
+    return reinterpret_cast<const double*>(u64_column(col));
+}
+
+void TraceReader::print_cell(CsvEmitter& out, size_t col, size_t row) const {
+    switch (column_format(col)) {
+    case TRACE_UINT:
+        out.put_uint(u64_column(col)[row]);
+        break;
+    case TRACE_FIXED3:
+        out.put_fixed3(f64_column(col)[row]);
+        break;
+    case TRACE_VALUE:
+        out.put_value(f64_column(col)[row]);
+        break;
+    default:
+        throw std::runtime_error("unknown column format " + std::to_string(column_format(col)));
+    }
+}
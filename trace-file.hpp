@@ -0,0 +1,146 @@
+/*
+ * trace-file.hpp
+ *
+ * A binary, memory-mappable, columnar format for bench output.
+ *
+ * Layout (all values little-endian, every section 64-byte aligned):
+ *
+ *   TraceHeader
+ *   TraceColumnDesc[column_count]
+ *   column 0 data: row_capacity 8-byte cells
+ *   column 1 data: row_capacity 8-byte cells
+ *   ...
+ *
+ * Only the first row_count cells of each column are valid. Reserving row_capacity
+ * cells up front means the file can be written in place (through a shared mapping)
+ * while the test runs, even when the final row count isn't known in advance.
+ */
+
+#ifndef TRACE_FILE_H_
+#define TRACE_FILE_H_
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+class CsvEmitter;
+
+constexpr char     TRACE_MAGIC[8] = {'F', 'B', 'T', 'R', 'A', 'C', 'E', '\0'};
+constexpr uint32_t TRACE_VERSION  = 1;
+
+/** how the cells of a column are stored and how they are printed in CSV form */
+enum TraceFormat : uint32_t {
+    /** uint64_t, printed as an integer */
+    TRACE_UINT   = 0,
+    /** double, always printed with 3 decimal places */
+    TRACE_FIXED3 = 1,
+    /** double, printed as an integer if it has no fractional part, otherwise with 3 decimal places */
+    TRACE_VALUE  = 2,
+};
+
+struct TraceHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t column_count;
+    uint64_t row_count;
+    uint64_t row_capacity;
+    /** offset of the first column's data from the start of the file */
+    uint64_t data_offset;
+    double   tsc_freq;
+    uint32_t family, model, stepping;
+    uint32_t reserved;
+    char     brand[64];
+};
+
+struct TraceColumnDesc {
+    char     name[56];
+    uint32_t format;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(TraceHeader) % 64 == 0, "header must keep columns aligned");
+static_assert(sizeof(TraceColumnDesc) == 64, "column descriptor must be 64 bytes");
+
+/** the descriptive information stored in the header */
+struct TraceInfo {
+    double tsc_freq;
+    uint32_t family, model, stepping;
+    std::string brand;
+};
+
+struct TraceColumn {
+    std::string name;
+    TraceFormat format;
+};
+
+/**
+ * Writes a trace file through a shared mapping. Throws std::runtime_error if the file
+ * can't be created or mapped.
+ */
+class TraceWriter {
+    std::string path;
+    int fd;
+    char* base;
+    size_t map_size;
+    TraceHeader* header;
+    std::vector<uint64_t*> cols;
+
+public:
+    TraceWriter(const std::string& path, const std::vector<TraceColumn>& columns, size_t row_capacity,
+                const TraceInfo& info);
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    size_t row_capacity() const { return header->row_capacity; }
+
+    void set(size_t col, size_t row, uint64_t val) { cols[col][row] = val; }
+    void set(size_t col, size_t row, double val);
+
+    /** record the number of valid rows, may be called repeatedly as rows are added */
+    void set_row_count(size_t rows);
+
+    const std::string& get_path() const { return path; }
+};
+
+/**
+ * Read-only view of a trace file, mapped into memory. Throws std::runtime_error if
+ * the file can't be mapped or isn't a trace.
+ */
+class TraceReader {
+    int fd;
+    const char* base;
+    size_t map_size;
+    const TraceHeader* header;
+    const TraceColumnDesc* descs;
+
+public:
+    explicit TraceReader(const std::string& path);
+    ~TraceReader();
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    size_t row_count() const { return header->row_count; }
+    size_t column_count() const { return header->column_count; }
+    const TraceHeader& get_header() const { return *header; }
+
+    std::string column_name(size_t col) const;
+    TraceFormat column_format(size_t col) const { return (TraceFormat)descs[col].format; }
+
+    /** index of the column with the given name, or -1 */
+    ssize_t find_column(const std::string& name) const;
+
+    const uint64_t* u64_column(size_t col) const;
+    const double*   f64_column(size_t col) const;
+
+    /** output the given cell exactly as the CSV output of bench would */
+    void print_cell(CsvEmitter& out, size_t col, size_t row) const;
+};
+
+#endif // #ifndef TRACE_FILE_H_
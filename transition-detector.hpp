@@ -0,0 +1,132 @@
+/*
+ * transition-detector.hpp
+ *
+ * Online detection of frequency transitions in a stream of samples, each of which
+ * gives the TSC ticks and unhalted core cycles elapsed since the previous sample.
+ */
+
+#ifndef TRANSITION_DETECTOR_H_
+#define TRANSITION_DETECTOR_H_
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+/** one detected transition, times in TSC ticks and frequencies in GHz */
+struct Transition {
+    /* the TSC at the start of the first sample that deviated from the old frequency */
+    uint64_t start_tsc;
+    /*
+     * the time the core spent halted during the transition: the part of each sample's
+     * duration not covered by its unhalted cycles at the lower of the old and new
+     * frequencies, so a lower bound
+     */
+    double halt_tsc;
+    double old_ghz, new_ghz;
+    /* from start_tsc to the start of the first sample at the new, stable, frequency */
+    uint64_t settle_tsc;
+};
+
+/**
+ * Feed samples with add(): the detector learns the initial frequency from the first
+ * base_count samples, and then treats any sample whose unhalted frequency is more than
+ * thresh (relative) away from the current level as the start of a transition. The
+ * transition ends once settle_count consecutive samples agree with their mean to within
+ * thresh, which becomes the new level. Transitions that settle back at the old level
+ * (e.g., an interrupt) are not reported.
+ */
+class TransitionDetector {
+    /* samples slower than this are (mostly) halted, and a run of them is never a new level */
+    static constexpr double MIN_RUNNING_GHZ = 0.1;
+
+    struct Point {
+        uint64_t start, ticks;
+        double cycles;
+    };
+
+    double tsc_ghz, thresh;
+    size_t base_count, settle_count;
+
+    double level;
+    std::vector<double> base;
+    std::vector<Point> pending;  // the samples in the current transition, if any
+
+    double ghz(const Point& p) const { return p.cycles * tsc_ghz / p.ticks; }
+
+    bool near(double v, double ref) const { return std::fabs(v - ref) <= thresh * std::fabs(ref); }
+
+    /* if the last settle_count pending samples agree, finish the transition and return true */
+    bool try_settle(Transition& out) {
+        if (pending.size() < settle_count) {
+            return false;
+        }
+        auto first = pending.end() - settle_count;
+        double mean = 0;
+        for (auto p = first; p != pending.end(); ++p) {
+            mean += ghz(*p);
+        }
+        mean /= settle_count;
+        if (mean < MIN_RUNNING_GHZ) {
+            return false;
+        }
+        for (auto p = first; p != pending.end(); ++p) {
+            if (!near(ghz(*p), mean)) {
+                return false;
+            }
+        }
+
+        bool changed = !near(mean, level);
+        if (changed) {
+            double slow = std::min(level, mean);
+            double halt = 0;
+            for (auto p = pending.begin(); p != first; ++p) {
+                halt += std::max(0., p->ticks - p->cycles * tsc_ghz / slow);
+            }
+            out = {pending.front().start, halt, level, mean, first->start - pending.front().start};
+        }
+        level = mean;
+        pending.clear();
+        return changed;
+    }
+
+public:
+    TransitionDetector(double tsc_ghz, double thresh = 0.05, size_t base_count = 10, size_t settle_count = 5)
+        : tsc_ghz{tsc_ghz}, thresh{thresh}, base_count{base_count}, settle_count{settle_count}, level{NAN} {}
+
+    /**
+     * Add the sample ending at tsc, which covers tsc_delta TSC ticks during which cycles
+     * unhalted cycles elapsed. Returns true and fills in out if this sample completed a
+     * transition.
+     */
+    bool add(uint64_t tsc, uint64_t tsc_delta, double cycles, Transition& out) {
+        if (tsc_delta == 0 || std::isnan(cycles)) {
+            return false;
+        }
+        Point p{tsc - tsc_delta, tsc_delta, cycles};
+
+        if (std::isnan(level)) {
+            base.push_back(ghz(p));
+            if (base.size() == base_count) {
+                std::nth_element(base.begin(), base.begin() + base.size() / 2, base.end());
+                level = base[base.size() / 2];
+            }
+            return false;
+        }
+
+        if (pending.empty() && near(ghz(p), level)) {
+            return false;
+        }
+        pending.push_back(p);
+        return try_settle(out);
+    }
+
+    /** the frequency of the current stable level, NaN while still learning it */
+    double current_ghz() const { return level; }
+
+    /** true if a transition has started but not yet settled */
+    bool in_transition() const { return !pending.empty(); }
+};
+
+#endif // #ifndef TRANSITION_DETECTOR_H_
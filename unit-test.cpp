@@ -2,14 +2,384 @@
  * unit-test.cpp
  */
 
+#include "batch-kernels.hpp"
+#include "campaign.hpp"
+#include "csv-emitter.hpp"
+#include "impl-list.hpp"
+#include "latency-histogram.hpp"
 #include "misc.hpp"
+#include "payload-jit.hpp"
+#include "perf-timer.hpp"
+#include "quantile-sketch.hpp"
+#include "schedule.hpp"
+#include "spsc-ring.hpp"
+#include "trace-file.hpp"
+#include "transition-detector.hpp"
+#include "x86-encoder.hpp"
 
 #include "catch.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <random>
+
 TEST_CASE( "string_format", "[util]" ) {
     REQUIRE( string_format("foo %d", 42) == "foo 42" );
     REQUIRE( string_format("%s %s", "foo", "bar") == "foo bar" );
 }
 
+TEST_CASE( "spsc-ring", "[util]" ) {
+    SpscRing<int> ring(3);
+    REQUIRE( ring.capacity() == 4 );
+    int out = -1;
+    REQUIRE( !ring.try_pop(out) );
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 4; i++) {
+            REQUIRE( ring.try_push(round * 10 + i) );
+        }
+        REQUIRE( !ring.try_push(99) );
+        for (int i = 0; i < 4; i++) {
+            REQUIRE( ring.try_pop(out) );
+            REQUIRE( out == round * 10 + i );
+        }
+        REQUIRE( !ring.try_pop(out) );
+    }
+}
+
+TEST_CASE( "trace-file", "[trace]" ) {
+    std::string path = "unit-test-trace.tmp";
+    {
+        TraceWriter w(path, {{"repeat", TRACE_UINT}, {"us", TRACE_FIXED3}, {"val", TRACE_VALUE}}, 10,
+                {2000000000., 6, 85, 4, "test cpu"});
+        for (size_t r = 0; r < 3; r++) {
+            w.set(0, r, (uint64_t)r);
+            w.set(1, r, r * 1.5);
+            w.set(2, r, r == 2 ? 0.25 : r * 2.);
+            w.set_row_count(r + 1);
+        }
+    }
+    TraceReader r(path);
+    REQUIRE( r.row_count() == 3 );
+    REQUIRE( r.column_count() == 3 );
+    REQUIRE( r.column_name(1) == "us" );
+    REQUIRE( r.find_column("val") == 2 );
+    REQUIRE( r.find_column("nope") == -1 );
+    REQUIRE( r.get_header().model == 85 );
+    REQUIRE( std::string(r.get_header().brand) == "test cpu" );
+    REQUIRE( r.u64_column(0)[2] == 2 );
+    REQUIRE( r.f64_column(1)[1] == 1.5 );
+    remove(path.c_str());
+}
+
+TEST_CASE( "csv-emitter matches printf", "[output]" ) {
+    const double vals[] = {0., -0., 1., -1., 0.0005, 0.0015, 2.5, 1234.5675, -3.14159, 1e15 + 0.5, 1e19, 1e300,
+                           -1e-9, 123456789.123456, NAN, -NAN, INFINITY, -INFINITY};
+    std::string expected;
+    char* buf  = nullptr;
+    size_t len = 0;
+    FILE* mem  = open_memstream(&buf, &len);
+    {
+        CsvEmitter out(mem, 16); // tiny buffer exercises the flush path
+        for (double v : vals) {
+            char tmp[400];
+            snprintf(tmp, sizeof(tmp), "%.3f|", v);
+            expected += tmp;
+            out.put_fixed3(v);
+            out.put('|');
+            ssize_t iv = v;
+            if ((double)iv == v) {
+                snprintf(tmp, sizeof(tmp), "%zd|", iv);
+            } else {
+                snprintf(tmp, sizeof(tmp), "%.3f|", v);
+            }
+            expected += tmp;
+            out.put_value(v);
+            out.put('|');
+        }
+        out.put_uint(18446744073709551615ull);
+        out.put_int(-42);
+        expected += "18446744073709551615-42";
+    }
+    fclose(mem);
+    REQUIRE( std::string(buf, len) == expected );
+    free(buf);
+}
+
+TEST_CASE( "p-square sketch", "[aggregate]" ) {
+    PSquareSpec<3> spec{{0.1, 0.5, 0.9}};
+
+    SECTION( "exact while small" ) {
+        PSquareSketch<3> sk;
+        for (double v : {5., 1., 3.}) {
+            sk.add(spec, v);
+        }
+        REQUIRE( sk.min() == 1. );
+        REQUIRE( sk.max() == 5. );
+        REQUIRE( sk.quantile(spec, 1) == 3. );
+    }
+
+    SECTION( "approximate when large" ) {
+        std::vector<double> vals;
+        for (int i = 1; i <= 10000; i++) {
+            vals.push_back(i);
+        }
+        std::shuffle(vals.begin(), vals.end(), std::mt19937(1));
+        PSquareSketch<3> sk;
+        for (double v : vals) {
+            sk.add(spec, v);
+        }
+        REQUIRE( sk.size() == 10000 );
+        REQUIRE( sk.min() == 1. );
+        REQUIRE( sk.max() == 10000. );
+        REQUIRE( sk.quantile(spec, 0) == Approx(1000).epsilon(0.02) );
+        REQUIRE( sk.quantile(spec, 1) == Approx(5000).epsilon(0.02) );
+        REQUIRE( sk.quantile(spec, 2) == Approx(9000).epsilon(0.02) );
+    }
+}
+
+TEST_CASE( "transition detector", "[transitions]" ) {
+    // a 2 GHz TSC and 1 us samples
+    TransitionDetector det(2.0);
+    Transition t;
+    uint64_t tsc = 1000000;
+    auto feed = [&](double ghz, int count) {
+        int found = 0;
+        for (int i = 0; i < count; i++) {
+            tsc += 2000;
+            found += det.add(tsc, 2000, ghz * 1000, t);
+        }
+        return found;
+    };
+
+    REQUIRE( feed(3.0, 20) == 0 );
+    REQUIRE( det.current_ghz() == Approx(3.0) );
+
+    SECTION( "halt then new frequency" ) {
+        uint64_t start = tsc;
+        REQUIRE( feed(0., 10) == 0 );
+        REQUIRE( det.in_transition() );
+        REQUIRE( feed(2.0, 5) == 1 );
+        REQUIRE( t.start_tsc == start );
+        REQUIRE( t.halt_tsc == Approx(20000) );
+        REQUIRE( t.old_ghz == Approx(3.0) );
+        REQUIRE( t.new_ghz == Approx(2.0) );
+        REQUIRE( t.settle_tsc == 20000 );
+        REQUIRE( !det.in_transition() );
+    }
+
+    SECTION( "blips are not transitions" ) {
+        REQUIRE( feed(0., 1) == 0 );
+        REQUIRE( feed(3.0, 10) == 0 );
+        REQUIRE( !det.in_transition() );
+        REQUIRE( det.current_ghz() == Approx(3.0) );
+    }
+}
+
+TEST_CASE( "schedule parsing", "[schedule]" ) {
+    // a 1 GHz TSC, so 1 us == 1000 cycles
+    auto s = parse_schedule("vporzmm_vz100 20us, dummy 500us  # idle\nvporymm_vz100 100cyc x2\nloop 50\n", 1e9);
+    REQUIRE( s.phases.size() == 4 );
+    REQUIRE( s.phases[0].test == get_by_name("vporzmm_vz100") );
+    REQUIRE( s.phases[0].cycles == 20000 );
+    REQUIRE( s.phases[1].cycles == 500000 );
+    REQUIRE( s.phases[3].test == get_by_name("vporymm_vz100") );
+    REQUIRE( s.phases[3].cycles == 100 );
+    REQUIRE( s.loop_count == 50 );
+    REQUIRE( s.loop_cycles() == 520200 );
+
+    PhaseCursor cursor(s, 1000);
+    REQUIRE( cursor.at(1000) == s.phases[0].test );
+    REQUIRE( cursor.at(21000) == s.phases[1].test );
+    REQUIRE( cursor.index() == 1 );
+    REQUIRE( cursor.at(1000 + 520200 + 5) == s.phases[0].test );
+
+    REQUIRE_THROWS( parse_schedule("dummy 20", 1e9) );
+    REQUIRE_THROWS( parse_schedule("nosuchtest 20us", 1e9) );
+    REQUIRE_THROWS( parse_schedule("dummy 20us x0", 1e9) );
+    REQUIRE_THROWS( parse_schedule("loop 5", 1e9) );
+}
+
+TEST_CASE( "campaign manifest", "[campaign]" ) {
+    // a 1 GHz TSC, so 1 us == 1000 cycles
+    auto cells = parse_campaign("# comment\na vporxmm TEST_RES=5us TEST_EXTRA=300\n\nb *_tput_vz100 COLS=Cycles,IPC  # c\n", 1e9);
+    REQUIRE( cells.size() == 2 );
+    REQUIRE( cells[0].name == "a" );
+    REQUIRE( cells[0].tests == "vporxmm" );
+    REQUIRE( cells[0].resolution_cycles == 5000 );
+    REQUIRE( cells[0].payload_extra_cycles == 300 );
+    REQUIRE( cells[0].test_cycles == -1 );
+    REQUIRE( cells[0].cols == "" );
+    REQUIRE( cells[1].tests == "*_tput_vz100" );
+    REQUIRE( cells[1].cols == "Cycles,IPC" );
+
+    REQUIRE_THROWS( parse_campaign("", 1e9) );
+    REQUIRE_THROWS( parse_campaign("a", 1e9) );
+    REQUIRE_THROWS( parse_campaign("a dummy\na vporxmm", 1e9) );
+    REQUIRE_THROWS( parse_campaign("../a dummy", 1e9) );
+    REQUIRE_THROWS( parse_campaign("a dummy TEST_RES=5parsecs", 1e9) );
+    REQUIRE_THROWS( parse_campaign("a dummy FOO=1", 1e9) );
+}
+
+TEST_CASE( "latency histogram", "[lathist]" ) {
+    using H = LogLinearHistogram<4>;
+    // buckets are contiguous and each value lands in the bucket whose range holds it
+    for (uint64_t v : {0ull, 1ull, 15ull, 16ull, 17ull, 31ull, 32ull, 1000ull, 123456789ull, ~0ull}) {
+        size_t idx = H::index(v);
+        REQUIRE( H::bucket_low(idx) <= v );
+        REQUIRE( v <= H::bucket_high(idx) );
+    }
+    for (size_t i = 0; i + 1 < H::BUCKETS; i++) {
+        REQUIRE( H::bucket_high(i) + 1 == H::bucket_low(i + 1) );
+    }
+    REQUIRE( H::index(~0ull) == H::BUCKETS - 1 );
 
+    LatencyHistogram h;
+    REQUIRE( h.value_at_percentile(50) == 0 );
+    for (int i = 1; i <= 1000; i++) {
+        h.record(i);
+    }
+    h.record(1000000);
+    REQUIRE( h.count() == 1001 );
+    REQUIRE( h.value_at_percentile(50) == Approx(500).epsilon(0.04) );
+    REQUIRE( h.value_at_percentile(100) == Approx(1000000).epsilon(0.04) );
+}
 
+TEST_CASE( "batch kernels match scalar", "[batch]" ) {
+    std::mt19937_64 rng(7);
+    std::vector<uint64_t> in(103);
+    uint64_t v = 1ull << 40;
+    for (auto& x : in) {
+        // mostly small steps, with the odd wrap and huge jump thrown in
+        uint64_t r = rng();
+        v += r % 17 == 0 ? -(r % 1000) : r % 31 == 0 ? r : r % 100000;
+        x = v;
+    }
+    for (uint64_t sub : {0ull, 50ull, 50000ull}) {
+        std::vector<double> out(in.size() - 1);
+        batch_delta(in.data(), in.size(), sub, out.data());
+        for (size_t i = 0; i + 1 < in.size(); i++) {
+            uint64_t d = in[i + 1] - in[i];
+            REQUIRE( out[i] == (double)(d > sub ? d - sub : 0) );
+        }
+    }
+
+    std::vector<double> a(11), b(11), out(11);
+    for (size_t i = 0; i < a.size(); i++) {
+        a[i] = rng() % 1000000 / 7.;
+        b[i] = rng() % 1000 + 1;
+    }
+    batch_divide(a.data(), b.data(), a.size(), out.data());
+    for (size_t i = 0; i < a.size(); i++) {
+        REQUIRE( out[i] == a[i] / b[i] );
+    }
+    batch_mul_div(a.data(), a.size(), 1e9, 2.1e9, out.data());
+    for (size_t i = 0; i < a.size(); i++) {
+        REQUIRE( out[i] == a[i] * 1e9 / 2.1e9 );
+    }
+}
+
+TEST_CASE( "multiplex scale factor", "[perf]" ) {
+    REQUIRE( scale_factor(0, 0) == 1 );             // not multiplexed
+    REQUIRE( scale_factor(1000, 1000) == 1 );
+    REQUIRE( scale_factor(1000, 250) == 4 );
+    REQUIRE( scale_factor(1000, 1001) == 1 );       // clock skew between the two times
+    REQUIRE( std::isnan(scale_factor(1000, 0)) );   // never on the PMU
+}
+
+TEST_CASE( "rdpmc count", "[perf]" ) {
+    // the kernel starts the counter at -prev_count, so the 48-bit raw value is sign extended
+    REQUIRE( rdpmc_count(1000, 5, 48) == 1005 );
+    REQUIRE( rdpmc_count(1000, (1ull << 48) - 5, 48) == 995 );
+    // past 2^48 the count keeps going rather than wrapping
+    REQUIRE( rdpmc_count(1ull << 48, 7, 48) == (1ull << 48) + 7 );
+    REQUIRE( rdpmc_count(1ull << 48, 7, 48) - rdpmc_count((1ull << 48) - 3, 1, 48) == 9 );
+}
+
+static std::vector<uint8_t> encode(const std::string& text) {
+    std::vector<uint8_t> out;
+    encode_instruction(text, out);
+    return out;
+}
+
+TEST_CASE( "x86 encoder", "[jit]" ) {
+    using v = std::vector<uint8_t>;
+    // expected bytes from GNU as
+    REQUIRE( encode("vpor ymm0, ymm0, ymm1")       == v{0xc5, 0xfd, 0xeb, 0xc1} );
+    REQUIRE( encode("vpor ymm8, ymm1, ymm2")       == v{0xc5, 0x75, 0xeb, 0xc2} );
+    REQUIRE( encode("vpor ymm3, ymm9, ymm12")      == v{0xc4, 0xc1, 0x35, 0xeb, 0xdc} );
+    REQUIRE( encode("VPORD zmm0,zmm0,zmm1")        == v{0x62, 0xf1, 0x7d, 0x48, 0xeb, 0xc1} );
+    REQUIRE( encode("vporq zmm31, zmm16, zmm7")    == v{0x62, 0x61, 0xfd, 0x40, 0xeb, 0xff} );
+    REQUIRE( encode("vpermilps ymm2, ymm3, 0x1b")  == v{0xc4, 0xe3, 0x7d, 0x04, 0xd3, 0x1b} );
+    REQUIRE( encode("vfmadd231pd zmm0, zmm1, zmm2")== v{0x62, 0xf2, 0xf5, 0x48, 0xb8, 0xc2} );
+    REQUIRE( encode("vmovq r10, xmm11")            == v{0xc4, 0x41, 0xf9, 0x7e, 0xda} );
+    REQUIRE( encode("por xmm8, xmm15")             == v{0x66, 0x45, 0x0f, 0xeb, 0xc7} );
+    REQUIRE( encode("imul r9, r10, 1000")          == v{0x4d, 0x69, 0xca, 0xe8, 0x03, 0x00, 0x00} );
+    REQUIRE( encode("mov rax, 0x123456789")        == v{0x48, 0xb8, 0x89, 0x67, 0x45, 0x23, 0x01, 0x00, 0x00, 0x00} );
+    REQUIRE( encode("vzeroupper")                  == v{0xc5, 0xf8, 0x77} );
+
+    v out;
+    REQUIRE( encode_instruction("vpaddd ymm1, ymm2, ymm3", out)  == NONE );
+    REQUIRE( encode_instruction("vpaddd ymm1, ymm2, ymm17", out) == (AVX512F | AVX512VL) );
+    REQUIRE( encode_instruction("vpaddd zmm1, zmm2, zmm3", out)  == AVX512F );
+    REQUIRE( encode_instruction("vpshufb zmm1, zmm2, zmm3", out) == (AVX512F | AVX512BW) );
+    REQUIRE( encode_instruction("vpshufb ymm1, ymm2, ymm3", out) == NONE );
+    REQUIRE( encode_instruction("vxorps xmm1, xmm2, xmm30", out) == (AVX512F | AVX512DQ | AVX512VL) );
+
+    REQUIRE_THROWS( encode("vpor zmm0, zmm0, zmm0") );
+    REQUIRE_THROWS( encode("vpermd xmm0, xmm0, xmm0") );
+    REQUIRE_THROWS( encode("vpaddd ymm0, xmm0, ymm0") );
+    REQUIRE_THROWS( encode("add rbx, 1") );
+    REQUIRE_THROWS( encode("frobnicate eax") );
+}
+
+TEST_CASE( "payload spec", "[jit]" ) {
+    auto p = assemble_payload("rep 3 { vpor ymm0, ymm0, ymm1; rep 2 { nop } }\n# a comment\nvzeroupper");
+    REQUIRE( p.instructions == 10 );
+    REQUIRE( p.code.size() == 3 * (4 + 2) + 3 );
+    REQUIRE( p.isa == NONE );
+    REQUIRE( assemble_payload("rep 2 {vpord zmm0, zmm0, zmm1}").isa == AVX512F );
+    REQUIRE( assemble_payload("vpord zmm0, zmm0, zmm1; vpaddb zmm2, zmm2, zmm3").isa == (AVX512F | AVX512BW) );
+
+    REQUIRE_THROWS( assemble_payload("rep 2 { nop") );
+    REQUIRE_THROWS( assemble_payload("nop }") );
+    REQUIRE_THROWS( assemble_payload("rep x { nop }") );
+    REQUIRE_THROWS( assemble_payload("rep 100000000 { vpord zmm0, zmm0, zmm1 }") );
+
+    JitPayload jit("rep 4 { add eax, 1 }; vzeroupper");
+    jit.function()(bench_args{});
+}
+
+TEST_CASE( "generated kernels", "[kernels]" ) {
+    auto lat = get_by_name("vpaddd_ymm_100_lat");
+    REQUIRE( lat );
+    REQUIRE( lat->desc == std::string("100x vpaddd as one dependency chain") );
+    REQUIRE( get_by_name("vpord_zmm_1000_tput") );
+    REQUIRE( !get_by_name("vpord_ymm_1000_tput") );
+
+    lat->call_f(bench_args{});
+    get_by_name("vfmadd231ps_xmm_100_tput")->call_f(bench_args{});
+}
+
+TEST_CASE( "test selection", "[registry]" ) {
+    auto names = [](const std::vector<test_description>& tests) {
+        std::vector<std::string> ret;
+        for (auto& t : tests) {
+            ret.push_back(t.name);
+        }
+        return ret;
+    };
+    using strings = std::vector<std::string>;
+
+    REQUIRE( names(get_by_list("vporxmm,vporymm")) == strings{"vporxmm", "vporymm"} );
+    REQUIRE( names(get_by_list("vpaddd_*_100_lat")) == strings{"vpaddd_xmm_100_lat", "vpaddd_ymm_100_lat", "vpaddd_zmm_100_lat"} );
+    // duplicates are dropped
+    REQUIRE( names(get_by_list("mem_load_xmm,@mem,mem_*")).size() == get_by_list("@mem").size() );
+    REQUIRE( get_by_list("@lic").size() == 24 );
+    REQUIRE_THROWS( get_by_list("vporxmm,nope") );
+    REQUIRE_THROWS( get_by_list("*nope*") );
+    REQUIRE_THROWS( get_by_list("@nope") );
+
+    auto tags = get_tags(*get_by_name("vpshufb_zmm_100_tput"));
+    REQUIRE( tags == strings{"vpshufb", "zmm", "tput", "kernel", "avx512bw"} );
+    REQUIRE( !missing_isa(*get_by_name("vporxmm")) );
+}
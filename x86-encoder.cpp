@@ -0,0 +1,562 @@
+/*
+ * x86-encoder.cpp
+ */
+
+#include "x86-encoder.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+namespace {
+
+enum RegKind { GPR32, GPR64, XMM, YMM, ZMM };
+
+struct Operand {
+    bool is_reg;
+    RegKind kind;
+    unsigned num;
+    int64_t imm;
+
+    bool is_vec() const { return is_reg && kind >= XMM; }
+    bool is_gpr() const { return is_reg && kind <= GPR64; }
+};
+
+std::runtime_error encode_error(const std::string& text, const std::string& problem) {
+    return std::runtime_error("can't encode '" + text + "': " + problem);
+}
+
+const char* const GPR32_NAMES[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                                   "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+const char* const GPR64_NAMES[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                   "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+
+/* rbx, rbp and r12-r15 must be preserved by a called function, and rsp is the stack */
+const bool CALLEE_SAVED[16] = {0, 0, 0, 1, 1, 1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1};
+
+Operand parse_operand(const std::string& text, const std::string& tok) {
+    for (unsigned i = 0; i < 16; i++) {
+        if (tok == GPR32_NAMES[i] || tok == GPR64_NAMES[i]) {
+            if (CALLEE_SAVED[i]) {
+                throw encode_error(text, tok + " is callee-saved or the stack pointer, use rax, rcx, rdx, rsi, rdi or r8-r11");
+            }
+            return {true, tok == GPR32_NAMES[i] ? GPR32 : GPR64, i, 0};
+        }
+    }
+    if (tok.size() > 3 && (tok.compare(0, 3, "xmm") == 0 || tok.compare(0, 3, "ymm") == 0 || tok.compare(0, 3, "zmm") == 0)) {
+        RegKind kind = tok[0] == 'x' ? XMM : tok[0] == 'y' ? YMM : ZMM;
+        size_t pos = 0;
+        unsigned long num = 32;
+        try {
+            num = std::stoul(tok.substr(3), &pos);
+        } catch (std::exception&) {
+        }
+        if (num >= 32 || pos != tok.size() - 3) {
+            throw encode_error(text, "bad register " + tok);
+        }
+        return {true, kind, (unsigned)num, 0};
+    }
+    size_t pos = 0;
+    long long imm = 0;
+    try {
+        imm = std::stoll(tok, &pos, 0);
+    } catch (std::exception&) {
+        pos = 0;
+    }
+    if (tok.empty() || pos != tok.size()) {
+        throw encode_error(text, "bad operand '" + tok + "'");
+    }
+    return {false, GPR32, 0, imm};
+}
+
+enum Map : uint8_t { MAP_0F = 1, MAP_0F38 = 2, MAP_0F3A = 3 };
+enum Prefix : uint8_t { PP_NONE = 0, PP_66 = 1, PP_F3 = 2, PP_F2 = 3 };
+
+enum VecEnc : uint8_t {
+    /** legacy SSE, xmm0-15 only */
+    SSE,
+    /** AVX/AVX2, with no AVX-512 form under this name (e.g., vpor, whose AVX-512 forms are vpord and vporq) */
+    VEX_ONLY,
+    /** AVX-512 only */
+    EVEX_ONLY,
+    /** VEX, or EVEX when a zmm register or one of registers 16-31 is used */
+    VEX_EVEX,
+};
+
+enum VecForm : uint8_t {
+    /** dst, src1, src2 */
+    RVM,
+    /** dst, src (for SSE, the usual dst, src with dst also a source) */
+    RM,
+    /** dst, src, imm8 */
+    RMI,
+    /** dst, src1, src2, imm8 */
+    RVMI,
+};
+
+struct VecOp {
+    const char* name;
+    VecEnc enc;
+    VecForm form;
+    uint8_t pp, map, opcode;
+    uint8_t vex_w, evex_w;
+    /* only the ymm and zmm forms exist (e.g., vpermd) */
+    bool no_xmm;
+    /* the extension the EVEX form needs besides AVX-512F, e.g., AVX512BW for byte and word ops */
+    AlgoFlags evex_isa = NONE;
+};
+
+const VecOp VEC_OPS[] = {
+    {"por",         SSE,       RM,   PP_66,   MAP_0F,   0xEB, 0, 0, false},
+    {"pand",        SSE,       RM,   PP_66,   MAP_0F,   0xDB, 0, 0, false},
+    {"pxor",        SSE,       RM,   PP_66,   MAP_0F,   0xEF, 0, 0, false},
+    {"paddd",       SSE,       RM,   PP_66,   MAP_0F,   0xFE, 0, 0, false},
+    {"paddq",       SSE,       RM,   PP_66,   MAP_0F,   0xD4, 0, 0, false},
+    {"psubd",       SSE,       RM,   PP_66,   MAP_0F,   0xFA, 0, 0, false},
+    {"pmulld",      SSE,       RM,   PP_66,   MAP_0F38, 0x40, 0, 0, false},
+    {"pmuludq",     SSE,       RM,   PP_66,   MAP_0F,   0xF4, 0, 0, false},
+    {"pmaddwd",     SSE,       RM,   PP_66,   MAP_0F,   0xF5, 0, 0, false},
+    {"pshufb",      SSE,       RM,   PP_66,   MAP_0F38, 0x00, 0, 0, false},
+    {"pshufd",      SSE,       RMI,  PP_66,   MAP_0F,   0x70, 0, 0, false},
+    {"movdqa",      SSE,       RM,   PP_66,   MAP_0F,   0x6F, 0, 0, false},
+    {"addps",       SSE,       RM,   PP_NONE, MAP_0F,   0x58, 0, 0, false},
+    {"addpd",       SSE,       RM,   PP_66,   MAP_0F,   0x58, 0, 0, false},
+    {"mulps",       SSE,       RM,   PP_NONE, MAP_0F,   0x59, 0, 0, false},
+    {"mulpd",       SSE,       RM,   PP_66,   MAP_0F,   0x59, 0, 0, false},
+    {"subps",       SSE,       RM,   PP_NONE, MAP_0F,   0x5C, 0, 0, false},
+    {"divps",       SSE,       RM,   PP_NONE, MAP_0F,   0x5E, 0, 0, false},
+    {"sqrtps",      SSE,       RM,   PP_NONE, MAP_0F,   0x51, 0, 0, false},
+    {"andps",       SSE,       RM,   PP_NONE, MAP_0F,   0x54, 0, 0, false},
+    {"xorps",       SSE,       RM,   PP_NONE, MAP_0F,   0x57, 0, 0, false},
+    {"movaps",      SSE,       RM,   PP_NONE, MAP_0F,   0x28, 0, 0, false},
+    {"shufps",      SSE,       RMI,  PP_NONE, MAP_0F,   0xC6, 0, 0, false},
+
+    {"vpor",        VEX_ONLY,  RVM,  PP_66,   MAP_0F,   0xEB, 0, 0, false},
+    {"vpand",       VEX_ONLY,  RVM,  PP_66,   MAP_0F,   0xDB, 0, 0, false},
+    {"vpxor",       VEX_ONLY,  RVM,  PP_66,   MAP_0F,   0xEF, 0, 0, false},
+    {"vmovdqa",     VEX_ONLY,  RM,   PP_66,   MAP_0F,   0x6F, 0, 0, false},
+
+    {"vpord",       EVEX_ONLY, RVM,  PP_66,   MAP_0F,   0xEB, 0, 0, false},
+    {"vporq",       EVEX_ONLY, RVM,  PP_66,   MAP_0F,   0xEB, 0, 1, false},
+    {"vpandd",      EVEX_ONLY, RVM,  PP_66,   MAP_0F,   0xDB, 0, 0, false},
+    {"vpandq",      EVEX_ONLY, RVM,  PP_66,   MAP_0F,   0xDB, 0, 1, false},
+    {"vpxord",      EVEX_ONLY, RVM,  PP_66,   MAP_0F,   0xEF, 0, 0, false},
+    {"vpxorq",      EVEX_ONLY, RVM,  PP_66,   MAP_0F,   0xEF, 0, 1, false},
+    {"vpmullq",     EVEX_ONLY, RVM,  PP_66,   MAP_0F38, 0x40, 0, 1, false, AVX512DQ},
+    {"vpternlogd",  EVEX_ONLY, RVMI, PP_66,   MAP_0F3A, 0x25, 0, 0, false},
+    {"vpternlogq",  EVEX_ONLY, RVMI, PP_66,   MAP_0F3A, 0x25, 0, 1, false},
+    {"vmovdqa32",   EVEX_ONLY, RM,   PP_66,   MAP_0F,   0x6F, 0, 0, false},
+    {"vmovdqa64",   EVEX_ONLY, RM,   PP_66,   MAP_0F,   0x6F, 0, 1, false},
+
+    {"vpaddb",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0xFC, 0, 0, false, AVX512BW},
+    {"vpaddw",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0xFD, 0, 0, false, AVX512BW},
+    {"vpaddd",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0xFE, 0, 0, false},
+    {"vpaddq",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0xD4, 0, 1, false},
+    {"vpsubd",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0xFA, 0, 0, false},
+    {"vpsubq",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0xFB, 0, 1, false},
+    {"vpmulld",     VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0x40, 0, 0, false},
+    {"vpmuludq",    VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0xF4, 0, 1, false},
+    {"vpmaddwd",    VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0xF5, 0, 0, false, AVX512BW},
+    {"vpmaddubsw",  VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0x04, 0, 0, false, AVX512BW},
+    {"vpsadbw",     VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0xF6, 0, 0, false, AVX512BW},
+    {"vpshufb",     VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0x00, 0, 0, false, AVX512BW},
+    {"vpshufd",     VEX_EVEX,  RMI,  PP_66,   MAP_0F,   0x70, 0, 0, false},
+    {"vaddps",      VEX_EVEX,  RVM,  PP_NONE, MAP_0F,   0x58, 0, 0, false},
+    {"vaddpd",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0x58, 0, 1, false},
+    {"vmulps",      VEX_EVEX,  RVM,  PP_NONE, MAP_0F,   0x59, 0, 0, false},
+    {"vmulpd",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0x59, 0, 1, false},
+    {"vsubps",      VEX_EVEX,  RVM,  PP_NONE, MAP_0F,   0x5C, 0, 0, false},
+    {"vsubpd",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0x5C, 0, 1, false},
+    {"vdivps",      VEX_EVEX,  RVM,  PP_NONE, MAP_0F,   0x5E, 0, 0, false},
+    {"vdivpd",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0x5E, 0, 1, false},
+    {"vminps",      VEX_EVEX,  RVM,  PP_NONE, MAP_0F,   0x5D, 0, 0, false},
+    {"vmaxps",      VEX_EVEX,  RVM,  PP_NONE, MAP_0F,   0x5F, 0, 0, false},
+    {"vsqrtps",     VEX_EVEX,  RM,   PP_NONE, MAP_0F,   0x51, 0, 0, false},
+    {"vsqrtpd",     VEX_EVEX,  RM,   PP_66,   MAP_0F,   0x51, 0, 1, false},
+    {"vandps",      VEX_EVEX,  RVM,  PP_NONE, MAP_0F,   0x54, 0, 0, false, AVX512DQ},
+    {"vandpd",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0x54, 0, 1, false, AVX512DQ},
+    {"vxorps",      VEX_EVEX,  RVM,  PP_NONE, MAP_0F,   0x57, 0, 0, false, AVX512DQ},
+    {"vxorpd",      VEX_EVEX,  RVM,  PP_66,   MAP_0F,   0x57, 0, 1, false, AVX512DQ},
+    {"vshufps",     VEX_EVEX,  RVMI, PP_NONE, MAP_0F,   0xC6, 0, 0, false},
+    {"vmovaps",     VEX_EVEX,  RM,   PP_NONE, MAP_0F,   0x28, 0, 0, false},
+    {"vmovapd",     VEX_EVEX,  RM,   PP_66,   MAP_0F,   0x28, 0, 1, false},
+    {"vcvtdq2ps",   VEX_EVEX,  RM,   PP_NONE, MAP_0F,   0x5B, 0, 0, false},
+    {"vcvtps2dq",   VEX_EVEX,  RM,   PP_66,   MAP_0F,   0x5B, 0, 0, false},
+    {"vfmadd132ps", VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0x98, 0, 0, false},
+    {"vfmadd213ps", VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0xA8, 0, 0, false},
+    {"vfmadd231ps", VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0xB8, 0, 0, false},
+    {"vfmadd132pd", VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0x98, 1, 1, false},
+    {"vfmadd213pd", VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0xA8, 1, 1, false},
+    {"vfmadd231pd", VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0xB8, 1, 1, false},
+    {"vpermilps",   VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0x0C, 0, 0, false},
+    {"vpermilps",   VEX_EVEX,  RMI,  PP_66,   MAP_0F3A, 0x04, 0, 0, false},
+    {"vpermilpd",   VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0x0D, 0, 1, false},
+    {"vpermilpd",   VEX_EVEX,  RMI,  PP_66,   MAP_0F3A, 0x05, 0, 1, false},
+    {"vpermd",      VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0x36, 0, 0, true },
+    {"vpermps",     VEX_EVEX,  RVM,  PP_66,   MAP_0F38, 0x16, 0, 0, true },
+    {"vpermq",      VEX_EVEX,  RMI,  PP_66,   MAP_0F3A, 0x00, 1, 1, true },
+    {"vpermpd",     VEX_EVEX,  RMI,  PP_66,   MAP_0F3A, 0x01, 1, 1, true },
+};
+
+void emit_modrm(std::vector<uint8_t>& out, unsigned reg, unsigned rm) {
+    out.push_back(0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* a REX prefix, if one is needed */
+void emit_rex(std::vector<uint8_t>& out, bool w, unsigned reg, unsigned rm) {
+    uint8_t rex = 0x40 | w << 3 | (reg & 8) >> 1 | (rm & 8) >> 3;
+    if (rex != 0x40) {
+        out.push_back(rex);
+    }
+}
+
+/* in the VEX and EVEX prefixes the register extension bits and vvvv are stored inverted */
+void emit_vex(std::vector<uint8_t>& out, unsigned map, unsigned pp, unsigned w, unsigned l,
+        unsigned reg, unsigned vvvv, unsigned rm) {
+    if (map == MAP_0F && w == 0 && rm < 8) {
+        out.push_back(0xC5);
+        out.push_back((~reg & 8) << 4 | (~vvvv & 15) << 3 | l << 2 | pp);
+    } else {
+        out.push_back(0xC4);
+        out.push_back((~reg & 8) << 4 | 0x40 | (~rm & 8) << 2 | map);
+        out.push_back(w << 7 | (~vvvv & 15) << 3 | l << 2 | pp);
+    }
+}
+
+/* EVEX with no masking, broadcast or rounding; a register rm uses X as its 5th bit */
+void emit_evex(std::vector<uint8_t>& out, unsigned map, unsigned pp, unsigned w, unsigned ll,
+        unsigned reg, unsigned vvvv, unsigned rm) {
+    out.push_back(0x62);
+    out.push_back((~reg & 8) << 4 | (~rm & 16) << 2 | (~rm & 8) << 2 | (~reg & 16) | map);
+    out.push_back(w << 7 | (~vvvv & 15) << 3 | 0x04 | pp);
+    out.push_back(ll << 5 | (~vvvv & 16) >> 1);
+}
+
+void emit_imm8(const std::string& text, std::vector<uint8_t>& out, int64_t imm) {
+    if (imm < -128 || imm > 255) {
+        throw encode_error(text, "immediate must fit in 8 bits");
+    }
+    out.push_back(imm);
+}
+
+void emit_imm32(std::vector<uint8_t>& out, int64_t imm) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back(imm >> (8 * i));
+    }
+}
+
+AlgoFlags encode_vec(const std::string& text, const std::string& mnem, const std::vector<Operand>& ops,
+        std::vector<uint8_t>& out) {
+    size_t nregs = 0;
+    while (nregs < ops.size() && ops[nregs].is_reg) {
+        nregs++;
+    }
+    bool has_imm = nregs + 1 == ops.size();
+    if (nregs + has_imm != ops.size()) {
+        throw encode_error(text, "immediates must come last");
+    }
+
+    const VecOp* op = nullptr;
+    for (auto& candidate : VEC_OPS) {
+        if (mnem != candidate.name) {
+            continue;
+        }
+        op = &candidate;
+        unsigned want_regs = candidate.form == RVM || candidate.form == RVMI ? 3 : 2;
+        bool want_imm = candidate.form == RMI || candidate.form == RVMI;
+        if (nregs == want_regs && has_imm == want_imm) {
+            break;
+        }
+        op = nullptr;
+    }
+    if (!op) {
+        throw encode_error(text, "wrong number or kind of operands for " + mnem);
+    }
+
+    RegKind kind = ops[0].kind;
+    bool high = false;
+    for (size_t i = 0; i < nregs; i++) {
+        if (!ops[i].is_vec() || ops[i].kind != kind) {
+            throw encode_error(text, "operands must all be xmm, all ymm or all zmm registers");
+        }
+        high |= ops[i].num >= 16;
+    }
+    if (op->no_xmm && kind == XMM) {
+        throw encode_error(text, mnem + " has no xmm form");
+    }
+
+    unsigned reg = ops[0].num, vvvv = 0, rm;
+    if (op->form == RVM || op->form == RVMI) {
+        vvvv = ops[1].num;
+        rm   = ops[2].num;
+    } else {
+        rm   = ops[1].num;
+    }
+
+    bool evex = op->enc == EVEX_ONLY || (op->enc == VEX_EVEX && (kind == ZMM || high));
+    if (op->enc == SSE) {
+        if (kind != XMM || high) {
+            throw encode_error(text, "SSE instructions only take xmm0-xmm15");
+        }
+        static const uint8_t PREFIX_BYTE[] = {0, 0x66, 0xF3, 0xF2};
+        if (op->pp != PP_NONE) {
+            out.push_back(PREFIX_BYTE[op->pp]);
+        }
+        emit_rex(out, false, reg, rm);
+        out.push_back(0x0F);
+        if (op->map == MAP_0F38) {
+            out.push_back(0x38);
+        } else if (op->map == MAP_0F3A) {
+            out.push_back(0x3A);
+        }
+    } else if (evex) {
+        emit_evex(out, op->map, op->pp, op->evex_w, kind - XMM, reg, vvvv, rm);
+    } else {
+        if (kind == ZMM || high) {
+            throw encode_error(text, mnem + " has no AVX-512 (zmm or xmm16-31) form");
+        }
+        emit_vex(out, op->map, op->pp, op->vex_w, kind - XMM, reg, vvvv, rm);
+    }
+    out.push_back(op->opcode);
+    emit_modrm(out, reg, rm);
+    if (has_imm) {
+        emit_imm8(text, out, ops.back().imm);
+    }
+    if (!evex) {
+        return NONE;
+    }
+    return AVX512F | op->evex_isa | (kind == ZMM ? NONE : AVX512VL);
+}
+
+/* vmovd/vmovq between a general purpose and an xmm register */
+AlgoFlags encode_vmov_gpr(const std::string& text, const std::string& mnem, const std::vector<Operand>& ops,
+        std::vector<uint8_t>& out) {
+    bool to_xmm = ops[0].is_vec();
+    const Operand& x = to_xmm ? ops[0] : ops[1];
+    const Operand& g = to_xmm ? ops[1] : ops[0];
+    RegKind gkind = mnem == "vmovq" ? GPR64 : GPR32;
+    if (!x.is_reg || x.kind != XMM || !g.is_reg || g.kind != gkind) {
+        throw encode_error(text, mnem + " needs an xmm and a " + (gkind == GPR64 ? "64" : "32") + "-bit register");
+    }
+    uint8_t opcode = to_xmm ? 0x6E : 0x7E;
+    bool evex = x.num >= 16;
+    if (evex) {
+        emit_evex(out, MAP_0F, PP_66, gkind == GPR64, 0, x.num, 0, g.num);
+    } else {
+        emit_vex(out, MAP_0F, PP_66, gkind == GPR64, 0, x.num, 0, g.num);
+    }
+    out.push_back(opcode);
+    emit_modrm(out, x.num, g.num);
+    return evex ? AVX512F : NONE;
+}
+
+struct AluOp {
+    const char* name;
+    /* the opcode of the r/m, reg form and the /digit of the 0x81/0x83 immediate forms */
+    uint8_t rr_opcode, imm_ext;
+};
+
+const AluOp ALU_OPS[] = {
+    {"add", 0x01, 0},
+    {"or",  0x09, 1},
+    {"and", 0x21, 4},
+    {"sub", 0x29, 5},
+    {"xor", 0x31, 6},
+    {"cmp", 0x39, 7},
+};
+
+void check_gprs(const std::string& text, const std::vector<Operand>& ops, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!ops[i].is_gpr() || ops[i].kind != ops[0].kind) {
+            throw encode_error(text, "expected 32-bit or 64-bit registers of the same size");
+        }
+    }
+}
+
+void check_imm32(const std::string& text, const Operand& op, bool is64) {
+    if (op.imm < INT32_MIN || op.imm > (is64 ? INT32_MAX : (int64_t)UINT32_MAX)) {
+        throw encode_error(text, "immediate doesn't fit in 32 bits");
+    }
+}
+
+bool fits_int8(int64_t imm) {
+    return imm >= -128 && imm <= 127;
+}
+
+void encode_gpr(const std::string& text, const std::string& mnem, const std::vector<Operand>& ops,
+        std::vector<uint8_t>& out) {
+    auto shape = [&](size_t nregs, bool imm) {
+        if (ops.size() != nregs + imm) {
+            return false;
+        }
+        for (size_t i = 0; i < ops.size(); i++) {
+            if (ops[i].is_reg != (i < nregs)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto bad = [&]() { return encode_error(text, "wrong number or kind of operands for " + mnem); };
+
+    static const char* const OTHER_OPS[] = {"mov", "imul", "inc", "dec", "shl", "shr", "sar"};
+    bool known = std::any_of(std::begin(ALU_OPS), std::end(ALU_OPS), [&](const AluOp& a) { return mnem == a.name; }) ||
+                 std::find(std::begin(OTHER_OPS), std::end(OTHER_OPS), mnem) != std::end(OTHER_OPS);
+    if (!known) {
+        throw encode_error(text, "unknown instruction " + mnem);
+    }
+    if (ops.empty() || !ops[0].is_gpr()) {
+        throw bad();
+    }
+    const bool w = ops[0].kind == GPR64;
+    const unsigned dst = ops[0].num;
+
+    for (auto& alu : ALU_OPS) {
+        if (mnem != alu.name) {
+            continue;
+        }
+        if (shape(2, false)) {
+            check_gprs(text, ops, 2);
+            emit_rex(out, w, ops[1].num, dst);
+            out.push_back(alu.rr_opcode);
+            emit_modrm(out, ops[1].num, dst);
+        } else if (shape(1, true)) {
+            check_imm32(text, ops[1], w);
+            bool short_imm = fits_int8(ops[1].imm);
+            emit_rex(out, w, 0, dst);
+            out.push_back(short_imm ? 0x83 : 0x81);
+            emit_modrm(out, alu.imm_ext, dst);
+            if (short_imm) {
+                out.push_back(ops[1].imm);
+            } else {
+                emit_imm32(out, ops[1].imm);
+            }
+        } else {
+            throw bad();
+        }
+        return;
+    }
+
+    if (mnem == "mov") {
+        if (shape(2, false)) {
+            check_gprs(text, ops, 2);
+            emit_rex(out, w, ops[1].num, dst);
+            out.push_back(0x89);
+            emit_modrm(out, ops[1].num, dst);
+        } else if (shape(1, true)) {
+            int64_t imm = ops[1].imm;
+            if (w && (imm < INT32_MIN || imm > INT32_MAX)) {
+                // movabs
+                emit_rex(out, true, 0, dst);
+                out.push_back(0xB8 + (dst & 7));
+                emit_imm32(out, imm);
+                emit_imm32(out, imm >> 32);
+            } else if (w) {
+                emit_rex(out, true, 0, dst);
+                out.push_back(0xC7);
+                emit_modrm(out, 0, dst);
+                emit_imm32(out, imm);
+            } else {
+                check_imm32(text, ops[1], false);
+                emit_rex(out, false, 0, dst);
+                out.push_back(0xB8 + (dst & 7));
+                emit_imm32(out, imm);
+            }
+        } else {
+            throw bad();
+        }
+    } else if (mnem == "imul") {
+        if (shape(2, false) || shape(2, true)) {
+            check_gprs(text, ops, 2);
+            emit_rex(out, w, dst, ops[1].num);
+            if (ops.size() == 2) {
+                out.push_back(0x0F);
+                out.push_back(0xAF);
+                emit_modrm(out, dst, ops[1].num);
+            } else {
+                check_imm32(text, ops[2], true);
+                bool short_imm = fits_int8(ops[2].imm);
+                out.push_back(short_imm ? 0x6B : 0x69);
+                emit_modrm(out, dst, ops[1].num);
+                if (short_imm) {
+                    out.push_back(ops[2].imm);
+                } else {
+                    emit_imm32(out, ops[2].imm);
+                }
+            }
+        } else {
+            throw bad();
+        }
+    } else if (mnem == "inc" || mnem == "dec") {
+        if (!shape(1, false)) {
+            throw bad();
+        }
+        emit_rex(out, w, 0, dst);
+        out.push_back(0xFF);
+        emit_modrm(out, mnem == "dec", dst);
+    } else if (mnem == "shl" || mnem == "shr" || mnem == "sar") {
+        if (!shape(1, true) || ops[1].imm < 0 || ops[1].imm > (w ? 63 : 31)) {
+            throw encode_error(text, mnem + " needs a register and a shift count");
+        }
+        emit_rex(out, w, 0, dst);
+        out.push_back(0xC1);
+        emit_modrm(out, mnem == "shl" ? 4 : mnem == "shr" ? 5 : 7, dst);
+        out.push_back(ops[1].imm);
+    }
+}
+
+std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos) {
+        return "";
+    }
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+} // namespace
+
+AlgoFlags encode_instruction(const std::string& text, std::vector<uint8_t>& out) {
+    std::string lower = trim(text);
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+    size_t split_at = lower.find_first_of(" \t");
+    std::string mnem = lower.substr(0, split_at);
+    std::vector<Operand> ops;
+    if (split_at != std::string::npos) {
+        for (auto& tok : split(lower.substr(split_at), ",")) {
+            ops.push_back(parse_operand(text, trim(tok)));
+        }
+    }
+
+    static const struct {
+        const char* name;
+        std::vector<uint8_t> bytes;
+    } FIXED[] = {
+        {"nop",        {0x90}},
+        {"pause",      {0xF3, 0x90}},
+        {"lfence",     {0x0F, 0xAE, 0xE8}},
+        {"vzeroupper", {0xC5, 0xF8, 0x77}},
+        {"vzeroall",   {0xC5, 0xFC, 0x77}},
+    };
+    for (auto& f : FIXED) {
+        if (mnem == f.name) {
+            if (!ops.empty()) {
+                throw encode_error(text, mnem + " takes no operands");
+            }
+            out.insert(out.end(), f.bytes.begin(), f.bytes.end());
+            return NONE;
+        }
+    }
+
+    if ((mnem == "vmovd" || mnem == "vmovq") && ops.size() == 2 && (ops[0].is_gpr() || ops[1].is_gpr())) {
+        return encode_vmov_gpr(text, mnem, ops, out);
+    }
+    for (auto& op : VEC_OPS) {
+        if (mnem == op.name) {
+            return encode_vec(text, mnem, ops, out);
+        }
+    }
+    encode_gpr(text, mnem, ops, out);
+    return NONE;
+}
@@ -0,0 +1,38 @@
+/*
+ * x86-encoder.hpp
+ *
+ * A small x86-64 encoder for the register-to-register instruction forms used in
+ * payloads: legacy SSE, VEX (AVX/AVX2/FMA) and EVEX (AVX-512) vector ops, plus a handful
+ * of scalar integer and misc instructions. Instructions are written in Intel syntax,
+ * destination first, e.g.:
+ *
+ *     vpord zmm0, zmm0, zmm1
+ *     vpermilps ymm2, ymm3, 0x1b
+ *     imul eax, eax, 3
+ *
+ * There are no memory operands, and no masking or embedded rounding for EVEX ops. The
+ * VEX forms are used for AVX instructions unless an operand is a zmm register or one of
+ * xmm16-31/ymm16-31, which need EVEX. Only caller-saved general purpose registers (rax,
+ * rcx, rdx, rsi, rdi and r8-r11, in any of their 32 or 64-bit names) are accepted, so
+ * encoded code can be called as a normal function.
+ */
+
+#ifndef X86_ENCODER_H_
+#define X86_ENCODER_H_
+
+#include "impl-list.hpp"
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+/**
+ * Encode the single instruction in text, appending its bytes to out. Returns the ISA
+ * extensions the instruction needs beyond AVX2: NONE, or AVX512F for an EVEX encoding,
+ * plus AVX512BW or AVX512DQ for ops that need them in their EVEX form and AVX512VL for
+ * EVEX on xmm or ymm registers. Throws std::runtime_error naming the instruction if it
+ * can't be parsed or has no encoding here.
+ */
+AlgoFlags encode_instruction(const std::string& text, std::vector<uint8_t>& out);
+
+#endif // #ifndef X86_ENCODER_H_